@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <string.h>
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "opengl.h"
+#include "CPU.h"
+#include "util.h"
+
+// Particles per cache block. All steps of a RunSteps call are applied to a
+// block before moving on, so the five arrays of a block stay in L2.
+#define CHUNK_PARTICLES 1024
+
+CPU::CPU(bool headless, int threads)
+{
+	initialized = false;
+	this->headless = headless;
+
+	pos = vel = col = pos_gen = vel_gen = 0;
+	count = 0;
+	dt = 0.0f;
+
+	threadCount = threads;
+	generation = 0;
+	pending = 0;
+	pendingSteps = 0;
+	quit = false;
+}
+
+
+CPU::~CPU(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	wake.notify_all();
+	for(size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	_mm_free(pos);
+	_mm_free(vel);
+	_mm_free(col);
+	_mm_free(pos_gen);
+	_mm_free(vel_gen);
+
+	if(!vbo_pos.empty())
+		glDeleteBuffers(1, &vbo_pos[0]);
+	if(!vbo_color.empty())
+		glDeleteBuffers(1, &vbo_color[0]);
+}
+
+bool CPU::InitializeContext()
+{
+	printf("Initializing native CPU backend...\n");
+
+	if(threadCount <= 0)
+		threadCount = (int)std::thread::hardware_concurrency();
+	if(threadCount <= 0)
+		threadCount = 1;
+
+	for(int i = 1; i < threadCount; i++)
+		workers.push_back(std::thread(WorkerMain, this, i));
+
+#ifdef __AVX__
+	printf("Using %d threads with AVX\n", threadCount);
+#else
+	printf("Using %d threads with SSE2\n", threadCount);
+#endif
+
+	initialized = true;
+	return true;
+}
+
+bool CPU::LoadProgram(const char* file)
+{
+	// The update is compiled in, there is nothing to load.
+	printf("Native CPU backend ignores \"%s\".\n", file);
+	return initialized;
+}
+
+bool CPU::LoadData(Vector4* pos, Vector4* vel, Vector4* col, int size)
+{
+	printf("Loading data...\n");
+	if(!initialized)
+	{
+		printf("Failed to load data. CPU backend not initialized. \n");
+		return false;
+	}
+
+	count = size;
+	size_t bytes = sizeof(Vector4) * size;
+	this->pos = (float*)_mm_malloc(bytes, 32);
+	this->vel = (float*)_mm_malloc(bytes, 32);
+	this->col = (float*)_mm_malloc(bytes, 32);
+	pos_gen = (float*)_mm_malloc(bytes, 32);
+	vel_gen = (float*)_mm_malloc(bytes, 32);
+	if(!this->pos || !this->vel || !this->col || !pos_gen || !vel_gen)
+	{
+		printf("Failed to allocate %u bytes of particle data.\n", (unsigned int)(5 * bytes));
+		return false;
+	}
+
+	memcpy(this->pos, pos, bytes);
+	memcpy(this->vel, vel, bytes);
+	memcpy(this->col, col, bytes);
+	memcpy(pos_gen, pos, bytes);
+	memcpy(vel_gen, vel, bytes);
+
+	if(!headless)
+	{
+		printf("Creating OpenGL buffers...\n");
+		GLuint vboPos = oglCreateVBO(pos, bytes, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+		if(!vboPos)
+		{
+			printf("Failed to create positions vbo.\n");
+			return false;
+		}
+		vbo_pos.push_back(vboPos);
+		GLuint vboColor = oglCreateVBO(col, bytes, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+		if(!vboColor)
+		{
+			printf("Failed to create colors vbo.\n");
+			return false;
+		}
+		vbo_color.push_back(vboColor);
+		vbo_count.push_back(size);
+	}
+	return true;
+}
+
+bool CPU::CreateKernel()
+{
+	if(!initialized)
+	{
+		printf("Failed to run. CPU backend not initialized.\n");
+		return false;
+	}
+
+	dt = timeStep;
+	return true;
+}
+
+bool CPU::Run(int launches)
+{
+	if(launches <= 0)
+		return true;
+	if( !RunSteps(launches * substeps) )
+		return false;
+
+	if(!headless)
+		return UploadBuffers();
+	return true;
+}
+
+bool CPU::RunSteps(int steps)
+{
+	if(!initialized || !pos)
+	{
+		printf("Failed to run. CPU backend not initialized.\n");
+		return false;
+	}
+
+	double start = get_time();
+	dt = timeStep;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		pendingSteps = steps;
+		pending = threadCount - 1;
+		generation++;
+	}
+	wake.notify_all();
+
+	UpdateSlice(0, steps);
+
+	std::unique_lock<std::mutex> guard(lock);
+	while(pending > 0)
+		done.wait(guard);
+
+	if(profiler)
+		profiler->RecordHost("updateParticles", start, get_time());
+	return true;
+}
+
+bool CPU::UploadBuffers()
+{
+	GLsizeiptr bytes = sizeof(Vector4) * count;
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_pos[0]);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, pos);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_color[0]);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, col);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	return glGetError() == GL_NO_ERROR;
+}
+
+void CPU::WorkerMain(CPU* cpu, int index)
+{
+	int seen = 0;
+	for(;;)
+	{
+		int steps;
+		{
+			std::unique_lock<std::mutex> guard(cpu->lock);
+			while(!cpu->quit && cpu->generation == seen)
+				cpu->wake.wait(guard);
+			if(cpu->quit)
+				return;
+			seen = cpu->generation;
+			steps = cpu->pendingSteps;
+		}
+
+		cpu->UpdateSlice(index, steps);
+
+		std::lock_guard<std::mutex> guard(cpu->lock);
+		if(--cpu->pending == 0)
+			cpu->done.notify_one();
+	}
+}
+
+void CPU::UpdateSlice(int index, int steps)
+{
+	// Slices start on an even particle so pairs stay 32 byte aligned.
+	int per = (count + threadCount - 1) / threadCount;
+	per = (per + 1) & ~1;
+
+	int begin = index * per;
+	int end = begin + per < count ? begin + per : count;
+
+	for(int chunk = begin; chunk < end; chunk += CHUNK_PARTICLES)
+	{
+		int chunkEnd = chunk + CHUNK_PARTICLES < end ? chunk + CHUNK_PARTICLES : end;
+		Update(chunk, chunkEnd, steps);
+	}
+}
+
+// Host version of updateParticles for particles [begin, end).
+void CPU::Update(int begin, int end, int steps)
+{
+	const float g = (float)(9.8 * dt);
+
+#ifdef __AVX__
+	const __m256 dt8 = _mm256_set1_ps(dt);
+	const __m256 zero8 = _mm256_setzero_ps();
+	const __m256 one8 = _mm256_set1_ps(1.0f);
+	const __m256 gravity8 = _mm256_setr_ps(0, 0, g, 0, 0, 0, g, 0);
+	const __m256 zstep8 = _mm256_setr_ps(0, 0, dt, 0, 0, 0, dt, 0);
+#endif
+	const __m128 dt4 = _mm_set1_ps(dt);
+	const __m128 zero4 = _mm_setzero_ps();
+	const __m128 one4 = _mm_set1_ps(1.0f);
+	const __m128 gravity4 = _mm_setr_ps(0, 0, g, 0);
+	const __m128 zstep4 = _mm_setr_ps(0, 0, dt, 0);
+	const __m128 wmask = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+
+	for(int s = 0; s < steps; s++)
+	{
+		int i = begin;
+#ifdef __AVX__
+		// Two particles per register
+		for(; i + 2 <= end; i += 2)
+		{
+			float* pp = pos + 4 * i;
+			float* vp = vel + 4 * i;
+			float* cp = col + 4 * i;
+
+			__m256 p = _mm256_load_ps(pp);
+			__m256 v = _mm256_load_ps(vp);
+
+			// life = v.w - dt, respawn where life <= 0. The compare masks
+			// select with and/andnot/or: GCC splits a blendv on them into
+			// scalar sign tests without AVX2.
+			__m256 life = _mm256_sub_ps(_mm256_permute_ps(v, 0xFF), dt8);
+			__m256 dead = _mm256_cmp_ps(life, zero8, _CMP_LE_OQ);
+			p = _mm256_or_ps(_mm256_and_ps(dead, _mm256_load_ps(pos_gen + 4 * i)), _mm256_andnot_ps(dead, p));
+			v = _mm256_or_ps(_mm256_and_ps(dead, _mm256_load_ps(vel_gen + 4 * i)), _mm256_andnot_ps(dead, v));
+			life = _mm256_or_ps(_mm256_and_ps(dead, one8), _mm256_andnot_ps(dead, life));
+
+			// Euler step on z
+			v = _mm256_sub_ps(v, gravity8);
+			p = _mm256_add_ps(p, _mm256_mul_ps(v, zstep8));
+
+			// Life goes to v.w and color.w
+			v = _mm256_blend_ps(v, life, 0x88);
+			_mm256_store_ps(pp, p);
+			_mm256_store_ps(vp, v);
+			_mm256_store_ps(cp, _mm256_blend_ps(_mm256_load_ps(cp), life, 0x88));
+		}
+#endif
+		// One particle per register, blends done with and/andnot/or
+		for(; i < end; i++)
+		{
+			float* pp = pos + 4 * i;
+			float* vp = vel + 4 * i;
+			float* cp = col + 4 * i;
+
+			__m128 p = _mm_load_ps(pp);
+			__m128 v = _mm_load_ps(vp);
+
+			__m128 life = _mm_sub_ps(_mm_shuffle_ps(v, v, 0xFF), dt4);
+			__m128 dead = _mm_cmple_ps(life, zero4);
+			p = _mm_or_ps(_mm_and_ps(dead, _mm_load_ps(pos_gen + 4 * i)), _mm_andnot_ps(dead, p));
+			v = _mm_or_ps(_mm_and_ps(dead, _mm_load_ps(vel_gen + 4 * i)), _mm_andnot_ps(dead, v));
+			life = _mm_or_ps(_mm_and_ps(dead, one4), _mm_andnot_ps(dead, life));
+
+			v = _mm_sub_ps(v, gravity4);
+			p = _mm_add_ps(p, _mm_mul_ps(v, zstep4));
+
+			v = _mm_or_ps(_mm_and_ps(wmask, life), _mm_andnot_ps(wmask, v));
+			_mm_store_ps(pp, p);
+			_mm_store_ps(vp, v);
+			__m128 c = _mm_load_ps(cp);
+			_mm_store_ps(cp, _mm_or_ps(_mm_and_ps(wmask, life), _mm_andnot_ps(wmask, c)));
+		}
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Engine.h"
+
+// Native host implementation of updateParticles from particles.cl. Particles
+// are split over a pool of worker threads and updated with SSE/AVX, with the
+// respawn done as a masked blend instead of a branch.
+class CPU : public Engine
+{
+public:
+	// threads = 0 uses one thread per hardware thread.
+	CPU(bool headless = false, int threads = 0);
+	~CPU(void);
+
+	bool InitializeContext();
+	bool LoadProgram(const char* file);
+	bool LoadData(Vector4* pos, Vector4* vel, Vector4* col, int size);
+	bool CreateKernel();
+	bool Run(int launches = 1);
+	bool RunSteps(int steps);
+	// Every block runs all steps of a RunSteps() call while it stays in
+	// cache, so memory sees one pass per call, shared by its steps.
+	double BytesPerParticleStep()
+	{
+		return Engine::BytesPerParticleStep() / (pendingSteps > 1 ? pendingSteps : 1);
+	}
+
+	bool initialized;
+	bool headless;
+
+private:
+	static void WorkerMain(CPU* cpu, int index);
+	void Update(int begin, int end, int steps);
+	void UpdateSlice(int index, int steps);
+	bool UploadBuffers();
+
+	// Particle state, 4 floats per particle, 32 byte aligned.
+	float* pos;
+	float* vel;
+	float* col;
+	float* pos_gen;
+	float* vel_gen;
+	int count;
+	float dt;
+
+	// Thread pool. Worker i handles slice i, the calling thread slice 0.
+	int threadCount;
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake, done;
+	int generation;
+	int pending;
+	int pendingSteps;
+	bool quit;
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+#include "opengl.h"
+#include "Profiler.h"
+
+typedef float Vector4[4];
+
+// Common interface of the simulation backends so main.cpp does not care
+// which one is running. Unless headless, an engine exposes its positions and
+// colors after every Run() as one or more VBO pairs, pair i holding
+// vbo_count[i] particles.
+class Engine
+{
+public:
+	Engine(void)
+	{
+		profiler = NULL;
+		substeps = 1;
+		timeStep = 0.01f;
+		vbo_pos_type = vbo_color_type = GL_FLOAT;
+		for(int i = 0; i < 3; i++)
+		{
+			vbo_offset[i] = 0.0f;
+			vbo_scale[i] = 1.0f;
+		}
+	}
+	virtual ~Engine(void) {}
+
+	virtual bool InitializeContext() = 0;
+	virtual bool LoadProgram(const char* file) = 0;
+	virtual bool LoadData(Vector4* pos, Vector4* vel, Vector4* col, int size) = 0;
+	virtual bool CreateKernel() = 0;
+	// Advances the simulation by launches times substeps steps of dt and
+	// makes the result drawable. Nothing happens for 0 launches.
+	virtual bool Run(int launches = 1) = 0;
+	// Advances by steps steps of dt, rounded up to whole launches of
+	// substeps where the engine fuses them.
+	virtual bool RunSteps(int steps) = 0;
+	// Blocks until the buffers of the last Run() may be drawn.
+	virtual bool WaitForFrame() { return true; }
+	// Global memory traffic of one particle update, for bandwidth figures.
+	// updateParticles reads and writes pos and vel and writes color.w, the
+	// respawn reads of a few percent of the particles are left out. 0 when
+	// the traffic is not known. Engines fusing steps count the last
+	// RunSteps() call's.
+	virtual double BytesPerParticleStep() { return 68.0; }
+	// True when LoadData() takes NULL arrays because the engine generates
+	// the initial particles itself. Valid after LoadProgram().
+	virtual bool SpawnsParticles() { return false; }
+
+	std::vector<GLuint> vbo_pos, vbo_color;
+	std::vector<int> vbo_count;
+	// When set, pair i draws the vbo_count[i] particles listed in element
+	// buffer vbo_index[i] instead.
+	std::vector<GLuint> vbo_index;
+	// Four components of vbo_pos_type and vbo_color_type per particle.
+	// Positions are drawn scaled by vbo_scale, then moved by vbo_offset,
+	// which only matters for fixed point positions.
+	GLenum vbo_pos_type, vbo_color_type;
+	float vbo_offset[3], vbo_scale[3];
+
+	// Steps integrated per launch while the particle stays in registers.
+	// Set before LoadProgram().
+	int substeps;
+	// Simulated seconds per step, dt. Changes take effect at the next launch.
+	float timeStep;
+
+	// Stage timings are recorded here when set before InitializeContext().
+	Profiler* profiler;
+};
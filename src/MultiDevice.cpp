@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "opengl.h"
+#include "MultiDevice.h"
+#include "util.h"
+
+MultiDevice::MultiDevice(bool headless)
+{
+	initialized = false;
+	this->headless = headless;
+	deviceType = CL_DEVICE_TYPE_ALL;
+	procedural = false;
+	integrator = INTEGRATOR_EULER;
+	fission = FISSION_NONE;
+	fissionUnits = 0;
+	balanceInterval = 16;
+	balanceThreshold = 0.02f;
+	runs = 0;
+	pos = vel = col = posGen = velGen = NULL;
+	count = 0;
+}
+
+
+MultiDevice::~MultiDevice(void)
+{
+	for(size_t i = 0; i < engines.size(); i++)
+		delete engines[i];
+	aligned_free(pos);
+	aligned_free(vel);
+	aligned_free(col);
+	aligned_free(posGen);
+	aligned_free(velGen);
+
+	if(!vbo_pos.empty())
+		glDeleteBuffers(1, &vbo_pos[0]);
+	if(!vbo_color.empty())
+		glDeleteBuffers(1, &vbo_color[0]);
+}
+
+// One headless engine per device of deviceType that takes a context and a
+// queue, the others are skipped.
+bool MultiDevice::InitializeContext()
+{
+	printf("Looking for OpenCL devices...\n");
+	cl_uint platformCount = 0;
+	if(clGetPlatformIDs(0, NULL, &platformCount) != CL_SUCCESS)
+		platformCount = 0;
+
+	for(cl_uint p = 0; p < platformCount; p++)
+	{
+		cl_platform_id platform;
+		cl_uint deviceCount = 0;
+		if( !oclGetPlatformByIndex(&platform, p) ||
+			clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount) != CL_SUCCESS )
+			continue;
+
+		for(cl_uint d = 0; d < deviceCount; d++)
+		{
+			cl_device_id id;
+			cl_device_type type = 0;
+			if( !oclGetDeviceByIndex(&id, platform, d) )
+				continue;
+			clGetDeviceInfo(id, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+			if(!(type & deviceType))
+				continue;
+
+			OCL* ocl = new OCL(true);
+			ocl->platformIndex = p;
+			ocl->deviceIndex = d;
+			ocl->profiler = profiler;
+			ocl->profilerDevice = (int)engines.size();
+			ocl->profileQueue = true;
+			ocl->fission = fission;
+			ocl->fissionUnits = fissionUnits;
+			if( !ocl->InitializeContext() )
+			{
+				printf("Skipping device %u of platform %u.\n", d, p);
+				delete ocl;
+				continue;
+			}
+			engines.push_back(ocl);
+
+			// A sub-device only has some of the compute units
+			cl_uint units = 1, clock = 1;
+			clGetDeviceInfo(ocl->DeviceId(), CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+			clGetDeviceInfo(id, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock), &clock, NULL);
+			weights.push_back(units > 0 && clock > 0 ? (double)units * clock : 1.0);
+		}
+	}
+
+	if(engines.empty())
+	{
+		printf("No usable OpenCL device found.\n");
+		return false;
+	}
+	printf("Using %u OpenCL devices\n", (unsigned int)engines.size());
+	initialized = true;
+	return true;
+}
+
+bool MultiDevice::LoadProgram(const char* file)
+{
+	if(!initialized)
+	{
+		printf("Failed to load program. No devices initialized.\n");
+		return false;
+	}
+	for(size_t i = 0; i < engines.size(); i++)
+	{
+		OCL* e = engines[i];
+		e->layout = LAYOUT_AOS;
+		e->procedural = procedural;
+		e->integrator = integrator;
+		e->substeps = substeps;
+		e->timeStep = timeStep;
+		if( !e->LoadProgram(file) )
+			return false;
+	}
+	return true;
+}
+
+// Every device gets at least a hundredth of its fair share, so a slow
+// one's speed keeps being measured, and the rest goes by weight.
+bool MultiDevice::Split(const std::vector<double>& weights, std::vector<size_t>& begin)
+{
+	size_t n = engines.size();
+	size_t minimum = count / (100 * n) > 0 ? count / (100 * n) : 1;
+	size_t rest = count - minimum * n;
+	double total = 0.0;
+	for(size_t i = 0; i < n; i++)
+		total += weights[i];
+	if(total <= 0.0)
+		return false;
+
+	begin.assign(n + 1, 0);
+	double sum = 0.0;
+	for(size_t i = 0; i < n; i++)
+	{
+		sum += weights[i];
+		begin[i + 1] = minimum * (i + 1) + (i + 1 == n ? rest : (size_t)(rest * (sum / total)));
+	}
+	return true;
+}
+
+bool MultiDevice::LoadData(Vector4* pos, Vector4* vel, Vector4* col, int size)
+{
+	printf("Loading data...\n");
+	if(!initialized || !pos || size <= 0)
+	{
+		printf("Failed to load data. No devices or no initial particles.\n");
+		return false;
+	}
+
+	// Every device needs at least one particle
+	while(engines.size() > (size_t)size)
+	{
+		delete engines.back();
+		engines.pop_back();
+		weights.pop_back();
+	}
+
+	count = size;
+	size_t bytes = sizeof(Vector4) * size;
+	this->pos = (Vector4*)aligned_malloc(bytes, 64);
+	this->vel = (Vector4*)aligned_malloc(bytes, 64);
+	this->col = (Vector4*)aligned_malloc(bytes, 64);
+	posGen = (Vector4*)aligned_malloc(bytes, 64);
+	velGen = (Vector4*)aligned_malloc(bytes, 64);
+	if(!this->pos || !this->vel || !this->col || !posGen || !velGen)
+	{
+		printf("Failed to allocate %u bytes of particle data.\n", (unsigned int)(5 * bytes));
+		return false;
+	}
+	memcpy(this->pos, pos, bytes);
+	memcpy(this->vel, vel, bytes);
+	memcpy(this->col, col, bytes);
+	memcpy(posGen, pos, bytes);
+	memcpy(velGen, vel, bytes);
+
+	if( !Split(weights, begin) )
+		return false;
+	for(size_t i = 0; i < engines.size(); i++)
+	{
+		engines[i]->indexBase = begin[i];
+		printf("Device %u: particles %u to %u\n", (unsigned int)i, (unsigned int)begin[i], (unsigned int)begin[i + 1]);
+		if( !engines[i]->LoadData(pos + begin[i], vel + begin[i], col + begin[i], (int)(begin[i + 1] - begin[i])) )
+			return false;
+	}
+	busy.assign(engines.size(), 0.0);
+	work.assign(engines.size(), 0.0);
+
+	if(!headless)
+	{
+		printf("Creating OpenGL buffers...\n");
+		GLuint vboPos = oglCreateVBO(pos, bytes, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+		if(!vboPos)
+		{
+			printf("Failed to create positions vbo.\n");
+			return false;
+		}
+		vbo_pos.push_back(vboPos);
+		GLuint vboColor = oglCreateVBO(col, bytes, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+		if(!vboColor)
+		{
+			printf("Failed to create colors vbo.\n");
+			return false;
+		}
+		vbo_color.push_back(vboColor);
+		vbo_count.push_back(size);
+	}
+	return true;
+}
+
+bool MultiDevice::CreateKernel()
+{
+	for(size_t i = 0; i < engines.size(); i++)
+		if( !engines[i]->CreateKernel() )
+			return false;
+	return initialized;
+}
+
+bool MultiDevice::Run(int launches)
+{
+	if(launches <= 0)
+		return true;
+	if( !RunSteps(launches * substeps) )
+		return false;
+	if(headless)
+		return true;
+
+	for(size_t i = 0; i < engines.size(); i++)
+		if( !engines[i]->ReadParticles(pos + begin[i], vel + begin[i], col + begin[i]) )
+			return false;
+	return UploadBuffers();
+}
+
+// Device seconds from the marker begin to the end of the launch end, or
+// -1 without profiling timestamps.
+static double DeviceSeconds(cl_event begin, cl_event end)
+{
+	cl_ulong start = 0, finish = 0;
+	if(!begin || !end ||
+		clGetEventProfilingInfo(begin, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+		clGetEventProfilingInfo(end, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &finish, NULL) != CL_SUCCESS ||
+		finish < start)
+		return -1.0;
+	return (finish - start) * 1e-9;
+}
+
+// All devices run at once. Every device is timed on its own clock, from a
+// marker queued ahead of its launches to the end of the last one, which is
+// what the next split goes by. The host just blocks on each in turn.
+bool MultiDevice::RunSteps(int steps)
+{
+	size_t n = engines.size();
+	int launches = (steps + substeps - 1) / substeps;
+	std::vector<cl_event> starts(n, (cl_event)0), events(n, (cl_event)0);
+	bool ok = true;
+
+	for(size_t i = 0; i < n && ok; i++)
+	{
+		engines[i]->timeStep = timeStep;
+		ok = engines[i]->Enqueue(launches, &events[i], &starts[i]);
+	}
+
+	for(size_t i = 0; i < n; i++)
+	{
+		engines[i]->Finish();
+		// Runs without timestamps leave the weights alone
+		double seconds = ok ? DeviceSeconds(starts[i], events[i]) : -1.0;
+		if(seconds > 0.0)
+		{
+			busy[i] += seconds;
+			work[i] += (double)launches * substeps * (begin[i + 1] - begin[i]);
+		}
+		if(starts[i])
+			clReleaseEvent(starts[i]);
+		if(events[i])
+			clReleaseEvent(events[i]);
+	}
+	if(!ok)
+		return false;
+
+	if(balanceInterval > 0 && ++runs % balanceInterval == 0)
+		return Rebalance();
+	return true;
+}
+
+// New weights are the particle steps per second every device managed since
+// the last split. Moving particles costs a read back and an upload of every
+// range, so small changes are left alone.
+bool MultiDevice::Rebalance()
+{
+	size_t n = engines.size();
+	for(size_t i = 0; i < n; i++)
+	{
+		if(busy[i] > 0.0 && work[i] > 0.0)
+			weights[i] = work[i] / busy[i];
+		busy[i] = work[i] = 0.0;
+	}
+
+	std::vector<size_t> target;
+	if( !Split(weights, target) )
+		return true;
+	size_t moved = 0;
+	for(size_t i = 1; i < n; i++)
+	{
+		size_t change = target[i] > begin[i] ? target[i] - begin[i] : begin[i] - target[i];
+		if(change > moved)
+			moved = change;
+	}
+	if(moved <= balanceThreshold * count)
+		return true;
+
+	printf("Rebalancing particles:");
+	for(size_t i = 0; i < n; i++)
+		printf(" %u", (unsigned int)(target[i + 1] - target[i]));
+	printf("\n");
+
+	for(size_t i = 0; i < n; i++)
+		if( !engines[i]->ReadParticles(pos + begin[i], vel + begin[i], col + begin[i]) )
+			return false;
+	begin = target;
+	for(size_t i = 0; i < n; i++)
+	{
+		size_t b = begin[i];
+		engines[i]->indexBase = b;
+		if( !engines[i]->ReloadData(pos + b, vel + b, col + b, posGen + b, velGen + b, (int)(begin[i + 1] - b)) )
+			return false;
+	}
+	return true;
+}
+
+bool MultiDevice::UploadBuffers()
+{
+	GLsizeiptr bytes = sizeof(Vector4) * count;
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_pos[0]);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, pos);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_color[0]);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, col);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	return glGetError() == GL_NO_ERROR;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+#include <CL/cl.h>
+#include "Engine.h"
+#include "OCL.h"
+
+// Runs the fountain on every usable OpenCL device of every platform at
+// once. Each device gets a headless OCL engine with its own context, queue
+// and a contiguous range of the particles. The ranges follow the devices'
+// measured throughput: every balanceInterval runs they are re-split and the
+// particles moved between devices through the host. Unless headless the
+// ranges are read back into one VBO pair for drawing, like the CPU backend.
+class MultiDevice : public Engine
+{
+public:
+	MultiDevice(bool headless = false);
+	~MultiDevice(void);
+
+	bool InitializeContext();
+	bool LoadProgram(const char* file);
+	bool LoadData(Vector4* pos, Vector4* vel, Vector4* col, int size);
+	bool CreateKernel();
+	bool Run(int launches = 1);
+	bool RunSteps(int steps);
+
+	bool initialized;
+	bool headless;
+	// Devices to use, CL_DEVICE_TYPE_ALL by default.
+	cl_device_type deviceType;
+	// Passed on to every device's engine, set before LoadProgram(). They
+	// all use the AoS float layout.
+	bool procedural;
+	ParticleIntegrator integrator;
+	// Passed on to every engine before InitializeContext(), only partitions
+	// CPU devices.
+	DeviceFission fission;
+	cl_uint fissionUnits;
+	// Runs between re-splits, 0 keeps the first split. A re-split only
+	// moves particles when some range changes by more than balanceThreshold
+	// of all particles.
+	int balanceInterval;
+	float balanceThreshold;
+
+	std::vector<OCL*> engines;
+
+private:
+	bool Split(const std::vector<double>& weights, std::vector<size_t>& begin);
+	bool Rebalance();
+	bool UploadBuffers();
+
+	// engines[i] holds particles [begin[i], begin[i + 1])
+	std::vector<size_t> begin;
+	// Relative speed of every device, first from its compute units and
+	// clock, then measured as particle steps per second
+	std::vector<double> weights;
+	// Device seconds every device's launches took and the particle steps
+	// they ran since the last re-split
+	std::vector<double> busy;
+	std::vector<double> work;
+	int runs;
+
+	// Host copies for moving particles and drawing: the state as of the
+	// last read back and the respawn state
+	Vector4* pos;
+	Vector4* vel;
+	Vector4* col;
+	Vector4* posGen;
+	Vector4* velGen;
+	int count;
+};
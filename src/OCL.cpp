@@ -1,27 +1,108 @@
 #include <stdio.h>
+#include <string.h>
 #include <malloc.h>
+#include <math.h>
+#include <limits.h>
 
 #include "opengl.h"
 #include "OCL.h"
 #include "util.h"
+#include "scene.h"
 #include <CL/cl.h>
 #include <CL/cl_gl.h>
 
-OCL::OCL(void)
+// OpenCL 1.1, missing from the 1.0 headers
+#ifndef CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE
+#define CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE 0x11B3
+#endif
+
+// OpenCL 1.2 device fission
+#ifndef CL_DEVICE_PARTITION_EQUALLY
+#define CL_DEVICE_PARTITION_EQUALLY 0x1086
+#define CL_DEVICE_PARTITION_BY_COUNTS 0x1087
+#define CL_DEVICE_PARTITION_BY_COUNTS_LIST_END 0x0
+#define CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN 0x1088
+#define CL_DEVICE_AFFINITY_DOMAIN_NUMA (1 << 0)
+#endif
+
+OCL::OCL(bool headless)
 {
 	initialized = false;
+	this->headless = headless;
 	platformId = 0;
 	deviceId = 0;
+	parentDeviceId = 0;
+	fission = FISSION_NONE;
+	fissionUnits = 0;
 	context = 0;
 	commandQueue = 0;
 	program = 0;
+	kernel = 0;
+	unpackKernel = 0;
+	dtArg = 5;
+	kernelTimeStep = 0.0f;
 	
-	buffersSize = 0;
+	particleCount = 0;
+	maxChunkParticles = 0;
+	platformIndex = deviceIndex = -1;
+	profilerDevice = 0;
+	profileQueue = false;
+	indexBase = 0;
+	localWorkSize = 0;
+	autotune = false;
+	compact = false;
+	procedural = false;
+	lifecycle = false;
+	emitCount = -1;
+	emitBurst = 1;
+	aliveList = 0;
+	beginKernel = emitKernel = 0;
+	grid = false;
+	cellSize = 0.02f;
+	hashSize = 0;
+	primitives = NULL;
+	nbody = false;
+	gravity = 1.0f;
+	softening = 0.01f;
+	moveKernel = 0;
+	bodyMass = 0;
+	barnesHut = false;
+	theta = 0.5f;
+	mortonBits = 30;
+	for(int i = 0; i < TREE_KERNELS; i++)
+		treeKernels[i] = 0;
+	boundsMin = boundsMax = mortonKeys = bodyOrder = 0;
+	nodeLeft = nodeRight = nodeParent = nodeVisits = nodeCom = nodeMin = nodeMax = 0;
+	sph = false;
+	sphSpacing = 0.0f;
+	sphRestDensity = 998.0f;
+	sphStiffness = 10.0f;
+	sphViscosity = 3.5f;
+	reorderKernel = densityKernel = 0;
+	sortedPos = sortedVel = fluidState = 0;
+	fluidPasses = 1;
+	restitution = 0.5f;
+	trajectory = NULL;
+	trajectoryLaunches = 0;
+	collider = 0;
+	colliderScale = 1.0f;
+	for(int i = 0; i < 4; i++)
+		colliderOrigin[i] = 0.0f;
+	for(int i = 0; i < GRID_KERNELS; i++)
+		gridKernels[i] = 0;
+	cellStart = cellEnd = particleCell = particleRank = sortedIndex = 0;
+	stepCount = 0;
+	spawnArg = 7;
+	posSize = velSize = colorSize = sizeof(Vector4);
+	layout = LAYOUT_AOS;
+	aosoaWidth = 16;
+	integrator = INTEGRATOR_EULER;
+	tuneFile = "worksizes.txt";
 
-	cl_static_pos = cl_static_vel = 0;
-
-	cl_velocities = 0;
-	vbo_pos = vbo_color = 0;
+	pipelined = false;
+	binaryCache = true;
+	glEventSupported = false;
+	runEvents[0] = runEvents[1] = runEvents[2] = 0;
 }
 
 
@@ -29,6 +110,20 @@ OCL::~OCL(void)
 {
 	if(initialized)
 	{
+		// The writer has to be done with the pinned buffers
+		if(trajectory)
+			trajectory->Close();
+		for(size_t i = 0; i < trajectoryBuffers.size(); i++)
+		{
+			if(trajectory && i < trajectory->slots.size())
+				clEnqueueUnmapMemObject(commandQueue, trajectoryBuffers[i], trajectory->slots[i], 0, NULL, NULL);
+			clReleaseMemObject(trajectoryBuffers[i]);
+		}
+		if(commandQueue)
+			clFinish(commandQueue);
+		for(size_t i = 0; i < liveCountReads.size(); i++)
+			for(size_t j = 0; j < liveCountReads[i].size(); j++)
+				clReleaseEvent(liveCountReads[i][j].done);
 		if(context)
 			clReleaseContext(context);
 		if(commandQueue)
@@ -37,17 +132,46 @@ OCL::~OCL(void)
 			clReleaseProgram(program);
 		if(kernel)
 			clReleaseKernel(kernel);
-		if(cl_static_pos)
-			clReleaseMemObject(cl_static_pos);
-		if(cl_static_vel)
-			clReleaseMemObject(cl_static_vel);
-		if(cl_velocities)
-			clReleaseMemObject(cl_velocities);
-		if(vbo_pos)
-			glDeleteBuffers(1, &vbo_pos);
-		if(vbo_color)
-			glDeleteBuffers(1, &vbo_pos);
+		if(unpackKernel)
+			clReleaseKernel(unpackKernel);
+		if(beginKernel)
+			clReleaseKernel(beginKernel);
+		if(emitKernel)
+			clReleaseKernel(emitKernel);
+		for(int i = 0; i < GRID_KERNELS; i++)
+			if(gridKernels[i])
+				clReleaseKernel(gridKernels[i]);
+		cl_mem gridBuffers[] = { cellStart, cellEnd, particleCell, particleRank, sortedIndex };
+		for(int i = 0; i < 5; i++)
+			if(gridBuffers[i])
+				clReleaseMemObject(gridBuffers[i]);
+		delete primitives;
+		if(moveKernel)
+			clReleaseKernel(moveKernel);
+		for(int i = 0; i < TREE_KERNELS; i++)
+			if(treeKernels[i])
+				clReleaseKernel(treeKernels[i]);
+		if(reorderKernel)
+			clReleaseKernel(reorderKernel);
+		if(densityKernel)
+			clReleaseKernel(densityKernel);
+		cl_mem bodyBuffers[] = { bodyMass, boundsMin, boundsMax, mortonKeys, bodyOrder,
+			nodeLeft, nodeRight, nodeParent, nodeVisits, nodeCom, nodeMin, nodeMax,
+			sortedPos, sortedVel, fluidState, collider };
+		for(int i = 0; i < 16; i++)
+			if(bodyBuffers[i])
+				clReleaseMemObject(bodyBuffers[i]);
+		ReleaseChunks();
+		ReleaseRunEvents();
+		for(size_t i = 0; i < trackedEvents.size(); i++)
+			clReleaseEvent(trackedEvents[i]);
+		if(!vbo_pos.empty())
+			glDeleteBuffers((GLsizei)vbo_pos.size(), &vbo_pos[0]);
+		if(!vbo_color.empty())
+			glDeleteBuffers((GLsizei)vbo_color.size(), &vbo_color[0]);
 	}
+	if(parentDeviceId)
+		oclReleaseSubDevice(deviceId);
 }
 
 bool OCL::InitializeContext()
@@ -55,7 +179,7 @@ bool OCL::InitializeContext()
 	cl_int error;
 	printf("Initializing OpenCL context...\n");
 
-	if( !oclGetNVIDIAPlatform(&platformId) )
+	if(platformIndex >= 0 ? !oclGetPlatformByIndex(&platformId, platformIndex) : !oclGetNVIDIAPlatform(&platformId))
 	{
 		printf("Failed to get a platform\n");
 		return false;
@@ -63,22 +187,52 @@ bool OCL::InitializeContext()
 	printf("Got platform...\n");
 	oclPrintPlatformInfo(platformId);
 
-	if( !oclGetSomeGPUDevice(&deviceId, platformId) )
+	if(deviceIndex >= 0)
 	{
-		printf("Failed to get a GPU device\n");
-		return false;
+		if( !oclGetDeviceByIndex(&deviceId, platformId, deviceIndex) )
+		{
+			printf("Failed to get device %d\n", deviceIndex);
+			return false;
+		}
+		printf("Got device %d...\n", deviceIndex);
+	}
+	else if(headless)
+	{
+		// Any device will do (e.g. a CPU only runtime on a batch node)
+		if( !oclGetSomeDevice(&deviceId, platformId) )
+		{
+			printf("Failed to get a device\n");
+			return false;
+		}
+		printf("Got device...\n");
+	}
+	else
+	{
+		if( !oclGetSomeGPUDevice(&deviceId, platformId) )
+		{
+			printf("Failed to get a GPU device\n");
+			return false;
+		}
+		printf("Got GPU device...\n");
 	}
-	printf("Got GPU device...\n");
 	oclPrintDeviceInfo(deviceId);
 
-	if( !oclCreateSomeContext(&context, deviceId, platformId) )
+	if(fission != FISSION_NONE && !CreateSubDevice())
+		printf("Running on the whole device\n");
+
+	// With cl_khr_gl_event acquire/release synchronize with GL implicitly.
+	glEventSupported = !headless && oclDeviceHasExtension(deviceId, "cl_khr_gl_event");
+
+	if( !oclCreateSomeContext(&context, deviceId, platformId, !headless) )
 	{
 		printf("Failed to create cl context\n");
 		return false;
 	}
 	printf("Created cl context\n");
 
-	commandQueue = clCreateCommandQueue(context,deviceId,NULL, &error);
+	// Profiling timestamps are only recorded when asked for.
+	cl_command_queue_properties properties = profiler || profileQueue ? CL_QUEUE_PROFILING_ENABLE : 0;
+	commandQueue = clCreateCommandQueue(context,deviceId,properties, &error);
 	if(error != CL_SUCCESS)
 	{
 		clReleaseContext(context);
@@ -91,6 +245,54 @@ bool OCL::InitializeContext()
 	return true;
 }
 
+bool OCL::CreateSubDevice()
+{
+	cl_device_type type = 0;
+	cl_uint units = 0;
+	clGetDeviceInfo(deviceId, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+	clGetDeviceInfo(deviceId, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+	if(!(type & CL_DEVICE_TYPE_CPU))
+	{
+		printf("Device fission is only used on CPU devices\n");
+		return false;
+	}
+
+	// Leave one core for the GL thread and output by default
+	cl_uint count = fissionUnits > 0 ? fissionUnits : units - 1;
+	if(fission != FISSION_BY_NUMA && (count == 0 || count >= units))
+	{
+		printf("Can't partition %u compute units into sub-devices of %u\n", units, count);
+		return false;
+	}
+
+	intptr_t properties[4] = { 0, 0, 0, 0 };
+	switch(fission)
+	{
+	case FISSION_EQUALLY:
+		properties[0] = CL_DEVICE_PARTITION_EQUALLY;
+		properties[1] = count;
+		break;
+	case FISSION_BY_COUNTS:
+		properties[0] = CL_DEVICE_PARTITION_BY_COUNTS;
+		properties[1] = count;
+		properties[2] = CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+		break;
+	default:
+		properties[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+		properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+		break;
+	}
+
+	cl_device_id subDevice;
+	if(!oclCreateSubDevice(&subDevice, deviceId, properties))
+		return false;
+	parentDeviceId = deviceId;
+	deviceId = subDevice;
+	clGetDeviceInfo(deviceId, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+	printf("Running on a sub-device of %u compute units\n", units);
+	return true;
+}
+
 bool OCL::LoadProgram(const char* file)
 {
 	printf("Loading OpenCL program...\n");
@@ -103,6 +305,58 @@ bool OCL::LoadProgram(const char* file)
 		printf("Failed to load program. OpenCL context not initialized.\n");
 		return false;
 	}
+	if(compact && layout != LAYOUT_AOS)
+	{
+		printf("Compact storage is only available with the AoS layout, using AoS.\n");
+		layout = LAYOUT_AOS;
+	}
+	if(grid && (compact || layout != LAYOUT_AOS))
+	{
+		printf("The neighbor grid needs the AoS float layout, using it.\n");
+		layout = LAYOUT_AOS;
+		compact = false;
+	}
+	if(sph)
+	{
+		if(nbody || lifecycle || procedural || compact || layout != LAYOUT_AOS)
+			printf("SPH runs on the AoS float layout without bodies or respawns, using it.\n");
+		grid = true;
+		nbody = barnesHut = lifecycle = procedural = compact = false;
+		layout = LAYOUT_AOS;
+	}
+	if(barnesHut)
+	{
+		nbody = true;
+		mortonBits = mortonBits > 32 ? 63 : 30;
+	}
+	if(nbody && (compact || layout != LAYOUT_AOS || lifecycle || procedural))
+	{
+		printf("N-body gravity needs the AoS float layout without respawns, using it.\n");
+		layout = LAYOUT_AOS;
+		compact = lifecycle = procedural = false;
+	}
+	if(integrator != INTEGRATOR_EULER && (nbody || sph))
+		printf("N-body and SPH keep their own integrators.\n");
+	if(!colliderFile.empty() && (nbody || sph))
+	{
+		printf("SDF colliders only act on the fountain, ignoring \"%s\".\n", colliderFile.c_str());
+		colliderFile.clear();
+	}
+	if(!colliderFile.empty() && (compact || layout != LAYOUT_AOS))
+	{
+		printf("SDF colliders need the AoS float layout, using it.\n");
+		layout = LAYOUT_AOS;
+		compact = false;
+	}
+	if(lifecycle)
+	{
+		if(compact || layout != LAYOUT_AOS)
+			printf("Particle lifecycles need the AoS float layout, using it.\n");
+		layout = LAYOUT_AOS;
+		compact = false;
+		// Emitters spawn from the device RNG
+		procedural = true;
+	}
 
 	if(length <= 0)
 	{
@@ -112,6 +366,34 @@ bool OCL::LoadProgram(const char* file)
 		return false;
 	}
 
+	// primitives.cl lives next to the particle program
+	if(grid || barnesHut)
+	{
+		std::string path = file;
+		size_t slash = path.find_last_of("/\\");
+		path = (slash == std::string::npos ? std::string() : path.substr(0, slash + 1)) + "primitives.cl";
+		primitives = new Primitives(context, deviceId, commandQueue);
+		primitives->profiling = profiler != NULL;
+		primitives->binaryCache = binaryCache;
+		if( !primitives->Load(path.c_str()) )
+		{
+			free(read);
+			return false;
+		}
+	}
+
+	std::string cacheFile;
+	unsigned long long key = 0;
+	if(binaryCache)
+	{
+		key = oclProgramCacheKey(deviceId, file, ProgramOptions().c_str(), read, length, cacheFile);
+		if( LoadCachedProgram(cacheFile.c_str(), key) )
+		{
+			free(read);
+			return true;
+		}
+	}
+
 	program = clCreateProgramWithSource(context,1,(const char**)&read, (size_t*)&length, &error);
 	if(error != CL_SUCCESS)
 	{
@@ -129,223 +411,2068 @@ bool OCL::LoadProgram(const char* file)
 
 	free(read);
 
+	if(binaryCache)
+		oclSaveProgramBinary(program, cacheFile.c_str(), key);
+
+	return true;
+}
+
+bool OCL::LoadCachedProgram(const char* file, unsigned long long key)
+{
+	program = oclLoadProgramBinary(context, deviceId, file, key);
+	if(!program)
+		return false;
+	if(!BuildExecutable())
+	{
+		printf("Cached program binary rejected, rebuilding from source.\n");
+		clReleaseProgram(program);
+		program = 0;
+		remove(file);
+		return false;
+	}
 	return true;
 }
 
 bool OCL::LoadData(Vector4* pos, Vector4* vel, Vector4* col, int size)
 {
-	cl_int error;
 	printf("Loading data...\n");
 	if(!initialized)
 	{
 		printf("Failed to load data. OpenCL context not initialized. \n");
 		return false;
 	}
-	buffersSize = sizeof(Vector4) * size;
-	printf("Sizeof(Vector4) = %d\n", sizeof(Vector4));
+	printf("Sizeof(Vector4) = %d\n", (int)sizeof(Vector4));
 
-	printf("Creating OpenGL buffers...\n");
-	vbo_pos = oglCreateVBO(pos, buffersSize, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
-	if(!vbo_pos)
+	// Every buffer of a chunk has to fit in a single allocation.
+	cl_ulong maxAllocSize;
+	clGetDeviceInfo(deviceId, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocSize), &maxAllocSize, NULL);
+	size_t chunkParticles = (size_t)(maxAllocSize / sizeof(Vector4));
+	if(maxChunkParticles > 0 && maxChunkParticles < chunkParticles)
+		chunkParticles = maxChunkParticles;
+
+	if(!pos && !SpawnsParticles())
 	{
-		printf("Failed to create positions vbo.\n");
+		printf("Failed to load data. No initial particles given.\n");
 		return false;
 	}
-	vbo_color = oglCreateVBO(col, buffersSize, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
-	if(!vbo_color)
+
+	particleCount = size;
+	if(compact)
 	{
-		printf("Failed to create colors vbo.\n");
-		return false;
+		posSize = velSize = 4 * sizeof(cl_short);
+		colorSize = 4 * sizeof(cl_uchar);
+		vbo_pos_type = GL_SHORT;
+		vbo_color_type = GL_UNSIGNED_BYTE;
+		ComputeBounds(pos, vel, size);
 	}
-	glFinish(); // Wait for gl opperations to finish.
+	// Shared chunks are also VBOs, which GL only sizes up to INT_MAX bytes
+	size_t vboParticles = INT_MAX / (posSize > colorSize ? posSize : colorSize);
+	if(!headless && vboParticles < chunkParticles)
+		chunkParticles = vboParticles;
+	printf("Splitting %u particles into chunks of at most %u...\n", (unsigned int)particleCount, (unsigned int)chunkParticles);
 
-	// Create referances of the OpenGL buffers
-	printf("Referencing OpenGL buffers to OpenCL buffers...\n");
-	
-	cl_glReferances[0] = clCreateFromGLBuffer(context,CL_MEM_READ_WRITE,vbo_pos,&error);
-	if(error != CL_SUCCESS)
+	for(size_t offset = 0; offset < particleCount; offset += chunkParticles)
 	{
-		printf("Failed to referance gl buffer with error code %d(%s)\n", error, oclErrorString(error));
-		return false;
+		ParticleChunk chunk;
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.offset = offset;
+		chunk.count = particleCount - offset < chunkParticles ? particleCount - offset : chunkParticles;
+		chunks.push_back(chunk);
+
+		ParticleChunk& c = chunks.back();
+		const void* posData = pos ? pos + offset : NULL;
+		const void* velData = vel ? vel + offset : NULL;
+		const void* colData = col ? col + offset : NULL;
+
+		// Compact copies only live for this chunk, so their writes block
+		std::vector<short> posCompact;
+		std::vector<unsigned short> velCompact;
+		std::vector<unsigned char> colCompact;
+		if(compact)
+		{
+			CompactChunk(pos + offset, vel + offset, col + offset, c.count, posCompact, velCompact, colCompact);
+			posData = &posCompact[0];
+			velData = &velCompact[0];
+			colData = &colCompact[0];
+		}
+
+		if(headless)
+		{
+			if( !CreateBuffer(&c.pos, posData, posSize * c.count, compact) ||
+				!CreateBuffer(&c.color, colData, colorSize * c.count, compact) )
+				return false;
+		}
+		else if( !CreateSharedBuffers(c, posData, colData) )
+			return false;
+
+		printf("Writing chunk %u to device memory...\n", (unsigned int)(chunks.size() - 1));
+		if(layout == LAYOUT_AOS)
+		{
+			if( !CreateBuffer(&c.velocities, velData, velSize * c.count, compact) )
+				return false;
+			// Procedural respawns and bodies need no copy of the initial state
+			if( !procedural && !nbody &&
+				(!CreateBuffer(&c.static_pos, posData, posSize * c.count, compact) ||
+				!CreateBuffer(&c.static_vel, velData, velSize * c.count, compact)) )
+				return false;
+			if( lifecycle && !CreateLifecycleBuffers(c) )
+				return false;
+		}
+		else
+		{
+			// Only pos.z, vel.z and life change, everything else stays in the
+			// interleaved buffers the renderer reads.
+			std::vector<float> state(PackedSize(3, c.count)), gen(procedural ? 0 : PackedSize(2, c.count));
+			for(size_t j = 0; j < c.count; j++)
+			{
+				state[PackedIndex(0, 3, j, c.count)] = pos[offset + j][2];
+				state[PackedIndex(1, 3, j, c.count)] = vel[offset + j][2];
+				state[PackedIndex(2, 3, j, c.count)] = vel[offset + j][3];
+				if(procedural)
+					continue;
+				gen[PackedIndex(0, 2, j, c.count)] = pos[offset + j][2];
+				gen[PackedIndex(1, 2, j, c.count)] = vel[offset + j][2];
+			}
+			if( !CreateBuffer(&c.state, &state[0], sizeof(float) * state.size(), true) )
+				return false;
+			if( !procedural && !CreateBuffer(&c.gen, &gen[0], sizeof(float) * gen.size(), true) )
+				return false;
+		}
 	}
-	cl_glReferances[1] = clCreateFromGLBuffer(context,CL_MEM_READ_WRITE,vbo_color,&error);
-	if(error != CL_SUCCESS)
+
+	clFinish(commandQueue);
+	if(lifecycle)
 	{
-		printf("Failed to referance gl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		// Everything starts out dead, waiting for the emitters. By default
+		// they fill the particles over one lifetime.
+		if(emitCount < 0)
+			emitCount = size / 100;
+		liveCountReads.assign(chunks.size(), std::deque<LiveCountRead>());
+		liveCounts.assign(chunks.size(), 0);
+		vbo_count.assign(chunks.size(), 0);
+		liveBounds.assign(chunks.size(), 0);
+		liveEmitted.assign(chunks.size(), 0);
+		vbo_index.assign(chunks.size(), 0);
+		UpdateDrawCounts();
+	}
+	if(nbody && !CreateBodies(vel))
 		return false;
+	// The smoothing length is the cell size
+	if(sph)
+	{
+		if(sphSpacing <= 0.0f)
+		{
+			printf("SPH needs the particle spacing of the initial state.\n");
+			return false;
+		}
+		cellSize = 2.0f * sphSpacing;
 	}
+	if(grid && !CreateGrid())
+		return false;
+	if(!colliderFile.empty() && !collider && !CreateCollider())
+		return false;
+	if(!pos)
+		return SpawnParticles();
+	return true;
+}
 
-	cl_velocities = clCreateBuffer(context, CL_MEM_READ_WRITE, buffersSize, NULL, &error);
-	if(error != CL_SUCCESS)
+// Buffers and kernels of the neighbor grid, a spatial hash of hashSize
+// cells of cellSize. All particles have to be in one chunk to be binned
+// together.
+bool OCL::CreateGrid()
+{
+	cl_int error;
+
+	if(chunks.size() != 1)
 	{
-		printf("Failed to create cl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		printf("The neighbor grid needs all particles in one chunk, %u chunks are used.\n", (unsigned int)chunks.size());
 		return false;
 	}
-	cl_static_pos = clCreateBuffer(context, CL_MEM_READ_WRITE, buffersSize, NULL, &error);
-	if(error != CL_SUCCESS)
+	if(hashSize == 0)
 	{
-		printf("Failed to create cl buffer with error code %d(%s)\n", error, oclErrorString(error));
-		return false;
+		hashSize = 1;
+		while(hashSize < particleCount)
+			hashSize *= 2;
 	}
-	cl_static_vel = clCreateBuffer(context, CL_MEM_READ_WRITE, buffersSize, NULL, &error);
-	if(error != CL_SUCCESS)
+	if(hashSize & (hashSize - 1))
 	{
-		printf("Failed to create cl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		printf("The grid's hash size has to be a power of two.\n");
 		return false;
 	}
 
-	printf("Writing data to GPU memory...\n");
+	const char* names[GRID_KERNELS] = { "clearCells", "hashParticles", "scatterParticles", "finishCells" };
+	for(int i = 0; i < GRID_KERNELS; i++)
+	{
+		gridKernels[i] = clCreateKernel(program, names[i], &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create grid kernel %s with error code %d(%s)\n", names[i], error, oclErrorString(error));
+			return false;
+		}
+	}
 
-	error = clEnqueueWriteBuffer(commandQueue,cl_velocities, CL_TRUE, 0, buffersSize, vel, 0, NULL, NULL);
-	if(error != CL_SUCCESS)
+	size_t cells = sizeof(cl_uint) * hashSize, particles = sizeof(cl_uint) * particleCount;
+	if( !CreateBuffer(&cellStart, NULL, cells) || !CreateBuffer(&cellEnd, NULL, cells) ||
+		!CreateBuffer(&particleCell, NULL, particles) || !CreateBuffer(&particleRank, NULL, particles) ||
+		!CreateBuffer(&sortedIndex, NULL, particles) )
+		return false;
+	printf("Neighbor grid: %u cells of %f\n", (unsigned int)hashSize, cellSize);
+	return true;
+}
+
+// Bins the particles into the grid with a counting sort: count the
+// particles per cell, scan the counts into cellStart and scatter the
+// particle indices into sortedIndex. cellEnd turns from the counts into
+// the end of every cell's range.
+bool OCL::EnqueueGrid()
+{
+	cl_uint cells = (cl_uint)hashSize, count = (cl_uint)particleCount;
+	const ParticleChunk& c = chunks[0];
+
+	if( !SetArg(gridKernels[GRID_CLEAR], 0, sizeof(cl_mem), &cellEnd) ||
+		!SetArg(gridKernels[GRID_CLEAR], 1, sizeof(cl_uint), &cells) ||
+		!Launch(gridKernels[GRID_CLEAR], hashSize, 0, NULL, "gridClear", NULL) )
+		return false;
+
+	if( !SetArg(gridKernels[GRID_HASH], 0, sizeof(cl_mem), &c.pos) ||
+		!SetArg(gridKernels[GRID_HASH], 1, sizeof(cl_mem), &particleCell) ||
+		!SetArg(gridKernels[GRID_HASH], 2, sizeof(cl_mem), &particleRank) ||
+		!SetArg(gridKernels[GRID_HASH], 3, sizeof(cl_mem), &cellEnd) ||
+		!SetArg(gridKernels[GRID_HASH], 4, sizeof(float), &cellSize) ||
+		!SetArg(gridKernels[GRID_HASH], 5, sizeof(cl_uint), &cells) ||
+		!SetArg(gridKernels[GRID_HASH], 6, sizeof(cl_uint), &count) ||
+		!Launch(gridKernels[GRID_HASH], particleCount, 0, NULL, "gridHash", NULL) )
+		return false;
+
+	if( !primitives->ExclusiveScan(cellEnd, cellStart, hashSize) )
+		return false;
+
+	if( !SetArg(gridKernels[GRID_SCATTER], 0, sizeof(cl_mem), &particleCell) ||
+		!SetArg(gridKernels[GRID_SCATTER], 1, sizeof(cl_mem), &particleRank) ||
+		!SetArg(gridKernels[GRID_SCATTER], 2, sizeof(cl_mem), &cellStart) ||
+		!SetArg(gridKernels[GRID_SCATTER], 3, sizeof(cl_mem), &sortedIndex) ||
+		!SetArg(gridKernels[GRID_SCATTER], 4, sizeof(cl_uint), &count) ||
+		!Launch(gridKernels[GRID_SCATTER], particleCount, 0, NULL, "gridScatter", NULL) )
+		return false;
+
+	return SetArg(gridKernels[GRID_FINISH], 0, sizeof(cl_mem), &cellStart) &&
+		SetArg(gridKernels[GRID_FINISH], 1, sizeof(cl_mem), &cellEnd) &&
+		SetArg(gridKernels[GRID_FINISH], 2, sizeof(cl_uint), &cells) &&
+		Launch(gridKernels[GRID_FINISH], hashSize, 0, NULL, "gridFinish", NULL);
+}
+
+// Bodies keep their masses apart from the velocities the kick writes,
+// so no work item reads what another one changes. Every body attracts
+// every other one, so they have to share a chunk.
+bool OCL::CreateBodies(Vector4* vel)
+{
+	if(chunks.size() != 1)
 	{
-		printf("Failed to write to cl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		printf("N-body gravity needs all bodies in one chunk, %u chunks are used.\n", (unsigned int)chunks.size());
 		return false;
 	}
-	error = clEnqueueWriteBuffer(commandQueue,cl_static_vel, CL_TRUE, 0, buffersSize, vel, 0, NULL, NULL);
+
+	std::vector<float> mass(particleCount);
+	for(size_t i = 0; i < particleCount; i++)
+		mass[i] = vel[i][3];
+	return CreateBuffer(&bodyMass, &mass[0], sizeof(float) * particleCount, true);
+}
+
+// The kick loads one tile of bodies per work item into local memory, so
+// the work group is as large as the kernel and half the device's local
+// memory allow unless localWorkSize is set.
+bool OCL::CreateBodyKernels()
+{
+	cl_int error;
+	const ParticleChunk& c = chunks[0];
+	cl_uint count = (cl_uint)c.count;
+	float softening2 = softening * softening;
+
+	moveKernel = clCreateKernel(program, "moveBodies", &error);
 	if(error != CL_SUCCESS)
 	{
-		printf("Failed to write to cl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		printf("Failed to create moveBodies with error code %d(%s)\n", error, oclErrorString(error));
 		return false;
 	}
-	error = clEnqueueWriteBuffer(commandQueue,cl_static_pos, CL_TRUE, 0, buffersSize, pos, 0, NULL, NULL);
-	if(error != CL_SUCCESS)
+
+	if(localWorkSize == 0)
 	{
-		printf("Failed to write to cl buffer with error code %d(%s)\n", error, oclErrorString(error));
-		return false;
+		size_t maxGroup = 0;
+		cl_ulong localMem = 0;
+		clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL);
+		clGetDeviceInfo(deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMem, NULL);
+		for(localWorkSize = 1; localWorkSize * 2 <= maxGroup && localWorkSize < 256 &&
+			localWorkSize * 2 * sizeof(cl_float4) <= localMem / 2; localWorkSize *= 2);
 	}
+	if(autotune)
+		printf("N-body work groups follow the device limits, not tuning.\n");
+	if(!barnesHut)
+		printf("N-body tiles of %u bodies\n", (unsigned int)localWorkSize);
 
-	clFinish(commandQueue);
+	// The tree walk shares the first arguments of the tiled kick
+	dtArg = 4;
+	if( !SetArg(kernel, 0, sizeof(cl_mem), &c.pos) ||
+		!SetArg(kernel, 1, sizeof(cl_mem), &c.velocities) ||
+		!SetArg(kernel, 5, sizeof(float), &gravity) ||
+		!SetArg(kernel, 6, sizeof(float), &softening2) ||
+		!SetArg(kernel, 7, sizeof(cl_uint), &count) ||
+		!SetArg(moveKernel, 0, sizeof(cl_mem), &c.pos) ||
+		!SetArg(moveKernel, 1, sizeof(cl_mem), &c.velocities) ||
+		!SetArg(moveKernel, 3, sizeof(cl_uint), &count) ||
+		!SetTimeStep() )
+		return false;
+	if(barnesHut)
+		return CreateTree();
+	return SetArg(kernel, 2, sizeof(cl_mem), &bodyMass) &&
+		SetArg(kernel, 3, sizeof(cl_float4) * localWorkSize, NULL);
 }
 
-bool OCL::BuildExecutable()
+// Kernels and buffers of the Barnes-Hut tree, count - 1 internal nodes
+// followed by a leaf per body.
+bool OCL::CreateTree()
 {
 	cl_int error;
+	const ParticleChunk& c = chunks[0];
+	cl_uint count = (cl_uint)c.count;
+	size_t nodes = 2 * c.count - 1, internal = c.count > 1 ? c.count - 1 : 1;
+	size_t keySize = mortonBits > 32 ? sizeof(cl_ulong) : sizeof(cl_uint);
+	float theta2 = theta * theta;
 
-	// Build program
-	printf("Building OpenCL program...\n");
-	error = clBuildProgram(program, 1, &deviceId, NULL, NULL, NULL);
-	
-	if(error != CL_SUCCESS)
+	const char* names[TREE_KERNELS] = { "mortonCodes", "buildTree", "summarizeTree" };
+	for(int i = 0; i < TREE_KERNELS; i++)
 	{
-		printf("Failed to build executable with error code %d (%s)", error, oclErrorString(error));
-		return false;
+		treeKernels[i] = clCreateKernel(program, names[i], &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create tree kernel %s with error code %d(%s)\n", names[i], error, oclErrorString(error));
+			return false;
+		}
 	}
 
-	// Get and print build status messages.
-	cl_build_status build_status;
-	error = clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_STATUS, sizeof(cl_build_status), &build_status, NULL);
+	if( !CreateBuffer(&boundsMin, NULL, sizeof(cl_float4)) || !CreateBuffer(&boundsMax, NULL, sizeof(cl_float4)) ||
+		!CreateBuffer(&mortonKeys, NULL, keySize * c.count) || !CreateBuffer(&bodyOrder, NULL, sizeof(cl_uint) * c.count) ||
+		!CreateBuffer(&nodeLeft, NULL, sizeof(cl_uint) * internal) || !CreateBuffer(&nodeRight, NULL, sizeof(cl_uint) * internal) ||
+		!CreateBuffer(&nodeParent, NULL, sizeof(cl_uint) * nodes) || !CreateBuffer(&nodeVisits, NULL, sizeof(cl_uint) * internal) ||
+		!CreateBuffer(&nodeCom, NULL, sizeof(cl_float4) * nodes) || !CreateBuffer(&nodeMin, NULL, sizeof(cl_float4) * nodes) ||
+		!CreateBuffer(&nodeMax, NULL, sizeof(cl_float4) * nodes) )
+		return false;
+
+	cl_kernel morton = treeKernels[TREE_MORTON], build = treeKernels[TREE_BUILD], summarize = treeKernels[TREE_SUMMARIZE];
+	printf("Barnes-Hut tree: %u nodes, %d bit Morton codes, theta %f\n", (unsigned int)nodes, mortonBits, theta);
+	return SetArg(morton, 0, sizeof(cl_mem), &c.pos) && SetArg(morton, 1, sizeof(cl_mem), &boundsMin) &&
+		SetArg(morton, 2, sizeof(cl_mem), &boundsMax) && SetArg(morton, 3, sizeof(cl_mem), &mortonKeys) &&
+		SetArg(morton, 4, sizeof(cl_mem), &bodyOrder) && SetArg(morton, 5, sizeof(cl_uint), &count) &&
+
+		SetArg(build, 0, sizeof(cl_mem), &mortonKeys) && SetArg(build, 1, sizeof(cl_mem), &nodeLeft) &&
+		SetArg(build, 2, sizeof(cl_mem), &nodeRight) && SetArg(build, 3, sizeof(cl_mem), &nodeParent) &&
+		SetArg(build, 4, sizeof(cl_mem), &nodeVisits) && SetArg(build, 5, sizeof(cl_uint), &count) &&
 
-	char *build_log;
-	size_t ret_val_size;
-	error = clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, 0, NULL, &ret_val_size);
+		SetArg(summarize, 0, sizeof(cl_mem), &c.pos) && SetArg(summarize, 1, sizeof(cl_mem), &bodyMass) &&
+		SetArg(summarize, 2, sizeof(cl_mem), &bodyOrder) && SetArg(summarize, 3, sizeof(cl_mem), &nodeLeft) &&
+		SetArg(summarize, 4, sizeof(cl_mem), &nodeRight) && SetArg(summarize, 5, sizeof(cl_mem), &nodeParent) &&
+		SetArg(summarize, 6, sizeof(cl_mem), &nodeVisits) && SetArg(summarize, 7, sizeof(cl_mem), &nodeCom) &&
+		SetArg(summarize, 8, sizeof(cl_mem), &nodeMin) && SetArg(summarize, 9, sizeof(cl_mem), &nodeMax) &&
+		SetArg(summarize, 10, sizeof(cl_uint), &count) &&
+
+		SetArg(kernel, 2, sizeof(cl_mem), &bodyOrder) && SetArg(kernel, 3, sizeof(cl_mem), &nodeCom) &&
+		SetArg(kernel, 8, sizeof(cl_mem), &nodeMin) && SetArg(kernel, 9, sizeof(cl_mem), &nodeMax) &&
+		SetArg(kernel, 10, sizeof(cl_mem), &nodeLeft) && SetArg(kernel, 11, sizeof(cl_mem), &nodeRight) &&
+		SetArg(kernel, 12, sizeof(float), &theta2);
+}
+
+// Rebuilds the tree for the bodies' current positions: their bounds,
+// Morton codes in sorted order, the nodes over them and the nodes' masses.
+bool OCL::EnqueueTree()
+{
+	const ParticleChunk& c = chunks[0];
+	if( !primitives->ReduceFloat4(c.pos, boundsMin, c.count, Primitives::REDUCE_MIN) ||
+		!primitives->ReduceFloat4(c.pos, boundsMax, c.count, Primitives::REDUCE_MAX) ||
+		!Launch(treeKernels[TREE_MORTON], c.count, 0, NULL, "treeMorton", NULL) ||
+		!primitives->SortPairs(mortonKeys, bodyOrder, c.count, mortonBits) )
+		return false;
+	if(c.count > 1 && !Launch(treeKernels[TREE_BUILD], c.count - 1, 0, NULL, "treeBuild", NULL))
+		return false;
+	return Launch(treeKernels[TREE_SUMMARIZE], c.count, 0, NULL, "treeSummarize", NULL);
+}
 
-	build_log = new char[ret_val_size+1];
-	error = clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, ret_val_size, build_log, NULL);
-	build_log[ret_val_size] = '\0';
-	printf("BUILD LOG: \n %s", build_log);
+// Kick and drift once per substep, the whole system has to be kicked
+// before any body moves. Barnes-Hut rebuilds its tree before every kick.
+bool OCL::EnqueueBodies(cl_uint waitCount, const cl_event* waitList, cl_event* event)
+{
+	if(barnesHut && waitCount > 0)
+	{
+		cl_int error = clEnqueueWaitForEvents(commandQueue, waitCount, waitList);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to wait for events with error code %d(%s)\n", error, oclErrorString(error));
+			return false;
+		}
+		waitCount = 0;
+		waitList = NULL;
+	}
 
-	delete build_log;
+	for(int k = 0; k < substeps; k++)
+	{
+		bool last = k + 1 == substeps;
+		if( (barnesHut && !EnqueueTree()) ||
+			!Launch(kernel, particleCount, k == 0 ? waitCount : 0, k == 0 ? waitList : NULL, barnesHut ? "accelerateTree" : "accelerateBodies", NULL) ||
+			!Launch(moveKernel, particleCount, 0, NULL, "moveBodies", last ? event : NULL) )
+			return false;
+	}
+	stepCount += substeps;
 	return true;
 }
 
-bool OCL::CreateKernel()
+// Sorted copies of the particles and the fluid kernels. Work groups cache
+// their particles' position, velocity and density in local memory, so
+// they are as large as the kernels and half the local memory allow unless
+// localWorkSize is set. Stable steps need a particle to move less than a
+// fraction of h per pass, at the speed of sound plus a few m/s of flow.
+bool OCL::CreateFluid()
 {
 	cl_int error;
-	printf("Creating kernel...\n");
+	const ParticleChunk& c = chunks[0];
+	cl_uint count = (cl_uint)c.count, cells = (cl_uint)hashSize;
+	float h = cellSize;
+	float fluid[4] = { h, sphRestDensity * sphSpacing * sphSpacing * sphSpacing, sphRestDensity, sphStiffness };
+	size_t cacheBytes = 2 * sizeof(cl_float4) + sizeof(cl_float2);
 
-	if(!initialized)
+	reorderKernel = clCreateKernel(program, "sphReorder", &error);
+	if(error == CL_SUCCESS)
+		densityKernel = clCreateKernel(program, "sphDensity", &error);
+	if(error != CL_SUCCESS)
 	{
-		printf("Failed to run. OpenCL context not initialized.\n");
+		printf("Failed to create the SPH kernels with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+	if( !CreateBuffer(&sortedPos, NULL, sizeof(cl_float4) * c.count) || !CreateBuffer(&sortedVel, NULL, sizeof(cl_float4) * c.count) ||
+		!CreateBuffer(&fluidState, NULL, sizeof(cl_float2) * c.count) )
 		return false;
+
+	if(localWorkSize == 0)
+	{
+		size_t maxGroup = 0, densityGroup = 0;
+		cl_ulong localMem = 0;
+		clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL);
+		clGetKernelWorkGroupInfo(densityKernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &densityGroup, NULL);
+		clGetDeviceInfo(deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMem, NULL);
+		if(densityGroup < maxGroup)
+			maxGroup = densityGroup;
+		for(localWorkSize = 1; localWorkSize * 2 <= maxGroup && localWorkSize < 256 &&
+			localWorkSize * 2 * cacheBytes <= localMem / 2; localWorkSize *= 2);
 	}
+	if(autotune)
+		printf("SPH work groups follow the device limits, not tuning.\n");
 
-	// Create kernel
-	kernel = clCreateKernel(program, "updateParticles", &error);
+	printf("SPH: h %f, work groups of %u\n", h, (unsigned int)localWorkSize);
 
-	if(error != CL_SUCCESS)
+	dtArg = 13;
+	return SetArg(reorderKernel, 0, sizeof(cl_mem), &c.pos) && SetArg(reorderKernel, 1, sizeof(cl_mem), &c.velocities) &&
+		SetArg(reorderKernel, 2, sizeof(cl_mem), &sortedIndex) && SetArg(reorderKernel, 3, sizeof(cl_mem), &sortedPos) &&
+		SetArg(reorderKernel, 4, sizeof(cl_mem), &sortedVel) && SetArg(reorderKernel, 5, sizeof(cl_uint), &count) &&
+
+		SetArg(densityKernel, 0, sizeof(cl_mem), &sortedPos) && SetArg(densityKernel, 1, sizeof(cl_mem), &fluidState) &&
+		SetArg(densityKernel, 2, sizeof(cl_mem), &cellStart) && SetArg(densityKernel, 3, sizeof(cl_mem), &cellEnd) &&
+		SetArg(densityKernel, 4, sizeof(cl_float4) * localWorkSize, NULL) && SetArg(densityKernel, 5, sizeof(fluid), fluid) &&
+		SetArg(densityKernel, 6, sizeof(cl_uint), &cells) && SetArg(densityKernel, 7, sizeof(cl_uint), &count) &&
+
+		SetArg(kernel, 0, sizeof(cl_mem), &c.pos) && SetArg(kernel, 1, sizeof(cl_mem), &c.color) &&
+		SetArg(kernel, 2, sizeof(cl_mem), &c.velocities) && SetArg(kernel, 3, sizeof(cl_mem), &sortedPos) &&
+		SetArg(kernel, 4, sizeof(cl_mem), &sortedVel) && SetArg(kernel, 5, sizeof(cl_mem), &fluidState) &&
+		SetArg(kernel, 6, sizeof(cl_mem), &sortedIndex) && SetArg(kernel, 7, sizeof(cl_mem), &cellStart) &&
+		SetArg(kernel, 8, sizeof(cl_mem), &cellEnd) && SetArg(kernel, 9, 2 * sizeof(cl_float4) * localWorkSize, NULL) &&
+		SetArg(kernel, 10, sizeof(cl_float2) * localWorkSize, NULL) && SetArg(kernel, 11, sizeof(fluid), fluid) &&
+		SetArg(kernel, 12, sizeof(float), &sphViscosity) && SetArg(kernel, 14, sizeof(cl_uint), &cells) &&
+		SetArg(kernel, 15, sizeof(cl_uint), &count) && SetTimeStep();
+}
+
+// Every pass bins the particles, copies them in bucket order, sums up the
+// densities and then moves them by the forces.
+bool OCL::EnqueueFluid(cl_uint waitCount, const cl_event* waitList, cl_event* event)
+{
+	if(waitCount > 0)
 	{
-		printf("Failed to create kernel with error code %d(%s)", error, oclErrorString(error));
-		return false;
+		cl_int error = clEnqueueWaitForEvents(commandQueue, waitCount, waitList);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to wait for events with error code %d(%s)\n", error, oclErrorString(error));
+			return false;
+		}
 	}
 
-	// Set kernel arguments
-	error = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&cl_glReferances[0]);
-	if(error != CL_SUCCESS)
+	int passes = substeps * fluidPasses;
+	for(int k = 0; k < passes; k++)
 	{
-		printf("Failed to set kernel argument 0 with error code %d(%s)\n",error, oclErrorString(error));
-		return false;
+		if( !EnqueueGrid() ||
+			!Launch(reorderKernel, particleCount, 0, NULL, "sphReorder", NULL) ||
+			!Launch(densityKernel, particleCount, 0, NULL, "sphDensity", NULL) ||
+			!Launch(kernel, particleCount, 0, NULL, "sphForces", k + 1 == passes ? event : NULL) )
+			return false;
 	}
-	error = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&cl_glReferances[1]);
-	if(error != CL_SUCCESS)
+	stepCount += substeps;
+	return true;
+}
+
+// Reads colliderFile into a 3D image holding the outward normal and the
+// distance of every sample. The normals are the distance's central
+// differences, one sided at the borders; the kernel normalizes them after
+// filtering.
+bool OCL::CreateCollider()
+{
+	cl_int error;
+	cl_bool images = CL_FALSE;
+	clGetDeviceInfo(deviceId, CL_DEVICE_IMAGE_SUPPORT, sizeof(images), &images, NULL);
+	if(!images)
 	{
-		printf("Failed to set kernel argument 1 with error code %d(%s)\n",error, oclErrorString(error));
+		printf("SDF colliders need image support, which the device lacks.\n");
 		return false;
 	}
-	error = clSetKernelArg(kernel, 2, sizeof(cl_mem), (void*)&cl_velocities);
-	if(error != CL_SUCCESS)
+
+	size_t length;
+	char* data = read_binary_file(colliderFile.c_str(), &length);
+	if(!data)
 	{
-		printf("Failed to set kernel argument 2 with error code %d(%s)\n",error, oclErrorString(error));
+		printf("Could not read \"%s\"\n", colliderFile.c_str());
 		return false;
 	}
-	error = clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)&cl_static_pos);
-	if(error != CL_SUCCESS)
+	ColliderHeader* header = (ColliderHeader*)data;
+	size_t size[3] = { 0, 0, 0 }, samples = 0;
+	if(length >= sizeof(ColliderHeader))
 	{
-		printf("Failed to set kernel arguments 3 with error code %d(%s)\n",error, oclErrorString(error));
+		for(int a = 0; a < 3; a++)
+			size[a] = header->size[a];
+		samples = size[0] * size[1] * size[2];
+	}
+	if(samples == 0 || memcmp(header->magic, "PSDF", 4) != 0 || header->version != 1 || header->spacing <= 0.0f ||
+		length != sizeof(ColliderHeader) + sizeof(float) * samples)
+	{
+		printf("\"%s\" is not a collider volume.\n", colliderFile.c_str());
+		free(data);
 		return false;
 	}
-	error = clSetKernelArg(kernel, 4, sizeof(cl_mem), (void*)&cl_static_vel);
-	if(error != CL_SUCCESS)
+
+	size_t maxSize[3];
+	clGetDeviceInfo(deviceId, CL_DEVICE_IMAGE3D_MAX_WIDTH, sizeof(size_t), &maxSize[0], NULL);
+	clGetDeviceInfo(deviceId, CL_DEVICE_IMAGE3D_MAX_HEIGHT, sizeof(size_t), &maxSize[1], NULL);
+	clGetDeviceInfo(deviceId, CL_DEVICE_IMAGE3D_MAX_DEPTH, sizeof(size_t), &maxSize[2], NULL);
+	if(size[0] > maxSize[0] || size[1] > maxSize[1] || size[2] > maxSize[2])
 	{
-		printf("Failed to set kernel argument 4 with error code %d(%s)\n",error, oclErrorString(error));
+		printf("Collider volume of %ux%ux%u exceeds the device's 3D images.\n",
+			(unsigned int)size[0], (unsigned int)size[1], (unsigned int)size[2]);
+		free(data);
 		return false;
 	}
-	float dt = 0.01f;
-	error = clSetKernelArg(kernel, 5, sizeof(float), (void*)&dt);
+
+	const float* distance = (const float*)(header + 1);
+	size_t stride[3] = { 1, size[0], size[0] * size[1] };
+	std::vector<float> texels(4 * samples);
+	for(size_t s = 0; s < samples; s++)
+	{
+		size_t at[3] = { s % size[0], s / size[0] % size[1], s / stride[2] };
+		for(int a = 0; a < 3; a++)
+		{
+			size_t lo = at[a] > 0 ? s - stride[a] : s;
+			size_t hi = at[a] + 1 < size[a] ? s + stride[a] : s;
+			texels[4 * s + a] = distance[hi] - distance[lo];
+		}
+		texels[4 * s + 3] = distance[s];
+	}
+	for(int a = 0; a < 3; a++)
+		colliderOrigin[a] = header->origin[a];
+	colliderScale = 1.0f / header->spacing;
+	printf("Collider volume: %ux%ux%u samples of %f\n", (unsigned int)size[0], (unsigned int)size[1],
+		(unsigned int)size[2], header->spacing);
+	free(data);
+
+	// RGBA float is a format every device with images supports
+	cl_image_format format = { CL_RGBA, CL_FLOAT };
+	collider = clCreateImage3D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format, size[0], size[1], size[2],
+		0, 0, &texels[0], &error);
 	if(error != CL_SUCCESS)
 	{
-		printf("Failed to set kernel argument 5 with error code %d(%s)\n",error, oclErrorString(error));
+		printf("Failed to create the collider image with error code %d(%s)\n", error, oclErrorString(error));
 		return false;
 	}
 	return true;
 }
 
-bool OCL::Run()
+// The collider follows the update kernel's other arguments: the respawn
+// offset and step with procedural respawns, dt for lifecycles.
+bool OCL::SetColliderArgs()
+{
+	if(!collider)
+		return true;
+	cl_uint arg = lifecycle ? 8 : procedural ? spawnArg + 2 : 7;
+	return SetArg(kernel, arg, sizeof(cl_mem), &collider) &&
+		SetArg(kernel, arg + 1, sizeof(colliderOrigin), colliderOrigin) &&
+		SetArg(kernel, arg + 2, sizeof(float), &colliderScale) &&
+		SetArg(kernel, arg + 3, sizeof(float), &restitution);
+}
+
+// Hands timeStep to the update kernels when it changed since the last
+// launch. SPH splits a step into as many passes as the fluid's speed of
+// sound needs at its smoothing length.
+bool OCL::SetTimeStep()
+{
+	if(timeStep == kernelTimeStep)
+		return true;
+
+	float dt = timeStep;
+	if(sph)
+	{
+		float speed = sqrtf(sphStiffness) + 3.0f;
+		fluidPasses = (int)ceilf(timeStep * speed / (0.4f * cellSize));
+		if(fluidPasses < 1)
+			fluidPasses = 1;
+		dt = timeStep / fluidPasses;
+		printf("SPH: %d passes per step of %f\n", fluidPasses, timeStep);
+	}
+	if( !SetArg(kernel, dtArg, sizeof(float), &dt) || (moveKernel && !SetArg(moveKernel, 2, sizeof(float), &dt)) )
+		return false;
+	kernelTimeStep = timeStep;
+	return true;
+}
+
+// Live lists, free list and their counters for a lifecycle chunk. The
+// live lists double as element buffers to draw from unless headless.
+bool OCL::CreateLifecycleBuffers(ParticleChunk& chunk)
 {
 	cl_int error;
+	size_t bytes = sizeof(cl_uint) * chunk.count;
 
-	// Makes sure queue is empty
-	glFinish();
-	clFinish(commandQueue);
-	
-	cl_event event;
-	error = clEnqueueAcquireGLObjects(commandQueue,2,cl_glReferances,0,NULL,&event);
+	for(int i = 0; i < 2; i++)
+	{
+		if(headless)
+		{
+			if( !CreateBuffer(&chunk.alive[i], NULL, bytes) )
+				return false;
+			continue;
+		}
+
+		chunk.aliveVbo[i] = oglCreateVBO(NULL, bytes, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+		if(!chunk.aliveVbo[i])
+		{
+			printf("Failed to create live list vbo.\n");
+			return false;
+		}
+		chunk.alive[i] = clCreateFromGLBuffer(context, CL_MEM_READ_WRITE, chunk.aliveVbo[i], &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create live list from vbo with error code %d(%s)\n", error, oclErrorString(error));
+			return false;
+		}
+		glObjects.push_back(chunk.alive[i]);
+	}
+
+	std::vector<unsigned int> dead(chunk.count);
+	for(size_t i = 0; i < chunk.count; i++)
+		dead[i] = (unsigned int)i;
+	cl_uint counters[5] = { 0, (cl_uint)chunk.count, 0, 0, 0 };
+	return CreateBuffer(&chunk.dead, &dead[0], bytes, true) &&
+		CreateBuffer(&chunk.counters, counters, sizeof(counters), true);
+}
+
+// Fills every chunk with the initial ring on the device, in place of the
+// host's init_particles().
+bool OCL::SpawnParticles()
+{
+	cl_int error;
+
+	printf("Spawning particles on the device...\n");
+	cl_kernel spawn = clCreateKernel(program, "spawnParticles", &error);
 	if(error != CL_SUCCESS)
 	{
-		printf("Failed to acquire GL objects with error code %d(%s)\n",error, oclErrorString(error));
+		printf("Failed to create spawn kernel with error code %d(%s)\n", error, oclErrorString(error));
 		return false;
 	}
-	clReleaseEvent(event);
-	//clFinish(commandQueue);
-	size_t s = buffersSize / sizeof(Vector4);
-	error = clEnqueueNDRangeKernel(commandQueue,kernel,1,NULL,(size_t*)&s ,NULL,0,NULL, &event); // Another source of problem. Won't allow clEnqueueReleaseGLObjects after excution.
-	if(error != CL_SUCCESS)
+
+	if(!headless)
 	{
-		printf("Failed to execute kernel with error code %d(%s)\n",error, oclErrorString(error));
-		//return false;
+		glFinish();
+		error = clEnqueueAcquireGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],0,NULL,NULL);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to acquire GL objects with error code %d(%s)\n",error, oclErrorString(error));
+			clReleaseKernel(spawn);
+			return false;
+		}
 	}
-	clReleaseEvent(event);
-	//clFinish(commandQueue);
-	error = clEnqueueReleaseGLObjects(commandQueue,2,cl_glReferances,0, NULL, &event); // Source of problem
-	clReleaseEvent(event);
-	if(error != CL_SUCCESS)
+
+	bool ok = true;
+	for(size_t i = 0; i < chunks.size() && ok; i++)
 	{
-		printf("Failed to release GL Objects with error code %d(%s)\n",error, oclErrorString(error));
-		clFinish(commandQueue);
-		return false;
+		cl_uint count = (cl_uint)chunks[i].count;
+		cl_uint offset = (cl_uint)(indexBase + chunks[i].offset);
+		ok = SetArg(spawn, 0, sizeof(cl_mem), &chunks[i].pos) &&
+			SetArg(spawn, 1, sizeof(cl_mem), &chunks[i].color) &&
+			SetArg(spawn, 2, sizeof(cl_mem), &chunks[i].velocities) &&
+			SetArg(spawn, 3, sizeof(cl_uint), &count) &&
+			SetArg(spawn, 4, sizeof(cl_uint), &offset) &&
+			Launch(spawn, chunks[i].count, 0, NULL, "spawnParticles", NULL);
 	}
 
+	if(!headless)
+		clEnqueueReleaseGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],0,NULL,NULL);
 	clFinish(commandQueue);
+	clReleaseKernel(spawn);
+	return ok;
+}
 
-	return true;
+// Box every particle stays in for a whole lifetime, from its initial and
+// respawn state alike, so the fixed point positions never saturate. Only z
+// moves, falling from z0 with vz0 for about max(life, 1). The slack covers
+// the Euler steps and half precision life running a little long.
+void OCL::ComputeBounds(Vector4* pos, Vector4* vel, int size)
+{
+	const float g = 9.8f;
+	float lo[3], hi[3];
+
+	for(int i = 0; i < size; i++)
+	{
+		float t = 1.05f * (vel[i][3] > 1.0f ? vel[i][3] : 1.0f);
+		float apex = vel[i][2] / g;
+		apex = apex < 0.0f ? 0.0f : apex > t ? t : apex;
+		float zEnd = pos[i][2] + vel[i][2] * t - 0.5f * g * t * t;
+		float zApex = pos[i][2] + vel[i][2] * apex - 0.5f * g * apex * apex;
+
+		float pmin[3] = { pos[i][0], pos[i][1], zEnd < pos[i][2] ? zEnd : pos[i][2] };
+		float pmax[3] = { pos[i][0], pos[i][1], zApex };
+		for(int a = 0; a < 3; a++)
+		{
+			if(i == 0 || pmin[a] < lo[a])
+				lo[a] = pmin[a];
+			if(i == 0 || pmax[a] > hi[a])
+				hi[a] = pmax[a];
+		}
+	}
+
+	for(int a = 0; a < 3; a++)
+	{
+		float half = 0.6f * (hi[a] - lo[a]) + 1e-3f;
+		vbo_offset[a] = 0.5f * (lo[a] + hi[a]);
+		vbo_scale[a] = half / 32767.0f;
+	}
+	printf("Compact positions cover %f..%f, %f..%f, %f..%f\n",
+		vbo_offset[0] - 32767.0f * vbo_scale[0], vbo_offset[0] + 32767.0f * vbo_scale[0],
+		vbo_offset[1] - 32767.0f * vbo_scale[1], vbo_offset[1] + 32767.0f * vbo_scale[1],
+		vbo_offset[2] - 32767.0f * vbo_scale[2], vbo_offset[2] + 32767.0f * vbo_scale[2]);
+}
+
+// Converts count particles to the compact formats: positions as short4 in
+// the box of ComputeBounds() with w = 1, velocities and life as half4 and
+// colors as RGBA8.
+void OCL::CompactChunk(Vector4* pos, Vector4* vel, Vector4* col, size_t count,
+	std::vector<short>& posOut, std::vector<unsigned short>& velOut, std::vector<unsigned char>& colOut)
+{
+	posOut.resize(4 * count);
+	velOut.resize(4 * count);
+	colOut.resize(4 * count);
+	for(size_t i = 0; i < count; i++)
+	{
+		for(int a = 0; a < 4; a++)
+		{
+			float q = a < 3 ? (pos[i][a] - vbo_offset[a]) / vbo_scale[a] : 1.0f;
+			q = q < -32767.0f ? -32767.0f : q > 32767.0f ? 32767.0f : q;
+			posOut[4 * i + a] = (short)(q < 0.0f ? q - 0.5f : q + 0.5f);
+			velOut[4 * i + a] = float_to_half(vel[i][a]);
+			float c = col[i][a] < 0.0f ? 0.0f : col[i][a] > 1.0f ? 1.0f : col[i][a];
+			colOut[4 * i + a] = (unsigned char)(c * 255.0f + 0.5f);
+		}
+	}
+}
+
+bool OCL::CreateSharedBuffers(ParticleChunk& chunk, const void* pos, const void* col)
+{
+	cl_int error;
+
+	printf("Creating OpenGL buffers...\n");
+	GLuint vboPos = oglCreateVBO(pos, posSize * chunk.count, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+	if(!vboPos)
+	{
+		printf("Failed to create positions vbo.\n");
+		return false;
+	}
+	GLuint vboColor = oglCreateVBO(col, colorSize * chunk.count, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+	if(!vboColor)
+	{
+		printf("Failed to create colors vbo.\n");
+		glDeleteBuffers(1, &vboPos);
+		return false;
+	}
+	vbo_pos.push_back(vboPos);
+	vbo_color.push_back(vboColor);
+	vbo_count.push_back((int)chunk.count);
+	glFinish(); // Wait for gl opperations to finish.
+
+	// Create referances of the OpenGL buffers
+	printf("Referencing OpenGL buffers to OpenCL buffers...\n");
+	
+	chunk.pos = clCreateFromGLBuffer(context,CL_MEM_READ_WRITE,vboPos,&error);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to referance gl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+	chunk.color = clCreateFromGLBuffer(context,CL_MEM_READ_WRITE,vboColor,&error);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to referance gl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+	glObjects.push_back(chunk.pos);
+	glObjects.push_back(chunk.color);
+	return true;
+}
+
+// Creates a read/write buffer and, given data, queues a copy of it into the
+// buffer. Unless blocking, LoadData finishes the queue once all chunks are
+// queued.
+bool OCL::CreateBuffer(cl_mem* buffer, const void* data, size_t bytes, bool blocking)
+{
+	cl_int error;
+
+	*buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &error);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to create cl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+
+	if(!data)
+		return true;
+	error = clEnqueueWriteBuffer(commandQueue, *buffer, blocking ? CL_TRUE : CL_FALSE, 0, bytes, data, 0, NULL, NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to write to cl buffer with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+// Index of field f of particle i in a packed buffer holding fields floats
+// for each of count particles.
+size_t OCL::PackedIndex(int f, int fields, size_t i, size_t count)
+{
+	if(layout == LAYOUT_AOSOA)
+		return (i / aosoaWidth * fields + f) * aosoaWidth + i % aosoaWidth;
+	return f * count + i;
+}
+
+// Floats in a packed buffer, AoSoA pads to whole blocks.
+size_t OCL::PackedSize(int fields, size_t count)
+{
+	if(layout == LAYOUT_AOSOA)
+		return (count + aosoaWidth - 1) / aosoaWidth * aosoaWidth * fields;
+	return count * fields;
+}
+
+// buildOptions plus the defines derived from the run settings.
+std::string OCL::ProgramOptions()
+{
+	char defines[128];
+	sprintf(defines, " -DSUBSTEPS=%d", substeps > 0 ? substeps : 1);
+	std::string options = buildOptions + defines;
+
+	if(compact)
+		options += " -DCOMPACT";
+	if(lifecycle)
+		options += " -DLIFECYCLE";
+	if(grid)
+		options += " -DGRID";
+	if(nbody)
+		options += " -DNBODY";
+	if(sph)
+		options += " -DSPH";
+	if(!colliderFile.empty())
+		options += " -DCOLLIDER";
+	if(integrator != INTEGRATOR_EULER && !nbody && !sph)
+	{
+		sprintf(defines, " -DINTEGRATOR=%d", (int)integrator);
+		options += defines;
+	}
+	if(barnesHut)
+	{
+		sprintf(defines, " -DBARNES_HUT -DMORTON_BITS=%d", mortonBits);
+		options += defines;
+	}
+	if(procedural)
+		options += " -DPROCEDURAL_RESPAWN";
+	if(layout == LAYOUT_SOA)
+		options += " -DLAYOUT_SOA";
+	else if(layout == LAYOUT_AOSOA)
+	{
+		sprintf(defines, " -DLAYOUT_AOSOA -DAOSOA_WIDTH=%d", aosoaWidth);
+		options += defines;
+	}
+	return options;
+}
+
+bool OCL::BuildExecutable()
+{
+	// Build program
+	printf("Building OpenCL program...\n");
+	std::string options = ProgramOptions();
+	printf("Build options: %s\n", options.c_str());
+	cl_int buildError = clBuildProgram(program, 1, &deviceId, options.c_str(), NULL, NULL);
+
+	// Get and print build status messages.
+	size_t ret_val_size = 0;
+	cl_int error = clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, 0, NULL, &ret_val_size);
+	if(error == CL_SUCCESS)
+	{
+		char *build_log = new char[ret_val_size+1];
+		error = clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, ret_val_size, build_log, NULL);
+		build_log[error == CL_SUCCESS ? ret_val_size : 0] = '\0';
+		printf("BUILD LOG: \n %s", build_log);
+		delete [] build_log;
+	}
+	if(error != CL_SUCCESS)
+		printf("Failed to get the build log with error code %d (%s)\n", error, oclErrorString(error));
+
+	if(buildError != CL_SUCCESS)
+	{
+		printf("Failed to build executable with error code %d (%s)", buildError, oclErrorString(buildError));
+		return false;
+	}
+	return true;
+}
+
+bool OCL::CreateKernel()
+{
+	cl_int error;
+	printf("Creating kernel...\n");
+
+	if(!initialized)
+	{
+		printf("Failed to run. OpenCL context not initialized.\n");
+		return false;
+	}
+
+	// Create kernel. Packed layouts have their own update and, for
+	// rendering, a kernel writing the results back into the VBOs.
+	// Lifecycles update the live list and need two more kernels. Bodies
+	// are kicked by one kernel and drifted by another.
+	const char* name = layout != LAYOUT_AOS ? "updateParticlesPacked" : compact ? "updateParticlesCompact" : "updateParticles";
+	if(lifecycle)
+		name = "updateLiveParticles";
+	if(nbody)
+		name = barnesHut ? "accelerateTree" : "accelerateBodies";
+	if(sph)
+		name = "sphForces";
+	kernel = clCreateKernel(program, name, &error);
+
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to create kernel with error code %d(%s)", error, oclErrorString(error));
+		return false;
+	}
+	if(layout != LAYOUT_AOS && !headless)
+	{
+		unpackKernel = clCreateKernel(program, "unpackParticles", &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create unpack kernel with error code %d(%s)", error, oclErrorString(error));
+			return false;
+		}
+	}
+	if(lifecycle)
+	{
+		beginKernel = clCreateKernel(program, "beginLifecycleStep", &error);
+		if(error == CL_SUCCESS)
+			emitKernel = clCreateKernel(program, "emitParticles", &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create lifecycle kernels with error code %d(%s)", error, oclErrorString(error));
+			return false;
+		}
+		// The lists swap every step, so the other arguments are set per
+		// launch. The tuner's scratch buffers have no lists to run on.
+		dtArg = 7;
+		return SetTimeStep() && SetColliderArgs() && (!trajectory || CreateTrajectoryBuffers());
+	}
+
+	// Every mode's launches stream frames, so each needs the slots
+	if(nbody)
+		return CreateBodyKernels() && (!trajectory || CreateTrajectoryBuffers());
+	if(sph)
+		return CreateFluid() && (!trajectory || CreateTrajectoryBuffers());
+
+	// Set kernel arguments. With several chunks the buffers are swapped
+	// before every launch. Procedural respawns take the chunk offset and
+	// the step count after the other arguments.
+	dtArg = layout == LAYOUT_AOS ? 5 : 2;
+	spawnArg = layout != LAYOUT_AOS ? 5 : compact ? 9 : 7;
+	if( !SetChunkArgs(chunks[0]) )
+		return false;
+
+	if( !SetTimeStep() || !SetColliderArgs() )
+		return false;
+	if(compact)
+	{
+		// Fixed point positions decode as center + q * scale
+		float center[4] = { vbo_offset[0], vbo_offset[1], vbo_offset[2], 0.0f };
+		float scale[4] = { vbo_scale[0], vbo_scale[1], vbo_scale[2], 1.0f };
+		if( !SetArg(kernel, 7, sizeof(center), center) || !SetArg(kernel, 8, sizeof(scale), scale) )
+			return false;
+	}
+	if(trajectory && !CreateTrajectoryBuffers())
+		return false;
+
+	if(autotune && localWorkSize == 0)
+		return TuneWorkGroupSize();
+	return true;
+}
+
+// Picks the fastest local work size for updateParticles on this device
+// and remembers it in tuneFile, keyed by device, driver and build options.
+bool OCL::TuneWorkGroupSize()
+{
+	cl_int error;
+	char deviceName[1024], driverVersion[1024], kernelName[256] = "";
+	clGetDeviceInfo(deviceId, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+	clGetDeviceInfo(deviceId, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL);
+	// The update kernel CreateKernel() picked for the layout
+	clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kernelName), kernelName, NULL);
+	unsigned long long key = hash_fnv1a(deviceName, strlen(deviceName));
+	key = hash_fnv1a(driverVersion, strlen(driverVersion), key);
+	key = hash_fnv1a(kernelName, strlen(kernelName), key);
+	std::string options = ProgramOptions();
+	key = hash_fnv1a(options.c_str(), options.size(), key);
+
+	// Earlier result?
+	FILE* f = fopen(tuneFile.c_str(), "r");
+	if(f)
+	{
+		unsigned long long fileKey;
+		unsigned int size;
+		while(fscanf(f, "%llx %u", &fileKey, &size) == 2)
+		{
+			if(fileKey == key)
+			{
+				fclose(f);
+				localWorkSize = size;
+				printf("Using tuned local work size %u\n", size);
+				return true;
+			}
+		}
+		fclose(f);
+	}
+
+	size_t maxSize = 0, multiple = 1;
+	clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxSize, NULL);
+	error = clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, NULL);
+	if(error != CL_SUCCESS || multiple == 0)
+		multiple = 1;
+	printf("Tuning local work size (max %u, multiple of %u)...\n", (unsigned int)maxSize, (unsigned int)multiple);
+
+	// Time on scratch copies of the first chunk so the simulation itself is
+	// not advanced. The static buffers are only read.
+	ParticleChunk scratch = chunks[0];
+	scratch.pos = scratch.color = scratch.velocities = scratch.state = 0;
+	scratch.count = chunks[0].count < (1 << 20) ? chunks[0].count : (1 << 20);
+	if(layout == LAYOUT_AOS)
+	{
+		scratch.pos = clCreateBuffer(context, CL_MEM_READ_WRITE, posSize * scratch.count, NULL, NULL);
+		scratch.color = clCreateBuffer(context, CL_MEM_READ_WRITE, colorSize * scratch.count, NULL, NULL);
+		scratch.velocities = clCreateBuffer(context, CL_MEM_READ_WRITE, velSize * scratch.count, NULL, NULL);
+		if(scratch.pos && scratch.color && scratch.velocities)
+		{
+			// Colors are write only and positions don't change the control
+			// flow, any finite values will do
+			cl_mem source = chunks[0].static_pos ? chunks[0].static_pos : chunks[0].velocities;
+			clEnqueueCopyBuffer(commandQueue, source, scratch.pos, 0, 0, posSize * scratch.count, 0, NULL, NULL);
+			clEnqueueCopyBuffer(commandQueue, source, scratch.color, 0, 0, colorSize * scratch.count, 0, NULL, NULL);
+			clEnqueueCopyBuffer(commandQueue, chunks[0].velocities, scratch.velocities, 0, 0, velSize * scratch.count, 0, NULL, NULL);
+		}
+	}
+	else
+	{
+		// AoSoA blocks are contiguous so a prefix will do, SoA needs each
+		// field. gen is read with the scratch stride, which stays in bounds.
+		size_t floats = PackedSize(3, scratch.count);
+		scratch.state = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * floats, NULL, NULL);
+		if(scratch.state && layout == LAYOUT_AOSOA)
+			clEnqueueCopyBuffer(commandQueue, chunks[0].state, scratch.state, 0, 0, sizeof(float) * floats, 0, NULL, NULL);
+		else if(scratch.state)
+		{
+			for(int f = 0; f < 3; f++)
+				clEnqueueCopyBuffer(commandQueue, chunks[0].state, scratch.state, sizeof(float) * f * chunks[0].count,
+					sizeof(float) * f * scratch.count, sizeof(float) * scratch.count, 0, NULL, NULL);
+		}
+	}
+	if(layout == LAYOUT_AOS ? !scratch.pos || !scratch.color || !scratch.velocities : !scratch.state)
+	{
+		printf("Failed to create tuning buffers, keeping the driver's choice.\n");
+		ReleaseScratch(scratch);
+		return true;
+	}
+	SetChunkArgs(scratch);
+
+	// Candidates: the driver's choice and every power of two multiple of
+	// the preferred multiple the kernel allows.
+	std::vector<size_t> candidates;
+	candidates.push_back(0);
+	for(size_t size = multiple; size <= maxSize; size *= 2)
+		candidates.push_back(size);
+
+	size_t best = 0;
+	double bestTime = 0.0;
+	bool timed = false;
+	for(size_t c = 0; c < candidates.size(); c++)
+	{
+		localWorkSize = candidates[c];
+		size_t global = GlobalSize(scratch.count, localWorkSize);
+		const size_t* local = localWorkSize ? &localWorkSize : NULL;
+
+		// One untimed launch, then the best of a few
+		double time = 0.0;
+		error = clEnqueueNDRangeKernel(commandQueue,kernel,1,NULL,&global,local,0,NULL,NULL);
+		clFinish(commandQueue);
+		for(int run = 0; run < 5 && error == CL_SUCCESS; run++)
+		{
+			double start = get_time();
+			error = clEnqueueNDRangeKernel(commandQueue,kernel,1,NULL,&global,local,0,NULL,NULL);
+			clFinish(commandQueue);
+			double t = get_time() - start;
+			if(run == 0 || t < time)
+				time = t;
+		}
+		if(error != CL_SUCCESS)
+		{
+			printf("  local %4u: failed with error code %d(%s)\n", (unsigned int)localWorkSize, error, oclErrorString(error));
+			continue;
+		}
+		printf("  local %4u: %f ms\n", (unsigned int)localWorkSize, time * 1e3);
+		if(!timed || time < bestTime)
+		{
+			best = localWorkSize;
+			bestTime = time;
+			timed = true;
+		}
+	}
+
+	ReleaseScratch(scratch);
+	localWorkSize = best;
+	if( !SetChunkArgs(chunks[0]) )
+		return false;
+	// Nothing to remember, the next run tries again
+	if(!timed)
+	{
+		printf("No local work size could be timed, keeping the driver's choice.\n");
+		return true;
+	}
+	printf("Selected local work size %u\n", (unsigned int)best);
+
+	f = fopen(tuneFile.c_str(), "a");
+	if(f)
+	{
+		fprintf(f, "%016llx %u\n", key, (unsigned int)best);
+		fclose(f);
+	}
+	return true;
+}
+
+void OCL::ReleaseChunks()
+{
+	for(size_t i = 0; i < chunks.size(); i++)
+	{
+		cl_mem buffers[] = { chunks[i].pos, chunks[i].color, chunks[i].velocities, chunks[i].static_pos, chunks[i].static_vel,
+			chunks[i].state, chunks[i].gen, chunks[i].alive[0], chunks[i].alive[1], chunks[i].dead, chunks[i].counters };
+		for(int j = 0; j < 11; j++)
+			if(buffers[j])
+				clReleaseMemObject(buffers[j]);
+		for(int j = 0; j < 2; j++)
+			if(chunks[i].aliveVbo[j])
+				glDeleteBuffers(1, &chunks[i].aliveVbo[j]);
+	}
+	chunks.clear();
+}
+
+void OCL::ReleaseScratch(ParticleChunk& scratch)
+{
+	if(scratch.pos)
+		clReleaseMemObject(scratch.pos);
+	if(scratch.color)
+		clReleaseMemObject(scratch.color);
+	if(scratch.velocities)
+		clReleaseMemObject(scratch.velocities);
+	if(scratch.state)
+		clReleaseMemObject(scratch.state);
+}
+
+bool OCL::SetArg(cl_kernel k, cl_uint index, size_t size, const void* value)
+{
+	cl_int error = clSetKernelArg(k, index, size, value);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to set kernel argument %u with error code %d(%s)\n",index,error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+bool OCL::SetChunkArgs(const ParticleChunk& chunk)
+{
+	cl_uint count = (cl_uint)chunk.count;
+	cl_uint offset = (cl_uint)(indexBase + chunk.offset);
+
+	// The step count is set again before every launch, but launches like
+	// the tuner's come first
+	if( procedural && (!SetArg(kernel, spawnArg, sizeof(cl_uint), &offset) ||
+		!SetArg(kernel, spawnArg + 1, sizeof(cl_uint), &stepCount)) )
+		return false;
+
+	// The SoA stride is the chunk's particle count
+	if(layout != LAYOUT_AOS)
+		return SetArg(kernel, 0, sizeof(cl_mem), &chunk.state) &&
+			SetArg(kernel, 1, sizeof(cl_mem), &chunk.gen) &&
+			SetArg(kernel, 3, sizeof(cl_uint), &count) &&
+			SetArg(kernel, 4, sizeof(cl_uint), &count);
+
+	return SetArg(kernel, 0, sizeof(cl_mem), &chunk.pos) &&
+		SetArg(kernel, 1, sizeof(cl_mem), &chunk.color) &&
+		SetArg(kernel, 2, sizeof(cl_mem), &chunk.velocities) &&
+		SetArg(kernel, 3, sizeof(cl_mem), &chunk.static_pos) &&
+		SetArg(kernel, 4, sizeof(cl_mem), &chunk.static_vel) &&
+		SetArg(kernel, 6, sizeof(cl_uint), &count);
+}
+
+bool OCL::SetUnpackArgs(const ParticleChunk& chunk)
+{
+	cl_uint count = (cl_uint)chunk.count;
+
+	return SetArg(unpackKernel, 0, sizeof(cl_mem), &chunk.pos) &&
+		SetArg(unpackKernel, 1, sizeof(cl_mem), &chunk.color) &&
+		SetArg(unpackKernel, 2, sizeof(cl_mem), &chunk.state) &&
+		SetArg(unpackKernel, 3, sizeof(cl_uint), &count) &&
+		SetArg(unpackKernel, 4, sizeof(cl_uint), &count);
+}
+
+// Rounds count up to whole work groups of local.
+size_t OCL::GlobalSize(size_t count, size_t local)
+{
+	if(local == 0)
+		return count;
+	return (count + local - 1) / local * local;
+}
+
+// localWorkSize is picked for kernel, the others may allow less. Each
+// kernel's CL_KERNEL_WORK_GROUP_SIZE is asked for once.
+size_t OCL::LocalSize(cl_kernel k)
+{
+	if(localWorkSize == 0)
+		return 0;
+	size_t maxGroup = 0;
+	size_t i = 0;
+	for(; i < kernelGroupSizes.size() && kernelGroupSizes[i].first != k; i++);
+	if(i < kernelGroupSizes.size())
+		maxGroup = kernelGroupSizes[i].second;
+	else
+	{
+		if(clGetKernelWorkGroupInfo(k, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL) != CL_SUCCESS)
+			maxGroup = localWorkSize;
+		kernelGroupSizes.push_back(std::make_pair(k, maxGroup));
+	}
+	return localWorkSize < maxGroup ? localWorkSize : maxGroup;
+}
+
+// Sets the draw counts and lists of the lifecycle step that last finished.
+void OCL::UpdateDrawCounts()
+{
+	CollectLiveCounts();
+	for(size_t i = 0; i < chunks.size(); i++)
+	{
+		vbo_count[i] = (int)liveCounts[i];
+		vbo_index[i] = chunks[i].aliveVbo[aliveList];
+	}
+}
+
+// Reads chunk i's live count after the queued steps without waiting.
+bool OCL::EnqueueLiveCountRead(size_t i)
+{
+	LiveCountRead read = { 0, 0, liveEmitted[i] };
+	liveCountReads[i].push_back(read);
+	LiveCountRead& back = liveCountReads[i].back();
+	cl_int error = clEnqueueReadBuffer(commandQueue, chunks[i].counters, CL_FALSE, 4 * sizeof(cl_uint), sizeof(cl_uint),
+		&back.count, 0, NULL, &back.done);
+	if(error != CL_SUCCESS)
+	{
+		liveCountReads[i].pop_back();
+		printf("Failed to read live count with error code %d(%s)\n",error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+// Takes the live counts of the reads that finished, oldest first, so long
+// batches of queued steps keep their dispatch bounds tight: the newest one
+// plus everything emitted since bounds the live list.
+void OCL::CollectLiveCounts()
+{
+	for(size_t i = 0; i < liveCountReads.size(); i++)
+	{
+		std::deque<LiveCountRead>& reads = liveCountReads[i];
+		while(!reads.empty())
+		{
+			cl_int status = CL_COMPLETE;
+			if(clGetEventInfo(reads.front().done, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL) != CL_SUCCESS)
+				status = -1;
+			if(status > CL_COMPLETE)
+				break;
+			if(status == CL_COMPLETE)
+			{
+				liveCounts[i] = reads.front().count;
+				size_t bound = liveCounts[i] + liveEmitted[i] - reads.front().emitted;
+				liveBounds[i] = bound < chunks[i].count ? bound : chunks[i].count;
+			}
+			clReleaseEvent(reads.front().done);
+			reads.pop_front();
+		}
+	}
+}
+
+// One lifecycle step per chunk: beginLifecycleStep settles the counters and
+// takes the emitted particles off the free list, emitParticles spawns them
+// and updateLiveParticles advances the live list, appending survivors to
+// the other list and the dead to the free list. The new live counts are
+// read back without waiting. OpenCL 1.x has no indirect dispatch, so the
+// update covers the newest count read that finished plus everything
+// emitted since and the kernel checks the exact count.
+bool OCL::EnqueueLifecycle(cl_uint waitCount, const cl_event* waitList, cl_event* event)
+{
+	// Bursts emit burst steps worth of particles every burst launches
+	int period = emitBurst > 1 ? emitBurst : 1;
+	size_t request = 0;
+	if((stepCount / substeps) % period == 0)
+		request = (size_t)emitCount * substeps * period;
+
+	CollectLiveCounts();
+	for(size_t i = 0; i < chunks.size(); i++)
+	{
+		ParticleChunk& c = chunks[i];
+		cl_uint chunkRequest = (cl_uint)(request * c.count / particleCount);
+		cl_uint offset = (cl_uint)(indexBase + c.offset);
+		bool last = i + 1 == chunks.size();
+
+		liveEmitted[i] += chunkRequest;
+		liveBounds[i] += chunkRequest;
+		if(liveBounds[i] > c.count)
+			liveBounds[i] = c.count;
+
+		if( !SetArg(beginKernel, 0, sizeof(cl_mem), &c.counters) ||
+			!SetArg(beginKernel, 1, sizeof(cl_uint), &chunkRequest) ||
+			!Launch(beginKernel, 1, waitCount, waitList, "beginLifecycleStep", NULL) )
+			return false;
+
+		if(chunkRequest > 0 &&
+			(!SetArg(emitKernel, 0, sizeof(cl_mem), &c.pos) ||
+			!SetArg(emitKernel, 1, sizeof(cl_mem), &c.color) ||
+			!SetArg(emitKernel, 2, sizeof(cl_mem), &c.velocities) ||
+			!SetArg(emitKernel, 3, sizeof(cl_mem), &c.alive[aliveList]) ||
+			!SetArg(emitKernel, 4, sizeof(cl_mem), &c.dead) ||
+			!SetArg(emitKernel, 5, sizeof(cl_mem), &c.counters) ||
+			!SetArg(emitKernel, 6, sizeof(cl_uint), &offset) ||
+			!SetArg(emitKernel, 7, sizeof(cl_uint), &stepCount) ||
+			!Launch(emitKernel, chunkRequest, 0, NULL, "emitParticles", NULL)) )
+			return false;
+
+		// At least one work item so there always is an event to return
+		if( !SetArg(kernel, 0, sizeof(cl_mem), &c.pos) ||
+			!SetArg(kernel, 1, sizeof(cl_mem), &c.color) ||
+			!SetArg(kernel, 2, sizeof(cl_mem), &c.velocities) ||
+			!SetArg(kernel, 3, sizeof(cl_mem), &c.alive[aliveList]) ||
+			!SetArg(kernel, 4, sizeof(cl_mem), &c.alive[1 - aliveList]) ||
+			!SetArg(kernel, 5, sizeof(cl_mem), &c.dead) ||
+			!SetArg(kernel, 6, sizeof(cl_mem), &c.counters) ||
+			!Launch(kernel, liveBounds[i] > 0 ? liveBounds[i] : 1, 0, NULL, "updateParticles", last ? event : NULL) ||
+			!EnqueueLiveCountRead(i) )
+			return false;
+	}
+
+	aliveList = 1 - aliveList;
+	stepCount += substeps;
+	return true;
+}
+
+// Queues updateParticles once per chunk and, with unpack, the copy of
+// packed results into the VBOs. The launches wait on waitList and the last
+// one returns event; the queue is in order so that covers all.
+bool OCL::EnqueueUpdate(cl_uint waitCount, const cl_event* waitList, cl_event* event, bool unpack)
+{
+	if( !SetTimeStep() )
+		return false;
+	if(lifecycle)
+		return EnqueueLifecycle(waitCount, waitList, event) && (!grid || EnqueueGrid());
+	if(nbody)
+		return EnqueueBodies(waitCount, waitList, event) && (!grid || EnqueueGrid());
+	if(sph)
+		return EnqueueFluid(waitCount, waitList, event);
+
+	unpack = unpack && unpackKernel;
+	if(procedural && !SetArg(kernel, spawnArg + 1, sizeof(cl_uint), &stepCount))
+		return false;
+
+	for(size_t i = 0; i < chunks.size(); i++)
+	{
+		if(chunks.size() > 1 && !SetChunkArgs(chunks[i]))
+			return false;
+
+		bool last = i + 1 == chunks.size();
+		if( !Launch(kernel, chunks[i].count, waitCount, waitList, "updateParticles", last && !unpack ? event : NULL) )
+			return false;
+
+		if(unpack)
+		{
+			if( !SetUnpackArgs(chunks[i]) ||
+				!Launch(unpackKernel, chunks[i].count, 0, NULL, "unpackParticles", last ? event : NULL) )
+				return false;
+		}
+	}
+	stepCount += substeps;
+	return !grid || EnqueueGrid();
+}
+
+// Queues k over count work items. event, when given, receives the launch's
+// event, which the caller then owns.
+bool OCL::Launch(cl_kernel k, size_t count, cl_uint waitCount, const cl_event* waitList, const char* stage, cl_event* event)
+{
+	cl_int error;
+	cl_event launchEvent = 0;
+	size_t local = LocalSize(k);
+	size_t s = GlobalSize(count, local);
+
+	error = clEnqueueNDRangeKernel(commandQueue,k,1,NULL,&s,local ? &local : NULL,waitCount,waitList,
+		profiler || event ? &launchEvent : NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to execute kernel with error code %d(%s)\n",error, oclErrorString(error));
+		return false;
+	}
+
+	if(event)
+	{
+		*event = launchEvent;
+		if(!profiler)
+			return true;
+		clRetainEvent(launchEvent);
+	}
+	TrackEvent(stage, launchEvent);
+	return true;
+}
+
+// Takes ownership of event and, when profiling, keeps it until
+// CollectProfile() reads its timestamps.
+void OCL::TrackEvent(const char* stage, cl_event event)
+{
+	if(!event)
+		return;
+	if(!profiler)
+	{
+		clReleaseEvent(event);
+		return;
+	}
+	trackedEvents.push_back(event);
+	trackedStages.push_back(stage);
+}
+
+void OCL::CollectProfile()
+{
+	if(primitives)
+		primitives->TakeEvents(trackedEvents, trackedStages);
+	if(trackedEvents.empty())
+		return;
+
+	clWaitForEvents((cl_uint)trackedEvents.size(), &trackedEvents[0]);
+	for(size_t i = 0; i < trackedEvents.size(); i++)
+	{
+		cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+		clGetEventProfilingInfo(trackedEvents[i], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+		clGetEventProfilingInfo(trackedEvents[i], CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, NULL);
+		clGetEventProfilingInfo(trackedEvents[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+		clGetEventProfilingInfo(trackedEvents[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+		profiler->RecordEvent(trackedStages[i], profilerDevice, queued, submit, start, end);
+		clReleaseEvent(trackedEvents[i]);
+	}
+	trackedEvents.clear();
+	trackedStages.clear();
+}
+
+bool OCL::Run(int launches)
+{
+	cl_int error;
+
+	if(headless)
+		return RunSteps(launches * substeps);
+	// Nothing due this frame, the last one is still drawable
+	if(launches <= 0)
+		return true;
+	if(pipelined)
+		return RunPipelined(launches);
+
+	// Makes sure queue is empty
+	glFinish();
+	clFinish(commandQueue);
+	
+	cl_event event = 0;
+	error = clEnqueueAcquireGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],0,NULL,profiler ? &event : NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to acquire GL objects with error code %d(%s)\n",error, oclErrorString(error));
+		return false;
+	}
+	TrackEvent("acquire", event);
+	// Packed layouts only have to unpack the last launch
+	bool updated = true;
+	for(int i = 0; i < launches && updated; i++)
+		updated = EnqueueUpdate(0, NULL, NULL, i + 1 == launches) && EnqueueTrajectory();
+	event = 0;
+	error = clEnqueueReleaseGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],0, NULL, profiler ? &event : NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to release GL Objects with error code %d(%s)\n",error, oclErrorString(error));
+		clFinish(commandQueue);
+		return false;
+	}
+	TrackEvent("release", event);
+
+	clFinish(commandQueue);
+	CollectProfile();
+	if(lifecycle)
+		UpdateDrawCounts();
+
+	return updated;
+}
+
+bool OCL::RunSteps(int steps)
+{
+	// Each launch covers substeps steps
+	int launches = (steps + substeps - 1) / substeps;
+	// Shared buffers are acquired once around all launches
+	if(!headless)
+		return Run(launches);
+
+	// Nothing else touches the buffers, so queue all launches back to back
+	// and only wait once.
+	return Enqueue(launches, NULL) && Finish();
+}
+
+bool OCL::Enqueue(int launches, cl_event* event, cl_event* begin)
+{
+	if(!headless)
+	{
+		printf("Only headless engines queue launches without waiting.\n");
+		return false;
+	}
+	if(begin)
+	{
+		cl_int error = clEnqueueMarker(commandQueue, begin);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to queue marker with error code %d(%s)\n", error, oclErrorString(error));
+			return false;
+		}
+	}
+	for(int i = 0; i < launches; i++)
+		if( !EnqueueUpdate(0, NULL, i + 1 == launches ? event : NULL, false) || !EnqueueTrajectory() )
+			return false;
+	clFlush(commandQueue);
+	return true;
+}
+
+bool OCL::Finish()
+{
+	clFinish(commandQueue);
+	CollectProfile();
+	if(lifecycle)
+		UpdateDrawCounts();
+	return true;
+}
+
+bool OCL::ReadParticles(Vector4* pos, Vector4* vel, Vector4* col)
+{
+	cl_int error = CL_SUCCESS;
+
+	if(layout != LAYOUT_AOS || compact || !headless)
+	{
+		printf("Only headless AoS float engines read their particles back.\n");
+		return false;
+	}
+	for(size_t i = 0; i < chunks.size() && error == CL_SUCCESS; i++)
+	{
+		const ParticleChunk& c = chunks[i];
+		size_t bytes = sizeof(Vector4) * c.count;
+		error = clEnqueueReadBuffer(commandQueue, c.pos, CL_FALSE, 0, bytes, pos + c.offset, 0, NULL, NULL);
+		if(error == CL_SUCCESS)
+			error = clEnqueueReadBuffer(commandQueue, c.velocities, CL_FALSE, 0, bytes, vel + c.offset, 0, NULL, NULL);
+		if(error == CL_SUCCESS)
+			error = clEnqueueReadBuffer(commandQueue, c.color, CL_FALSE, 0, bytes, col + c.offset, 0, NULL, NULL);
+	}
+	clFinish(commandQueue);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to read particles with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+// The new chunks are created from the respawn state, which their static
+// buffers keep, and then overwritten with the current one.
+bool OCL::ReloadData(Vector4* pos, Vector4* vel, Vector4* col, Vector4* posGen, Vector4* velGen, int size)
+{
+	cl_int error = CL_SUCCESS;
+
+	if(layout != LAYOUT_AOS || compact || lifecycle || grid || nbody || !headless)
+	{
+		printf("Only the headless AoS float fountain reloads its particles.\n");
+		return false;
+	}
+	clFinish(commandQueue);
+	ReleaseChunks();
+	if( !LoadData(posGen, velGen, col, size) || !SetChunkArgs(chunks[0]) )
+		return false;
+
+	for(size_t i = 0; i < chunks.size() && error == CL_SUCCESS; i++)
+	{
+		const ParticleChunk& c = chunks[i];
+		size_t bytes = sizeof(Vector4) * c.count;
+		error = clEnqueueWriteBuffer(commandQueue, c.pos, CL_FALSE, 0, bytes, pos + c.offset, 0, NULL, NULL);
+		if(error == CL_SUCCESS)
+			error = clEnqueueWriteBuffer(commandQueue, c.velocities, CL_FALSE, 0, bytes, vel + c.offset, 0, NULL, NULL);
+	}
+	clFinish(commandQueue);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to write particles with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+// Every buffer the next step reads that a step does not rebuild, in the
+// same order for engines set up the same way.
+void OCL::CheckpointBuffers(std::vector<cl_mem>& buffers)
+{
+	for(size_t i = 0; i < chunks.size(); i++)
+	{
+		const ParticleChunk& c = chunks[i];
+		cl_mem chunkBuffers[] = { c.pos, c.color, c.velocities, c.static_pos, c.static_vel,
+			c.state, c.gen, c.alive[0], c.alive[1], c.dead, c.counters };
+		for(int j = 0; j < 11; j++)
+			if(chunkBuffers[j])
+				buffers.push_back(chunkBuffers[j]);
+	}
+	if(bodyMass)
+		buffers.push_back(bodyMass);
+}
+
+cl_uint OCL::CheckpointFeatures()
+{
+	return (compact ? CHECKPOINT_COMPACT : 0) | (procedural ? CHECKPOINT_PROCEDURAL : 0) |
+		(lifecycle ? CHECKPOINT_LIFECYCLE : 0) | (grid ? CHECKPOINT_GRID : 0) |
+		(nbody ? CHECKPOINT_NBODY : 0) | (sph ? CHECKPOINT_SPH : 0);
+}
+
+// Waits for the last frame and takes the shared buffers from GL. The
+// commands queued until ReleaseFromHost() may touch every buffer.
+bool OCL::AcquireForHost()
+{
+	if( !WaitForFrame() )
+		return false;
+	if(headless)
+		return true;
+
+	glFinish();
+	clFinish(commandQueue);
+	cl_int error = clEnqueueAcquireGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],0,NULL,NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to acquire GL objects with error code %d(%s)\n",error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+// Queues the release without waiting for it.
+bool OCL::ReleaseFromHost()
+{
+	if(headless)
+		return true;
+
+	cl_int error = clEnqueueReleaseGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],0,NULL,NULL);
+	clFlush(commandQueue);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to release GL Objects with error code %d(%s)\n",error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+bool OCL::SaveCheckpoint(const char* file, double simulated)
+{
+	const size_t page = 4096;
+	static const char padding[4096] = { 0 };
+
+	if(!initialized || chunks.empty())
+	{
+		printf("Failed to save checkpoint. No particles loaded.\n");
+		return false;
+	}
+
+	std::vector<cl_mem> buffers;
+	CheckpointBuffers(buffers);
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "PCKP", 4);
+	header.version = 1;
+	header.particleCount = particleCount;
+	header.chunkCount = (cl_uint)chunks.size();
+	header.bufferCount = (cl_uint)buffers.size();
+	header.layout = layout;
+	header.aosoaWidth = aosoaWidth;
+	header.integrator = integrator;
+	header.substeps = substeps;
+	header.features = CheckpointFeatures();
+	header.stepCount = stepCount;
+	header.aliveList = aliveList;
+	header.timeStep = timeStep;
+	for(int a = 0; a < 3; a++)
+	{
+		header.boundsOffset[a] = vbo_offset[a];
+		header.boundsScale[a] = vbo_scale[a];
+	}
+	header.simulated = simulated;
+
+	std::vector<CheckpointBuffer> table(buffers.size());
+	size_t end = sizeof(header) + sizeof(CheckpointBuffer) * table.size();
+	for(size_t i = 0; i < buffers.size(); i++)
+	{
+		size_t size = 0;
+		clGetMemObjectInfo(buffers[i], CL_MEM_SIZE, sizeof(size), &size, NULL);
+		table[i].offset = (end + page - 1) / page * page;
+		table[i].size = size;
+		end = (size_t)(table[i].offset + size);
+	}
+
+	FILE* f = fopen(file, "wb");
+	if(!f)
+	{
+		printf("Failed to open %s for writing\n", file);
+		return false;
+	}
+	char* staging = (char*)aligned_malloc(end, page);
+	if(!staging || !AcquireForHost())
+	{
+		aligned_free(staging);
+		fclose(f);
+		return false;
+	}
+
+	// Each buffer goes to disk as soon as its read finishes, overlapping
+	// the writes with the remaining reads.
+	cl_int error = CL_SUCCESS;
+	std::vector<cl_event> reads;
+	for(size_t i = 0; i < buffers.size() && error == CL_SUCCESS; i++)
+	{
+		cl_event read = 0;
+		error = clEnqueueReadBuffer(commandQueue, buffers[i], CL_FALSE, 0, (size_t)table[i].size,
+			staging + table[i].offset, 0, NULL, &read);
+		if(error == CL_SUCCESS)
+			reads.push_back(read);
+	}
+	bool saved = ReleaseFromHost() && error == CL_SUCCESS;
+	if(error != CL_SUCCESS)
+		printf("Failed to read checkpoint buffer with error code %d(%s)\n", error, oclErrorString(error));
+
+	size_t written = sizeof(header) + sizeof(CheckpointBuffer) * table.size();
+	saved = saved && fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(&table[0], sizeof(CheckpointBuffer), table.size(), f) == table.size();
+	for(size_t i = 0; i < reads.size(); i++)
+	{
+		if(saved)
+			saved = clWaitForEvents(1, &reads[i]) == CL_SUCCESS &&
+				fwrite(padding, 1, (size_t)table[i].offset - written, f) == (size_t)table[i].offset - written &&
+				fwrite(staging + table[i].offset, 1, (size_t)table[i].size, f) == (size_t)table[i].size;
+		written = (size_t)(table[i].offset + table[i].size);
+		clReleaseEvent(reads[i]);
+	}
+
+	clFinish(commandQueue);
+	aligned_free(staging);
+	if(fclose(f) != 0)
+		saved = false;
+	if(!saved)
+	{
+		printf("Failed to write checkpoint %s\n", file);
+		return false;
+	}
+	printf("Saved %u buffers of %u particles to %s\n", header.bufferCount, (unsigned int)particleCount, file);
+	return true;
+}
+
+// The buffers are written from the mapped file, so the only copy is the
+// upload itself.
+bool OCL::RestoreCheckpoint(const char* file, double* simulated)
+{
+	size_t length = 0;
+	const char* data = (const char*)map_file(file, &length);
+	if(!data)
+	{
+		printf("Failed to map checkpoint %s\n", file);
+		return false;
+	}
+
+	std::vector<cl_mem> buffers;
+	CheckpointBuffers(buffers);
+	const CheckpointHeader* header = (const CheckpointHeader*)data;
+	const CheckpointBuffer* table = (const CheckpointBuffer*)(header + 1);
+
+	bool valid = length >= sizeof(CheckpointHeader) && memcmp(header->magic, "PCKP", 4) == 0 && header->version == 1;
+	if(!valid)
+		printf("%s is not a version 1 particle checkpoint\n", file);
+	else if(header->particleCount != particleCount || header->chunkCount != chunks.size() ||
+		header->bufferCount != buffers.size() || header->layout != (cl_uint)layout ||
+		header->aosoaWidth != (cl_uint)aosoaWidth || header->integrator != (cl_uint)integrator ||
+		header->substeps != (cl_uint)substeps || header->features != CheckpointFeatures())
+	{
+		printf("%s was saved by an engine set up differently\n", file);
+		valid = false;
+	}
+	else
+	{
+		valid = length >= sizeof(CheckpointHeader) + sizeof(CheckpointBuffer) * buffers.size();
+		for(size_t i = 0; i < buffers.size() && valid; i++)
+		{
+			size_t size = 0;
+			clGetMemObjectInfo(buffers[i], CL_MEM_SIZE, sizeof(size), &size, NULL);
+			valid = table[i].size == size && table[i].offset + table[i].size <= length;
+		}
+		if(!valid)
+			printf("%s is truncated or its buffers don't match\n", file);
+	}
+	if(!valid || !AcquireForHost())
+	{
+		unmap_file(data, length);
+		return false;
+	}
+
+	cl_int error = CL_SUCCESS;
+	for(size_t i = 0; i < buffers.size() && error == CL_SUCCESS; i++)
+		error = clEnqueueWriteBuffer(commandQueue, buffers[i], CL_FALSE, 0, (size_t)table[i].size,
+			data + table[i].offset, 0, NULL, NULL);
+
+	stepCount = header->stepCount;
+	aliveList = header->aliveList;
+	timeStep = header->timeStep;
+	for(int a = 0; a < 3; a++)
+	{
+		vbo_offset[a] = header->boundsOffset[a];
+		vbo_scale[a] = header->boundsScale[a];
+	}
+	if(simulated)
+		*simulated = header->simulated;
+
+	bool restored = error == CL_SUCCESS;
+	if(!restored)
+		printf("Failed to write checkpoint buffer with error code %d(%s)\n", error, oclErrorString(error));
+	if(restored && compact)
+	{
+		float center[4] = { vbo_offset[0], vbo_offset[1], vbo_offset[2], 0.0f };
+		float scale[4] = { vbo_scale[0], vbo_scale[1], vbo_scale[2], 1.0f };
+		restored = SetArg(kernel, 7, sizeof(center), center) && SetArg(kernel, 8, sizeof(scale), scale);
+	}
+	// The live counts come from the restored counters, the SPH grid is
+	// rebuilt by every step anyway.
+	for(size_t i = 0; i < chunks.size() && restored && lifecycle; i++)
+		restored = EnqueueLiveCountRead(i);
+	if(restored && grid && !sph)
+		restored = EnqueueGrid();
+
+	restored = ReleaseFromHost() && restored;
+	clFinish(commandQueue);
+	unmap_file(data, length);
+	if(!restored)
+		return false;
+	if(lifecycle)
+		UpdateDrawCounts();
+	printf("Restored %u particles at step %u from %s\n", (unsigned int)particleCount, stepCount, file);
+	return true;
+}
+
+// One frame buffer per slot, allocated by the driver so it can be pinned
+// and mapped once for the engine's lifetime.
+bool OCL::CreateTrajectoryBuffers()
+{
+	cl_int error;
+
+	if(layout != LAYOUT_AOS || compact)
+	{
+		printf("Only AoS float engines stream trajectories.\n");
+		return false;
+	}
+
+	size_t frameBytes = sizeof(TrajectoryFrame) + 2 * sizeof(Vector4) * particleCount;
+	for(int i = 0; i < trajectory->queueDepth; i++)
+	{
+		cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, frameBytes, NULL, &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create trajectory buffer with error code %d(%s)\n",error, oclErrorString(error));
+			return false;
+		}
+		trajectoryBuffers.push_back(buffer);
+
+		void* slot = clEnqueueMapBuffer(commandQueue, buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, frameBytes, 0, NULL, NULL, &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to map trajectory buffer with error code %d(%s)\n",error, oclErrorString(error));
+			return false;
+		}
+		trajectory->slots.push_back(slot);
+	}
+	return trajectory->Open(particleCount, frameBytes);
+}
+
+// Every trajectory->interval launches, queues reads of the positions and
+// velocities into a free slot and hands it to the writer without waiting.
+bool OCL::EnqueueTrajectory()
+{
+	cl_int error = CL_SUCCESS;
+
+	if(!trajectory)
+		return true;
+	trajectory->Poll();
+	if(++trajectoryLaunches < trajectory->interval)
+		return true;
+	trajectoryLaunches = 0;
+
+	int slot = trajectory->Acquire();
+	TrajectoryFrame* frame = (TrajectoryFrame*)trajectory->slots[slot];
+	frame->step = stepCount;
+	frame->timeStep = timeStep;
+	Vector4* pos = (Vector4*)(frame + 1);
+	Vector4* vel = pos + particleCount;
+
+	cl_event done = 0;
+	for(size_t i = 0; i < chunks.size() && error == CL_SUCCESS; i++)
+	{
+		const ParticleChunk& c = chunks[i];
+		size_t bytes = sizeof(Vector4) * c.count;
+		bool last = i + 1 == chunks.size();
+		error = clEnqueueReadBuffer(commandQueue, c.pos, CL_FALSE, 0, bytes, pos + c.offset, 0, NULL, NULL);
+		if(error == CL_SUCCESS)
+			error = clEnqueueReadBuffer(commandQueue, c.velocities, CL_FALSE, 0, bytes, vel + c.offset, 0, NULL, last ? &done : NULL);
+	}
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to read trajectory frame with error code %d(%s)\n",error, oclErrorString(error));
+		clFinish(commandQueue);
+		if(done)
+			clReleaseEvent(done);
+		trajectory->Cancel(slot);
+		return false;
+	}
+	clFlush(commandQueue);
+	trajectory->Submit(slot, done);
+	return true;
+}
+
+// Chains acquire -> updateParticles -> release by events and returns without
+// waiting. WaitForFrame() has to be called before GL touches the buffers.
+bool OCL::RunPipelined(int launches)
+{
+	cl_int error;
+
+	// The previous frame is complete once WaitForFrame() returned, so its
+	// events can go.
+	ReleaseRunEvents();
+
+	// Without cl_khr_gl_event GL has to be done with the buffers before
+	// they can be acquired.
+	if(!glEventSupported)
+		glFinish();
+
+	error = clEnqueueAcquireGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],0,NULL,&runEvents[0]);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to acquire GL objects with error code %d(%s)\n",error, oclErrorString(error));
+		return false;
+	}
+	if(profiler)
+	{
+		clRetainEvent(runEvents[0]);
+		TrackEvent("acquire", runEvents[0]);
+	}
+	// The first launch waits for the acquire, the last one is released
+	bool updated = true;
+	for(int i = 0; i < launches && updated; i++)
+	{
+		bool last = i + 1 == launches;
+		updated = EnqueueUpdate(i == 0 ? 1 : 0, i == 0 ? &runEvents[0] : NULL, last ? &runEvents[1] : NULL, last) &&
+			EnqueueTrajectory();
+	}
+	// Released even after a failed launch, or GL could never use the
+	// buffers again. The queue is in order, so without the last launch's
+	// event the release still follows everything queued.
+	error = clEnqueueReleaseGLObjects(commandQueue,(cl_uint)glObjects.size(),&glObjects[0],
+		runEvents[1] ? 1 : 0, runEvents[1] ? &runEvents[1] : NULL, &runEvents[2]);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to release GL Objects with error code %d(%s)\n",error, oclErrorString(error));
+		clFinish(commandQueue);
+		ReleaseRunEvents();
+		return false;
+	}
+	if(!updated)
+	{
+		clFinish(commandQueue);
+		ReleaseRunEvents();
+		return false;
+	}
+	if(profiler)
+	{
+		clRetainEvent(runEvents[2]);
+		TrackEvent("release", runEvents[2]);
+	}
+
+	clFlush(commandQueue);
+	return true;
+}
+
+bool OCL::WaitForFrame()
+{
+	cl_int error;
+
+	if(headless || !pipelined || !runEvents[2])
+		return true;
+
+	// cl_khr_gl_event makes GL commands issued after the release wait for
+	// it. Without indirect draws the live counts have to be read anyway.
+	if(!glEventSupported || lifecycle)
+	{
+		error = clWaitForEvents(1, &runEvents[2]);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to wait for release with error code %d(%s)\n",error, oclErrorString(error));
+			return false;
+		}
+	}
+
+	// Reading the timestamps waits for the frame even with cl_khr_gl_event.
+	CollectProfile();
+	if(lifecycle)
+		UpdateDrawCounts();
+	return true;
+}
+
+void OCL::ReleaseRunEvents()
+{
+	for(int i = 0; i < 3; i++)
+	{
+		if(runEvents[i])
+			clReleaseEvent(runEvents[i]);
+		runEvents[i] = 0;
+	}
 }
\ No newline at end of file
@@ -1,42 +1,381 @@
 #pragma once
+#include <string>
+#include <vector>
+#include <deque>
 #include <CL/cl.h>
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 #include "opengl.h"
+#include "Engine.h"
+#include "Primitives.h"
+#include "Trajectory.h"
 
-typedef float Vector4[4];
+// Particles [offset, offset + count) with every buffer small enough for a
+// single device allocation.
+struct ParticleChunk
+{
+	size_t offset, count;
+
+	// Dynamic buffers. pos and color reference the chunk's VBOs unless
+	// headless.
+	cl_mem pos, color;
+	cl_mem velocities;
+
+	// Static buffers
+	cl_mem static_pos, static_vel;
+
+	// Packed layouts only, replacing velocities and the static buffers:
+	// pos.z, vel.z and life, and the respawn pos.z and vel.z.
+	cl_mem state, gen;
+
+	// Lifecycles only: the live lists of this and the next step, the free
+	// list and their counters. Unless headless the live lists are the
+	// aliveVbo element buffers.
+	cl_mem alive[2], dead, counters;
+	GLuint aliveVbo[2];
+};
+
+// Memory layout of the simulation state. AoS updates the float4 buffers in
+// place. SoA and AoSoA (blocks of aosoaWidth particles) keep only the
+// changing components and copy them into the VBOs when rendering.
+enum ParticleLayout
+{
+	LAYOUT_AOS,
+	LAYOUT_SOA,
+	LAYOUT_AOSOA
+};
+
+// Integrator of the update kernels, compiled in with -DINTEGRATOR. Verlet
+// and leapfrog are second order, RK4 fourth.
+enum ParticleIntegrator
+{
+	INTEGRATOR_EULER,
+	INTEGRATOR_VERLET,
+	INTEGRATOR_LEAPFROG,
+	INTEGRATOR_RK4
+};
+
+// Partitioning of a CPU device into a sub-device to run on (OpenCL 1.2
+// device fission), leaving its other cores free.
+enum DeviceFission
+{
+	FISSION_NONE,
+	FISSION_EQUALLY,
+	FISSION_BY_COUNTS,
+	FISSION_BY_NUMA
+};
+
+// Checkpoint file: the header, then a CheckpointBuffer for every device
+// buffer holding particle state (see OCL::CheckpointBuffers()) and their
+// contents at page aligned offsets, so a restore can upload straight from
+// the mapped file. Buffers are stored as the device keeps them, so only an
+// engine set up the same way can continue from it.
+struct CheckpointHeader
+{
+	char magic[4]; // "PCKP"
+	cl_uint version; // 1
+	cl_ulong particleCount;
+	cl_uint chunkCount, bufferCount;
+	cl_uint layout, aosoaWidth, integrator, substeps;
+	cl_uint features; // CHECKPOINT_* of the modes that shape the buffers
+	cl_uint stepCount; // Keys the respawn and emitter RNG
+	cl_uint aliveList;
+	float timeStep;
+	float boundsOffset[3], boundsScale[3]; // Of compact positions
+	double simulated; // Simulated seconds, kept for the caller
+};
 
-class OCL
+struct CheckpointBuffer
+{
+	cl_ulong offset, size;
+};
+
+enum
+{
+	CHECKPOINT_COMPACT = 1 << 0,
+	CHECKPOINT_PROCEDURAL = 1 << 1,
+	CHECKPOINT_LIFECYCLE = 1 << 2,
+	CHECKPOINT_GRID = 1 << 3,
+	CHECKPOINT_NBODY = 1 << 4,
+	CHECKPOINT_SPH = 1 << 5
+};
+
+class OCL : public Engine
 {
 public:
-	OCL(void);
+	// A headless instance uses plain cl_mem buffers instead of shared VBOs and
+	// needs neither a GL context nor a GL sharing capable device.
+	OCL(bool headless = false);
 	~OCL(void);
 
 	bool InitializeContext();
 	bool LoadProgram(const char* file);
 	bool LoadData(Vector4* pos, Vector4* vel, Vector4* col, int size);
 	bool CreateKernel();
-	bool Run();
-
-	// Static buffers
-	cl_mem cl_static_pos, cl_static_vel;
+	bool Run(int launches = 1);
+	bool RunSteps(int steps);
+	bool WaitForFrame();
+	// Headless only: queues launches without waiting, the last one's event
+	// goes to event unless NULL. begin, unless NULL, gets a marker queued
+	// ahead of them, to time them by on a profiling queue. Finish() waits
+	// for them.
+	bool Enqueue(int launches, cl_event* event, cl_event* begin = NULL);
+	bool Finish();
+	// The sub-device when fission partitioned the device.
+	cl_device_id DeviceId() { return deviceId; }
+	// AoS float only: blocking reads of every particle's state.
+	bool ReadParticles(Vector4* pos, Vector4* vel, Vector4* col);
+	// Writes the particle state and simulated to file. The buffers are read
+	// without blocking and written out as each read finishes.
+	bool SaveCheckpoint(const char* file, double simulated);
+	// Continues from a checkpoint of an engine set up the same way, after
+	// CreateKernel(). simulated receives the time saved with it.
+	bool RestoreCheckpoint(const char* file, double* simulated);
+	// Replaces the particles of a fountain built by LoadData() and
+	// CreateKernel(), respawning from posGen and velGen.
+	bool ReloadData(Vector4* pos, Vector4* vel, Vector4* col, Vector4* posGen, Vector4* velGen, int size);
+	// Fused substeps share one read and write of each particle. Packed
+	// layouts read and write 12 bytes, compact ones 16 and the RGBA8 color.
+	// All-pairs bodies are kicked (pos, vel and vel again) and drifted (pos,
+	// vel and pos again), while every work group reads each body's position
+	// and mass once. Tree walks and SPH neighbourhoods have no fixed
+	// traffic and report 0. Valid after CreateKernel().
+	double BytesPerParticleStep()
+	{
+		if(barnesHut || sph)
+			return 0.0;
+		if(nbody)
+			return 96.0 + 20.0 * particleCount / (localWorkSize ? localWorkSize : 1);
+		double bytes = layout != LAYOUT_AOS ? 24.0 : compact ? 40.0 : Engine::BytesPerParticleStep();
+		return bytes / substeps;
+	}
 
-	// Dynamic buffers
-	cl_mem cl_velocities;
-	GLuint vbo_pos, vbo_color;
-	cl_mem cl_glReferances[2];
+	std::vector<ParticleChunk> chunks;
+	std::vector<cl_mem> glObjects; // Every chunk's shared pos and color
 	bool initialized;
+	bool headless;
+	// Chain Run() by events instead of finishing the GL and CL queues.
+	bool pipelined;
+	// Reuse program binaries saved next to the source by earlier runs.
+	bool binaryCache;
+	// Passed to clBuildProgram, part of the binary cache key.
+	std::string buildOptions;
+	// Caps the particles per chunk below what CL_DEVICE_MAX_MEM_ALLOC_SIZE
+	// allows, 0 for no cap.
+	size_t maxChunkParticles;
+	// Platform and device to use, -1 picks one automatically.
+	int platformIndex, deviceIndex;
+	// Clock the profiler files this engine's events under, when several
+	// engines share it.
+	int profilerDevice;
+	// Record profiling timestamps even without a profiler. Set before
+	// InitializeContext().
+	bool profileQueue;
+	// Run on a sub-device of fissionUnits compute units (0 for all but one)
+	// if the device is a CPU, or on its first NUMA node. Set before
+	// InitializeContext().
+	DeviceFission fission;
+	cl_uint fissionUnits;
+	// Global index of the first particle when this engine holds a range of
+	// a larger system, keys the procedural respawns.
+	size_t indexBase;
+	// Local work size of updateParticles, 0 leaves it to the driver.
+	size_t localWorkSize;
+	// Time the candidate local work sizes in CreateKernel() unless one is
+	// set or tuneFile already has a result for this device.
+	bool autotune;
+	std::string tuneFile;
+	// Set before LoadProgram().
+	ParticleLayout layout;
+	int aosoaWidth;
+	// Set before LoadProgram(). N-body and SPH have their own.
+	ParticleIntegrator integrator;
+	// Store positions as 16 bit fixed point inside the scene's bounds,
+	// velocities and life as half and colors as RGBA8. Needs the AoS layout,
+	// set before LoadProgram().
+	bool compact;
+	// Respawn from a counter based RNG in the kernel instead of copies of
+	// the initial state. Set before LoadProgram().
+	bool procedural;
+	// Procedural AoS float particles are also spawned on the device, so
+	// LoadData() takes NULL arrays.
+	bool SpawnsParticles() { return procedural && layout == LAYOUT_AOS && !compact; }
+	// Only update and draw live particles. Dead ones wait on a free list
+	// until the emitter takes emitCount of them a step (-1 for a hundredth
+	// of all particles), in bursts every emitBurst launches. Implies the AoS
+	// float layout and procedural spawns, set before LoadProgram().
+	bool lifecycle;
+	int emitCount;
+	int emitBurst;
+	// Bin the particles into a uniform grid after every step, hashed into
+	// hashSize cells (0 for the particle count rounded up to a power of
+	// two) of cellSize. Kernels find neighbors through cellStart/cellEnd
+	// and sortedIndex, see FOR_EACH_NEIGHBOR in particles.cl. Needs the AoS
+	// float layout and a single chunk, set before LoadProgram().
+	bool grid;
+	float cellSize;
+	size_t hashSize;
+	// All-pairs gravity between the particles instead of the fountain, with
+	// every body's mass in vel.w of the initial state (see init_bodies()).
+	// Work groups stage tiles of bodies in local memory, sized to the device
+	// unless localWorkSize is set. Needs the AoS float layout and a single
+	// chunk, set before LoadProgram().
+	bool nbody;
+	float gravity;
+	float softening;
+	// N-body gravity in O(N log N): bodies are sorted by 30 or 63 bit
+	// Morton codes (mortonBits) into a linear BVH every step, and nodes
+	// smaller than theta times their distance act as one body. Implies
+	// nbody, set before LoadProgram().
+	bool barnesHut;
+	float theta;
+	int mortonBits;
+	// SPH fluid in the box [-0.5, 0.5]^3 instead of the fountain, on the
+	// neighbor grid with cells of the smoothing length, twice sphSpacing
+	// (the initial particle spacing, see init_fluid()). Every step takes as
+	// many density and force passes as the fluid's speed of sound needs.
+	// Implies grid, set before LoadProgram().
+	bool sph;
+	float sphSpacing;
+	float sphRestDensity;
+	float sphStiffness;
+	float sphViscosity;
+	// Static colliders from a signed distance volume (see ColliderHeader in
+	// scene.h), sampled through a 3D image by the update kernel. Particles
+	// running into them bounce off with restitution of their normal speed.
+	// Needs image support and the AoS float fountain, set before
+	// LoadProgram().
+	std::string colliderFile;
+	float restitution;
+	// Streams positions and velocities into the trajectory's file every
+	// trajectory->interval launches, through pinned buffers read without
+	// blocking. Needs the AoS float layout, set before CreateKernel(). The
+	// engine closes it but doesn't delete it.
+	Trajectory* trajectory;
 
 private:
+	bool CreateSubDevice();
 	bool BuildExecutable();
+	std::string ProgramOptions();
+	bool LoadCachedProgram(const char* file, unsigned long long key);
+	void ComputeBounds(Vector4* pos, Vector4* vel, int size);
+	void CompactChunk(Vector4* pos, Vector4* vel, Vector4* col, size_t count,
+		std::vector<short>& posOut, std::vector<unsigned short>& velOut, std::vector<unsigned char>& colOut);
+	bool CreateSharedBuffers(ParticleChunk& chunk, const void* pos, const void* col);
+	bool SpawnParticles();
+	bool CreateLifecycleBuffers(ParticleChunk& chunk);
+	bool CreateGrid();
+	bool EnqueueGrid();
+	bool CreateBodies(Vector4* vel);
+	bool CreateBodyKernels();
+	bool EnqueueBodies(cl_uint waitCount, const cl_event* waitList, cl_event* event);
+	bool CreateTree();
+	bool EnqueueTree();
+	bool CreateFluid();
+	bool EnqueueFluid(cl_uint waitCount, const cl_event* waitList, cl_event* event);
+	bool CreateCollider();
+	bool SetTimeStep();
+	bool SetColliderArgs();
+	bool CreateBuffer(cl_mem* buffer, const void* data, size_t bytes, bool blocking = false);
+	size_t PackedIndex(int f, int fields, size_t i, size_t count);
+	size_t PackedSize(int fields, size_t count);
+	bool SetArg(cl_kernel k, cl_uint index, size_t size, const void* value);
+	bool SetChunkArgs(const ParticleChunk& chunk);
+	bool SetUnpackArgs(const ParticleChunk& chunk);
+	bool TuneWorkGroupSize();
+	void ReleaseScratch(ParticleChunk& scratch);
+	void ReleaseChunks();
+	size_t GlobalSize(size_t count, size_t local);
+	size_t LocalSize(cl_kernel k);
+	bool EnqueueUpdate(cl_uint waitCount, const cl_event* waitList, cl_event* event, bool unpack = false);
+	bool EnqueueLifecycle(cl_uint waitCount, const cl_event* waitList, cl_event* event);
+	void UpdateDrawCounts();
+	bool EnqueueLiveCountRead(size_t i);
+	void CollectLiveCounts();
+	bool Launch(cl_kernel k, size_t count, cl_uint waitCount, const cl_event* waitList, const char* stage, cl_event* event);
+	void TrackEvent(const char* stage, cl_event event);
+	void CollectProfile();
+	bool RunPipelined(int launches);
+	bool CreateTrajectoryBuffers();
+	bool EnqueueTrajectory();
+	void CheckpointBuffers(std::vector<cl_mem>& buffers);
+	cl_uint CheckpointFeatures();
+	bool AcquireForHost();
+	bool ReleaseFromHost();
+	void ReleaseRunEvents();
 
 	cl_platform_id platformId;
 	cl_device_id deviceId;
+	cl_device_id parentDeviceId; // Of deviceId if it is a sub-device
 	cl_context context;
 	cl_command_queue commandQueue;
 	cl_program program;
 	cl_kernel kernel;
+	cl_kernel unpackKernel;
+	cl_kernel beginKernel, emitKernel;
+	int dtArg; // Index of the dt argument of kernel
+	float kernelTimeStep; // timeStep the kernels were last given
+	int spawnArg; // Index of the chunk offset, followed by the step count
+	cl_uint stepCount; // Steps run so far, keys the respawn RNG
+
+	int aliveList; // Live list of the next step
+	// A chunk's live count read after a step, with the particles emitted
+	// up to that step.
+	struct LiveCountRead
+	{
+		cl_event done;
+		cl_uint count;
+		size_t emitted;
+	};
+	std::vector<std::deque<LiveCountRead> > liveCountReads; // Not yet collected, oldest first
+	std::vector<unsigned int> liveCounts; // Newest collected
+	std::vector<size_t> liveBounds; // Live count upper bounds for dispatch
+	std::vector<size_t> liveEmitted; // Particles emitted so far
+
+	cl_kernel moveKernel; // N-body drift, kernel does the kick
+	cl_mem bodyMass;
+
+	enum { TREE_MORTON, TREE_BUILD, TREE_SUMMARIZE, TREE_KERNELS };
+	cl_kernel treeKernels[TREE_KERNELS];
+	cl_mem boundsMin, boundsMax;
+	cl_mem mortonKeys, bodyOrder; // Sorted together, the body of every leaf
+	cl_mem nodeLeft, nodeRight, nodeParent, nodeVisits;
+	cl_mem nodeCom, nodeMin, nodeMax; // Center of mass and mass, bounds
+
+	cl_kernel reorderKernel, densityKernel; // sphForces is kernel
+	cl_mem sortedPos, sortedVel, fluidState; // In grid order
+	int fluidPasses; // Per step, each over dt / fluidPasses
+
+	cl_mem collider; // Normal and distance of every sample
+	float colliderOrigin[4];
+	float colliderScale; // Samples per unit
+
+	std::vector<cl_mem> trajectoryBuffers; // Pinned, mapped as the slots
+	int trajectoryLaunches; // Since the last frame
+
+	// Scans, sorts and reductions from primitives.cl, loaded with the
+	// program when a feature needs them.
+	Primitives* primitives;
+
+	enum { GRID_CLEAR, GRID_HASH, GRID_SCATTER, GRID_FINISH, GRID_KERNELS };
+	cl_kernel gridKernels[GRID_KERNELS];
+	cl_mem cellStart, cellEnd; // Range of every cell in sortedIndex
+	cl_mem particleCell, particleRank; // Cell and slot in it of every particle
+	cl_mem sortedIndex; // Particle indices ordered by cell
+
+	size_t particleCount;
+	size_t posSize, velSize, colorSize; // Bytes per particle
+
+	bool glEventSupported;
+	cl_event runEvents[3]; // acquire, updateParticles, release
+
+	// CL_KERNEL_WORK_GROUP_SIZE of every kernel Launch() ran
+	std::vector<std::pair<cl_kernel, size_t> > kernelGroupSizes;
 
-	int buffersSize;
+	// Events waiting to be read by CollectProfile()
+	std::vector<cl_event> trackedEvents;
+	std::vector<const char*> trackedStages;
 	
 };
 
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <string>
+
+#include "Primitives.h"
+#include "util.h"
+
+// Digits per radix sort pass, RADIX in primitives.cl
+static const size_t RADIX = 16;
+
+Primitives::Primitives(cl_context context, cl_device_id device, cl_command_queue queue)
+{
+	this->context = context;
+	deviceId = device;
+	commandQueue = queue;
+	program = 0;
+	for(int i = 0; i < KERNEL_COUNT; i++)
+		kernels[i] = 0;
+	profiling = false;
+	binaryCache = false;
+	groupSize = items = 0;
+}
+
+Primitives::~Primitives(void)
+{
+	ReleaseKernels();
+	if(program)
+		clReleaseProgram(program);
+	for(size_t i = 0; i < scratch.size(); i++)
+		if(scratch[i])
+			clReleaseMemObject(scratch[i]);
+	for(size_t i = 0; i < events.size(); i++)
+		clReleaseEvent(events[i]);
+}
+
+void Primitives::ReleaseKernels()
+{
+	for(int i = 0; i < KERNEL_COUNT; i++)
+	{
+		if(kernels[i])
+			clReleaseKernel(kernels[i]);
+		kernels[i] = 0;
+	}
+}
+
+// Picks the tile so the radix sort's, the hungriest kernel's, local arrays
+// fit: 64 bit keys plus a digit count per work item and digit. Work items
+// are given up for fewer elements each first, then the group shrinks.
+bool Primitives::Load(const char* file)
+{
+	int length;
+	char* source = read_file(file, &length);
+	if(length <= 0)
+	{
+		printf("Could not read \"%s\"\n", file);
+		return false;
+	}
+
+	cl_ulong localMem = 0;
+	size_t maxGroup = 0;
+	clGetDeviceInfo(deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMem, NULL);
+	clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL);
+
+	for(groupSize = 1; groupSize * 2 <= maxGroup && groupSize < 256; groupSize *= 2);
+	items = 8;
+	// A little left over for what the compiler needs itself
+	while(groupSize >= RADIX && groupSize * (items * sizeof(cl_ulong) + RADIX * sizeof(cl_uint)) + 256 > localMem)
+	{
+		if(items > 1)
+			items /= 2;
+		else
+			groupSize /= 2;
+	}
+
+	// A kernel may allow less than the device, then the group shrinks
+	// until all of them take it.
+	bool built = false;
+	while(!built && groupSize >= RADIX)
+	{
+		if( !Build(file, source, length) )
+			break;
+
+		built = true;
+		for(int i = 0; i < KERNEL_COUNT && built; i++)
+		{
+			size_t kernelGroup = 0;
+			clGetKernelWorkGroupInfo(kernels[i], deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelGroup, NULL);
+			built = kernelGroup >= groupSize;
+		}
+		if(!built)
+			groupSize /= 2;
+	}
+	free(source);
+
+	if(!built)
+	{
+		printf("Failed to build the parallel primitives.\n");
+		return false;
+	}
+	printf("Parallel primitives: groups of %u, %u elements per work item, %u bytes of local memory\n",
+		(unsigned int)groupSize, (unsigned int)items, (unsigned int)localMem);
+	return true;
+}
+
+// Every tile Load() tries is its own cache file, keyed by the options.
+bool Primitives::Build(const char* file, const char* source, size_t length)
+{
+	cl_int error = CL_SUCCESS;
+	ReleaseKernels();
+	if(program)
+		clReleaseProgram(program);
+
+	char options[64];
+	sprintf(options, "-DGROUP_SIZE=%u -DITEMS=%u", (unsigned int)groupSize, (unsigned int)items);
+
+	std::string cacheFile;
+	unsigned long long key = 0;
+	program = 0;
+	if(binaryCache)
+	{
+		key = oclProgramCacheKey(deviceId, file, options, source, length, cacheFile);
+		program = oclLoadProgramBinary(context, deviceId, cacheFile.c_str(), key);
+		if(program && clBuildProgram(program, 1, &deviceId, options, NULL, NULL) != CL_SUCCESS)
+		{
+			printf("Cached program binary rejected, rebuilding from source.\n");
+			clReleaseProgram(program);
+			program = 0;
+			remove(cacheFile.c_str());
+		}
+	}
+	bool cached = program != 0;
+
+	if(!cached)
+	{
+		program = clCreateProgramWithSource(context, 1, &source, &length, &error);
+		if(error != CL_SUCCESS)
+		{
+			program = 0;
+			printf("Failed to create the primitives program with error code %d(%s)\n", error, oclErrorString(error));
+			return false;
+		}
+		error = clBuildProgram(program, 1, &deviceId, options, NULL, NULL);
+	}
+	if(error != CL_SUCCESS)
+	{
+		size_t size = 0;
+		clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+		char* log = new char[size + 1];
+		clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, size, log, NULL);
+		log[size] = '\0';
+		printf("Failed to build the primitives with error code %d(%s)\nBUILD LOG: \n %s", error, oclErrorString(error), log);
+		delete [] log;
+		return false;
+	}
+	if(binaryCache && !cached)
+		oclSaveProgramBinary(program, cacheFile.c_str(), key);
+
+	const char* names[KERNEL_COUNT] = { "scanTiles", "addTileSums", "segmentBases", "segmentFinish", "compactScatter",
+		"radixCount32", "radixScatter32", "radixCount64", "radixScatter64", "reduceUint", "reduceFloat", "reduceFloat4" };
+	for(int i = 0; i < KERNEL_COUNT; i++)
+	{
+		kernels[i] = clCreateKernel(program, names[i], &error);
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create kernel %s with error code %d(%s)\n", names[i], error, oclErrorString(error));
+			return false;
+		}
+	}
+	return true;
+}
+
+void Primitives::TakeEvents(std::vector<cl_event>& events, std::vector<const char*>& stages)
+{
+	events.insert(events.end(), this->events.begin(), this->events.end());
+	stages.insert(stages.end(), this->stages.begin(), this->stages.end());
+	this->events.clear();
+	this->stages.clear();
+}
+
+bool Primitives::ExclusiveScan(cl_mem in, cl_mem out, size_t n)
+{
+	return n == 0 || ScanLevel(in, out, n, 0);
+}
+
+// Scans every tile and, with more than one, the tile totals into the
+// offsets added back to the tiles.
+bool Primitives::ScanLevel(cl_mem in, cl_mem out, size_t n, size_t level)
+{
+	cl_kernel scan = kernels[SCAN_TILES], add = kernels[ADD_TILE_SUMS];
+	size_t tiles = Tiles(n);
+	cl_mem sums = 0;
+	cl_uint size = (cl_uint)n;
+
+	if(tiles > 1 && !Scratch(SCRATCH_SCAN + (int)level, sizeof(cl_uint) * tiles, &sums))
+		return false;
+	if( !SetArg(scan, 0, sizeof(cl_mem), &in) || !SetArg(scan, 1, sizeof(cl_mem), &out) ||
+		!SetArg(scan, 2, sizeof(cl_mem), &sums) || !SetArg(scan, 3, sizeof(cl_uint), &size) ||
+		!LaunchTiles(SCAN_TILES, n, "scan") )
+		return false;
+	if(tiles == 1)
+		return true;
+
+	return ScanLevel(sums, sums, tiles, level + 1) &&
+		SetArg(add, 0, sizeof(cl_mem), &out) && SetArg(add, 1, sizeof(cl_mem), &sums) &&
+		SetArg(add, 2, sizeof(cl_uint), &size) &&
+		LaunchTiles(ADD_TILE_SUMS, n, "scan");
+}
+
+// A plain scan of the values and one of the head flags numbering the
+// segments, then every element drops the sum before its segment's head.
+bool Primitives::SegmentedScan(cl_mem in, cl_mem heads, cl_mem out, size_t n)
+{
+	cl_mem ids, bases;
+	cl_uint size = (cl_uint)n;
+	if(n == 0)
+		return true;
+	if( !ExclusiveScan(in, out, n) ||
+		!Scratch(SCRATCH_IDS, sizeof(cl_uint) * n, &ids) || !Scratch(SCRATCH_BASES, sizeof(cl_uint) * (n + 1), &bases) ||
+		!ExclusiveScan(heads, ids, n) )
+		return false;
+
+	for(int k = SEGMENT_BASES; k <= SEGMENT_FINISH; k++)
+	{
+		if( !SetArg(kernels[k], 0, sizeof(cl_mem), &out) || !SetArg(kernels[k], 1, sizeof(cl_mem), &ids) ||
+			!SetArg(kernels[k], 2, sizeof(cl_mem), &heads) || !SetArg(kernels[k], 3, sizeof(cl_mem), &bases) ||
+			!SetArg(kernels[k], 4, sizeof(cl_uint), &size) ||
+			!LaunchItems(k, n, "segmentedScan") )
+			return false;
+	}
+	return true;
+}
+
+// One counting pass and one scatter per 4 bit digit, alternating between
+// the given buffers and scratch ones. After an odd number of passes the
+// result is copied back.
+bool Primitives::SortPairs(cl_mem keys, cl_mem values, size_t n, int keyBits)
+{
+	bool wide = keyBits > 32;
+	size_t keySize = wide ? sizeof(cl_ulong) : sizeof(cl_uint);
+	size_t digits = RADIX * Tiles(n);
+	int passes = (keyBits + 3) / 4;
+	cl_mem tmpKeys, tmpValues, counts;
+	cl_uint size = (cl_uint)n;
+	cl_kernel count = kernels[wide ? RADIX_COUNT_64 : RADIX_COUNT_32];
+	cl_kernel scatter = kernels[wide ? RADIX_SCATTER_64 : RADIX_SCATTER_32];
+
+	if(n <= 1 || passes <= 0)
+		return true;
+	if( !Scratch(SCRATCH_KEYS, keySize * n, &tmpKeys) || !Scratch(SCRATCH_VALUES, sizeof(cl_uint) * n, &tmpValues) ||
+		!Scratch(SCRATCH_COUNTS, sizeof(cl_uint) * digits, &counts) )
+		return false;
+
+	cl_mem src[2] = { keys, values }, dst[2] = { tmpKeys, tmpValues };
+	for(int pass = 0; pass < passes; pass++)
+	{
+		cl_uint shift = pass * 4;
+		if( !SetArg(count, 0, sizeof(cl_mem), &src[0]) || !SetArg(count, 1, sizeof(cl_mem), &counts) ||
+			!SetArg(count, 2, sizeof(cl_uint), &size) || !SetArg(count, 3, sizeof(cl_uint), &shift) ||
+			!LaunchTiles(wide ? RADIX_COUNT_64 : RADIX_COUNT_32, n, "radixCount") ||
+			!ExclusiveScan(counts, counts, digits) )
+			return false;
+
+		if( !SetArg(scatter, 0, sizeof(cl_mem), &src[0]) || !SetArg(scatter, 1, sizeof(cl_mem), &src[1]) ||
+			!SetArg(scatter, 2, sizeof(cl_mem), &dst[0]) || !SetArg(scatter, 3, sizeof(cl_mem), &dst[1]) ||
+			!SetArg(scatter, 4, sizeof(cl_mem), &counts) || !SetArg(scatter, 5, sizeof(cl_uint), &size) ||
+			!SetArg(scatter, 6, sizeof(cl_uint), &shift) ||
+			!LaunchTiles(wide ? RADIX_SCATTER_64 : RADIX_SCATTER_32, n, "radixScatter") )
+			return false;
+		for(int i = 0; i < 2; i++)
+		{
+			cl_mem t = src[i];
+			src[i] = dst[i];
+			dst[i] = t;
+		}
+	}
+
+	if(passes % 2 == 0)
+		return true;
+	cl_int error = clEnqueueCopyBuffer(commandQueue, tmpKeys, keys, 0, 0, keySize * n, 0, NULL, NULL);
+	if(error == CL_SUCCESS)
+		error = clEnqueueCopyBuffer(commandQueue, tmpValues, values, 0, 0, sizeof(cl_uint) * n, 0, NULL, NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to copy the sorted pairs with error code %d(%s)\n", error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+bool Primitives::ReduceUint(cl_mem in, cl_mem result, size_t n, ReduceOp op)
+{
+	cl_uint identity = op == REDUCE_MIN ? 0xFFFFFFFFu : 0;
+	return Reduce(REDUCE_UINT, in, result, n, sizeof(cl_uint), op, &identity);
+}
+
+bool Primitives::ReduceFloat(cl_mem in, cl_mem result, size_t n, ReduceOp op)
+{
+	cl_float identity = op == REDUCE_MIN ? FLT_MAX : op == REDUCE_MAX ? -FLT_MAX : 0.0f;
+	return Reduce(REDUCE_FLOAT, in, result, n, sizeof(cl_float), op, &identity);
+}
+
+bool Primitives::ReduceFloat4(cl_mem in, cl_mem result, size_t n, ReduceOp op)
+{
+	cl_float v = op == REDUCE_MIN ? FLT_MAX : op == REDUCE_MAX ? -FLT_MAX : 0.0f;
+	cl_float identity[4] = { v, v, v, v };
+	return Reduce(REDUCE_FLOAT4, in, result, n, sizeof(identity), op, identity);
+}
+
+// Every pass reduces each tile to one element until a single tile is
+// left, which reduces into result. An empty input gives the identity.
+bool Primitives::Reduce(int k, cl_mem in, cl_mem result, size_t n, size_t size, ReduceOp op, const void* identity)
+{
+	cl_uint operation = (cl_uint)op;
+	cl_mem src = in;
+	for(int level = 0; ; level++)
+	{
+		size_t tiles = n > 0 ? Tiles(n) : 1;
+		cl_mem dst = result;
+		cl_uint count = (cl_uint)n;
+		if(tiles > 1 && !Scratch(SCRATCH_REDUCE + level % 2, size * tiles, &dst))
+			return false;
+
+		if( !SetArg(kernels[k], 0, sizeof(cl_mem), &src) || !SetArg(kernels[k], 1, sizeof(cl_mem), &dst) ||
+			!SetArg(kernels[k], 2, sizeof(cl_uint), &count) || !SetArg(kernels[k], 3, sizeof(cl_uint), &operation) ||
+			!SetArg(kernels[k], 4, size, identity) ||
+			!LaunchTiles(k, n > 0 ? n : 1, "reduce") )
+			return false;
+		if(tiles == 1)
+			return true;
+		src = dst;
+		n = tiles;
+	}
+}
+
+bool Primitives::Compact(cl_mem in, cl_mem flags, cl_mem out, cl_mem count, size_t n)
+{
+	cl_kernel k = kernels[COMPACT_SCATTER];
+	cl_mem pos;
+	cl_uint size = (cl_uint)n;
+	if(n == 0)
+	{
+		cl_uint zero = 0;
+		return clEnqueueWriteBuffer(commandQueue, count, CL_TRUE, 0, sizeof(cl_uint), &zero, 0, NULL, NULL) == CL_SUCCESS;
+	}
+
+	return Scratch(SCRATCH_IDS, sizeof(cl_uint) * n, &pos) && ExclusiveScan(flags, pos, n) &&
+		SetArg(k, 0, sizeof(cl_mem), &in) && SetArg(k, 1, sizeof(cl_mem), &flags) &&
+		SetArg(k, 2, sizeof(cl_mem), &pos) && SetArg(k, 3, sizeof(cl_mem), &out) &&
+		SetArg(k, 4, sizeof(cl_mem), &count) && SetArg(k, 5, sizeof(cl_uint), &size) &&
+		LaunchItems(COMPACT_SCATTER, n, "compact");
+}
+
+// Scratch buffer slot with room for at least bytes. Replaced buffers may
+// still be in use by queued commands, which keep them alive.
+bool Primitives::Scratch(int slot, size_t bytes, cl_mem* buffer)
+{
+	if((size_t)slot >= scratch.size())
+	{
+		scratch.resize(slot + 1, 0);
+		scratchSize.resize(slot + 1, 0);
+	}
+	if(scratchSize[slot] < bytes)
+	{
+		cl_int error;
+		if(scratch[slot])
+			clReleaseMemObject(scratch[slot]);
+		scratch[slot] = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &error);
+		if(error != CL_SUCCESS)
+		{
+			scratch[slot] = 0;
+			scratchSize[slot] = 0;
+			printf("Failed to create scratch buffer with error code %d(%s)\n", error, oclErrorString(error));
+			return false;
+		}
+		scratchSize[slot] = bytes;
+	}
+	*buffer = scratch[slot];
+	return true;
+}
+
+bool Primitives::SetArg(cl_kernel k, cl_uint index, size_t size, const void* value)
+{
+	cl_int error = clSetKernelArg(k, index, size, value);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to set kernel argument %u with error code %d(%s)\n",index,error, oclErrorString(error));
+		return false;
+	}
+	return true;
+}
+
+// One work group per tile of n elements.
+bool Primitives::LaunchTiles(int k, size_t n, const char* stage)
+{
+	cl_event event = 0;
+	size_t global = Tiles(n) * groupSize;
+
+	cl_int error = clEnqueueNDRangeKernel(commandQueue,kernels[k],1,NULL,&global,&groupSize,0,NULL,profiling ? &event : NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to execute %s with error code %d(%s)\n",stage,error, oclErrorString(error));
+		return false;
+	}
+	if(event)
+	{
+		events.push_back(event);
+		stages.push_back(stage);
+	}
+	return true;
+}
+
+// One work item per element.
+bool Primitives::LaunchItems(int k, size_t n, const char* stage)
+{
+	cl_event event = 0;
+	size_t global = (n + groupSize - 1) / groupSize * groupSize;
+
+	cl_int error = clEnqueueNDRangeKernel(commandQueue,kernels[k],1,NULL,&global,&groupSize,0,NULL,profiling ? &event : NULL);
+	if(error != CL_SUCCESS)
+	{
+		printf("Failed to execute %s with error code %d(%s)\n",stage,error, oclErrorString(error));
+		return false;
+	}
+	if(event)
+	{
+		events.push_back(event);
+		stages.push_back(stage);
+	}
+	return true;
+}
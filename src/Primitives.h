@@ -0,0 +1,80 @@
+#pragma once
+#include <vector>
+#include <CL/cl.h>
+
+// Host side of primitives.cl: scans, a key-value radix sort, reductions and
+// stream compaction over cl_mem buffers. Everything is queued in order on
+// the given queue without waiting, scratch buffers are kept between calls.
+// The tile of every work group is sized to the device's local memory.
+class Primitives
+{
+public:
+	enum ReduceOp { REDUCE_SUM, REDUCE_MIN, REDUCE_MAX };
+
+	Primitives(cl_context context, cl_device_id device, cl_command_queue queue);
+	~Primitives(void);
+
+	bool Load(const char* file);
+
+	// n uints from in to out, which may be the same buffer.
+	bool ExclusiveScan(cl_mem in, cl_mem out, size_t n);
+	// Restarts the sum at every element whose head flag (0 or 1) is set.
+	bool SegmentedScan(cl_mem in, cl_mem heads, cl_mem out, size_t n);
+	// Stable sort of n uint values by uint (keyBits <= 32) or ulong keys,
+	// of which only the low keyBits take part.
+	bool SortPairs(cl_mem keys, cl_mem values, size_t n, int keyBits = 32);
+	// Reduces n elements into the first element of result.
+	bool ReduceUint(cl_mem in, cl_mem result, size_t n, ReduceOp op);
+	bool ReduceFloat(cl_mem in, cl_mem result, size_t n, ReduceOp op);
+	// Per component, e.g. the bounds of float4 positions.
+	bool ReduceFloat4(cl_mem in, cl_mem result, size_t n, ReduceOp op);
+	// The uints of in whose flag (0 or 1) is set, in order, to out, and
+	// their number to the first element of count.
+	bool Compact(cl_mem in, cl_mem flags, cl_mem out, cl_mem count, size_t n);
+
+	// Launch events are kept for TakeEvents() while set.
+	bool profiling;
+	// Builds go through the program binary cache while set.
+	bool binaryCache;
+	void TakeEvents(std::vector<cl_event>& events, std::vector<const char*>& stages);
+
+	// Work items per group and elements per work item, set by Load().
+	size_t groupSize, items;
+
+private:
+	enum
+	{
+		SCAN_TILES, ADD_TILE_SUMS, SEGMENT_BASES, SEGMENT_FINISH, COMPACT_SCATTER,
+		RADIX_COUNT_32, RADIX_SCATTER_32, RADIX_COUNT_64, RADIX_SCATTER_64,
+		REDUCE_UINT, REDUCE_FLOAT, REDUCE_FLOAT4, KERNEL_COUNT
+	};
+	// Scratch buffers, the scan's block sums take one slot per level from
+	// SCRATCH_SCAN on.
+	enum
+	{
+		SCRATCH_IDS, SCRATCH_BASES, SCRATCH_KEYS, SCRATCH_VALUES, SCRATCH_COUNTS,
+		SCRATCH_REDUCE, SCRATCH_SCAN = SCRATCH_REDUCE + 2
+	};
+
+	bool Build(const char* file, const char* source, size_t length);
+	void ReleaseKernels();
+	bool ScanLevel(cl_mem in, cl_mem out, size_t n, size_t level);
+	bool Reduce(int k, cl_mem in, cl_mem result, size_t n, size_t size, ReduceOp op, const void* identity);
+	bool Scratch(int slot, size_t bytes, cl_mem* buffer);
+	bool SetArg(cl_kernel k, cl_uint index, size_t size, const void* value);
+	bool LaunchTiles(int k, size_t n, const char* stage);
+	bool LaunchItems(int k, size_t n, const char* stage);
+	size_t Tiles(size_t n) { return (n + groupSize * items - 1) / (groupSize * items); }
+
+	cl_context context;
+	cl_device_id deviceId;
+	cl_command_queue commandQueue;
+	cl_program program;
+	cl_kernel kernels[KERNEL_COUNT];
+
+	std::vector<cl_mem> scratch;
+	std::vector<size_t> scratchSize;
+
+	std::vector<cl_event> events;
+	std::vector<const char*> stages;
+};
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "Profiler.h"
+
+Profiler::Profiler(int window)
+{
+	this->window = window > 0 ? window : 1;
+	frame = 0;
+	haveHostBase = false;
+	hostBase = 0.0;
+	csv = NULL;
+	written = 0;
+}
+
+Profiler::~Profiler()
+{
+	Close();
+}
+
+bool Profiler::Open(const char* file)
+{
+	Close();
+	csv = fopen(file, "w");
+	if(!csv)
+	{
+		printf("Unable to open %s for writing\n", file);
+		return false;
+	}
+	csvFile = file;
+	written = 0;
+	fprintf(csv, "frame,stage,clock,queued_ns,submit_ns,start_ns,end_ns\n");
+	return true;
+}
+
+void Profiler::Close()
+{
+	if(!csv)
+		return;
+	bool failed = ferror(csv) != 0;
+	failed = fclose(csv) != 0 || failed;
+	csv = NULL;
+	if(failed)
+		printf("Failed to write %s, the timings are incomplete\n", csvFile.c_str());
+	printf("Wrote %lld timing samples to %s\n", written, csvFile.c_str());
+}
+
+// Signed, a device's samples may come in out of order.
+void Profiler::RecordEvent(const char* stage, int device, unsigned long long queued, unsigned long long submit,
+	unsigned long long start, unsigned long long end)
+{
+	if(device < 0)
+		device = 0;
+	if((int)deviceBase.size() <= device)
+	{
+		deviceBase.resize(device + 1, 0);
+		haveDeviceBase.resize(device + 1, false);
+	}
+	if(!haveDeviceBase[device])
+	{
+		deviceBase[device] = queued;
+		haveDeviceBase[device] = true;
+	}
+	unsigned long long base = deviceBase[device];
+	Add(stage, device, (double)(long long)(queued - base), (double)(long long)(submit - base),
+		(double)(long long)(start - base), (double)(long long)(end - base));
+}
+
+void Profiler::RecordHost(const char* stage, double start, double end)
+{
+	if(!haveHostBase)
+	{
+		hostBase = start;
+		haveHostBase = true;
+	}
+	double s = (start - hostBase) * 1e9;
+	double e = (end - hostBase) * 1e9;
+	Add(stage, -1, s, s, s, e);
+}
+
+void Profiler::NextFrame()
+{
+	frame++;
+}
+
+int Profiler::FindStage(const char* name, int device)
+{
+	for(size_t i = 0; i < stages.size(); i++)
+		if(stages[i].name == name && stages[i].device == device)
+			return (int)i;
+
+	Stage stage;
+	stage.name = name;
+	stage.device = device;
+	stage.next = 0;
+	stage.count = 0;
+	stages.push_back(stage);
+	return (int)stages.size() - 1;
+}
+
+void Profiler::Add(const char* stage, int device, double queued, double submit, double start, double end)
+{
+	// ns relative to the first sample on the same clock
+	Stage& s = stages[FindStage(stage, device)];
+	if(csv)
+	{
+		fprintf(csv, "%d,%s,%s,%.0f,%.0f,%.0f,%.0f\n", frame, s.name.c_str(), ClockName(device).c_str(),
+			queued, submit, start, end);
+		written++;
+	}
+
+	double ms = (end - start) * 1e-6;
+	if((int)s.durations.size() < window)
+		s.durations.push_back(ms);
+	else
+		s.durations[s.next] = ms;
+	s.next = (s.next + 1) % window;
+	s.count++;
+}
+
+// "host", or "device" and its number.
+std::string Profiler::ClockName(int device)
+{
+	if(device < 0)
+		return "host";
+	char name[32];
+	sprintf(name, "device%d", device);
+	return name;
+}
+
+void Profiler::PrintSummary()
+{
+	printf("Stage timings over the last %d samples (ms):\n", window);
+	printf("  %-20s %-8s %10s %10s %10s %10s\n", "stage", "clock", "samples", "min", "mean", "p99");
+	for(size_t i = 0; i < stages.size(); i++)
+	{
+		std::vector<double> d = stages[i].durations;
+		if(d.empty())
+			continue;
+
+		double sum = 0.0;
+		for(size_t j = 0; j < d.size(); j++)
+			sum += d[j];
+
+		size_t p99 = (d.size() * 99) / 100;
+		if(p99 >= d.size())
+			p99 = d.size() - 1;
+		std::nth_element(d.begin(), d.begin() + p99, d.end());
+		double p99Value = d[p99];
+		double minValue = *std::min_element(d.begin(), d.end());
+
+		printf("  %-20s %-8s %10lld %10.4f %10.4f %10.4f\n", stages[i].name.c_str(), ClockName(stages[i].device).c_str(),
+			stages[i].count, minValue, sum / d.size(), p99Value);
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Collects per frame timings of named stages, both from OpenCL profiling
+// events (device clock, ns) and host timers (get_time, s). Every sample
+// goes straight to the CSV, only the last window durations of each stage
+// are kept for rolling min/mean/p99. Every device has its own clock, so its samples are
+// timed from its own first one and its stages are kept apart.
+class Profiler
+{
+public:
+	Profiler(int window = 1024);
+	~Profiler();
+
+	// Starts the CSV the samples are written to as they come in.
+	bool Open(const char* file);
+	void Close();
+
+	// device numbers the clock the timestamps come from, from 0.
+	void RecordEvent(const char* stage, int device, unsigned long long queued, unsigned long long submit,
+		unsigned long long start, unsigned long long end);
+	void RecordHost(const char* stage, double start, double end);
+	void NextFrame();
+
+	void PrintSummary();
+
+private:
+	struct Stage
+	{
+		std::string name;
+		int device; // -1 for the host
+		std::vector<double> durations; // ms, ring buffer of window entries
+		int next;
+		long long count;
+	};
+
+	int FindStage(const char* name, int device);
+	static std::string ClockName(int device);
+	void Add(const char* stage, int device, double queued, double submit, double start, double end);
+
+	int window;
+	int frame;
+	std::vector<Stage> stages;
+	FILE* csv;
+	std::string csvFile;
+	long long written;
+	// First timestamp of every device's clock, valid where haveDeviceBase
+	std::vector<unsigned long long> deviceBase;
+	std::vector<bool> haveDeviceBase;
+	bool haveHostBase;
+	double hostBase;
+};
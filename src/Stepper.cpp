@@ -0,0 +1,43 @@
+#include <math.h>
+#include "Stepper.h"
+
+Stepper::Stepper(double launchTime, int maxLaunches)
+{
+	this->launchTime = launchTime;
+	this->maxLaunches = maxLaunches;
+	timeScale = 1.0;
+	simulated = dropped = 0.0;
+	accumulator = 0.0;
+	last = 0.0;
+	started = false;
+}
+
+int Stepper::Launches(double now)
+{
+	if(!started || launchTime <= 0.0)
+	{
+		started = true;
+		last = now;
+		simulated += launchTime;
+		return 1;
+	}
+
+	// A clock going backwards adds nothing
+	if(now > last)
+		accumulator += (now - last) * timeScale;
+	last = now;
+
+	int launches = (int)(accumulator / launchTime);
+	if(launches > maxLaunches)
+		launches = maxLaunches;
+	accumulator -= launches * launchTime;
+	if(accumulator >= launchTime)
+	{
+		// Over budget, keep only the fraction of a launch
+		double kept = fmod(accumulator, launchTime);
+		dropped += accumulator - kept;
+		accumulator = kept;
+	}
+	simulated += launches * launchTime;
+	return launches;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+// Fixed step scheduler for the render loop. Wall clock time between frames
+// is accumulated and paid out in whole launches of launchTime simulated
+// seconds each (the engine's timeStep times its substeps), so the
+// simulation keeps pace with real time however the frame rate varies. The
+// remainder carries over to the next frame. Under load at most maxLaunches
+// run per frame and the time beyond that is dropped, so the simulation
+// slows down instead of falling further and further behind.
+class Stepper
+{
+public:
+	Stepper(double launchTime = 0.01, int maxLaunches = 4);
+
+	// Launches due for a frame starting at now, in get_time() seconds. The
+	// first frame runs one.
+	int Launches(double now);
+
+	double launchTime;
+	int maxLaunches;
+	// Simulated seconds per wall clock second.
+	double timeScale;
+
+	// Simulated seconds so far, and seconds dropped by the cap.
+	double simulated, dropped;
+
+private:
+	double accumulator;
+	double last;
+	bool started;
+};
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "Trajectory.h"
+
+Trajectory::Trajectory(const char* file, int interval, int queueDepth)
+{
+	this->file = file;
+	this->interval = interval > 0 ? interval : 1;
+	// Two slots at least, so reads and writes alternate
+	this->queueDepth = queueDepth > 2 ? queueDepth : 2;
+	frames = stalls = 0;
+	f = NULL;
+	frameBytes = 0;
+	closing = failed = false;
+}
+
+Trajectory::~Trajectory()
+{
+	Close();
+}
+
+bool Trajectory::Open(size_t particleCount, size_t frameBytes)
+{
+	if((int)slots.size() != queueDepth)
+	{
+		printf("Trajectory needs %d slots, got %u\n", queueDepth, (unsigned int)slots.size());
+		return false;
+	}
+	f = fopen(file.c_str(), "wb");
+	if(!f)
+	{
+		printf("Failed to open %s for writing\n", file.c_str());
+		return false;
+	}
+
+	TrajectoryHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "PTRJ", 4);
+	header.version = 1;
+	header.particleCount = particleCount;
+	if(fwrite(&header, sizeof(header), 1, f) != 1)
+	{
+		printf("Failed to write %s\n", file.c_str());
+		fclose(f);
+		f = NULL;
+		return false;
+	}
+
+	this->frameBytes = frameBytes;
+	busy.assign(slots.size(), false);
+	writer = std::thread(WriterMain, this);
+	printf("Streaming a frame every %d launches to %s through %d slots\n", interval, file.c_str(), queueDepth);
+	return true;
+}
+
+int Trajectory::Acquire()
+{
+	for(;;)
+	{
+		Poll();
+		std::unique_lock<std::mutex> guard(lock);
+		for(size_t i = 0; i < busy.size(); i++)
+		{
+			if(!busy[i])
+			{
+				busy[i] = true;
+				return (int)i;
+			}
+		}
+		stalls++;
+		if(reading.empty())
+		{
+			freed.wait(guard);
+			continue;
+		}
+		// The oldest read has to finish before the writer can have it
+		guard.unlock();
+		clWaitForEvents(1, &reading.front().second);
+	}
+}
+
+void Trajectory::Submit(int slot, cl_event done)
+{
+	reading.push_back(std::make_pair(slot, done));
+	Poll();
+}
+
+void Trajectory::Poll()
+{
+	while(!reading.empty())
+	{
+		cl_int status = CL_COMPLETE;
+		if(clGetEventInfo(reading.front().second, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL) != CL_SUCCESS)
+			status = -1;
+		if(status > CL_COMPLETE)
+			return;
+		clReleaseEvent(reading.front().second);
+		Hand(reading.front().first, status == CL_COMPLETE);
+		reading.pop_front();
+	}
+}
+
+// A slot whose read failed is freed without writing it.
+void Trajectory::Hand(int slot, bool read)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if(read)
+	{
+		queue.push_back(slot);
+		queued.notify_one();
+		return;
+	}
+	failed = true;
+	busy[slot] = false;
+	freed.notify_one();
+}
+
+void Trajectory::Cancel(int slot)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	busy[slot] = false;
+	freed.notify_one();
+}
+
+void Trajectory::Close()
+{
+	if(!f)
+		return;
+	while(!reading.empty())
+	{
+		clWaitForEvents(1, &reading.front().second);
+		Poll();
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closing = true;
+		queued.notify_one();
+	}
+	writer.join();
+	fclose(f);
+	f = NULL;
+	if(failed)
+		printf("Failed to write %s, the trajectory is incomplete\n", file.c_str());
+	printf("Wrote %d trajectory frames, waited for a free slot %d times\n", frames, stalls);
+}
+
+// Frames go out in the order they were submitted, which is the order the
+// in order queue finishes their reads in. No OpenCL calls here.
+void Trajectory::WriterMain(Trajectory* t)
+{
+	for(;;)
+	{
+		int next;
+		{
+			std::unique_lock<std::mutex> guard(t->lock);
+			while(t->queue.empty() && !t->closing)
+				t->queued.wait(guard);
+			if(t->queue.empty())
+				return;
+			next = t->queue.front();
+			t->queue.pop_front();
+		}
+
+		bool written = fwrite(t->slots[next], 1, t->frameBytes, t->f) == t->frameBytes;
+
+		std::lock_guard<std::mutex> guard(t->lock);
+		if(written)
+			t->frames++;
+		else
+			t->failed = true;
+		t->busy[next] = false;
+		t->freed.notify_one();
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <CL/cl.h>
+
+// Trajectory file: the header, then one frame after another, each a
+// TrajectoryFrame followed by particleCount float4 positions and as many
+// velocities (life or mass in w).
+struct TrajectoryHeader
+{
+	char magic[4]; // "PTRJ"
+	cl_uint version; // 1
+	cl_ulong particleCount;
+};
+
+struct TrajectoryFrame
+{
+	cl_uint step; // Steps run before the frame
+	float timeStep;
+};
+
+// Streams frames to a file from a writer thread. The engine fills one of
+// the slots, pinned host memory it owns, with reads that have not finished
+// yet and hands it over with Submit(). OpenCL 1.0 is not thread safe, so
+// only the engine's thread touches the events: Poll() passes the slots
+// whose reads finished on to the writer, which writes the frame and frees
+// the slot. Only Acquire() blocks, when every slot is still being read or
+// waits to be written.
+class Trajectory
+{
+public:
+	// A frame every interval launches, queueDepth slots.
+	Trajectory(const char* file, int interval = 10, int queueDepth = 3);
+	~Trajectory();
+
+	// Set slots to queueDepth buffers of frameBytes before Open().
+	bool Open(size_t particleCount, size_t frameBytes);
+	// Index of a free slot, waits for the writer if there is none.
+	int Acquire();
+	// Queues slot to be written once done completes. Takes the event.
+	void Submit(int slot, cl_event done);
+	// Hands the slots whose reads finished to the writer, without waiting.
+	void Poll();
+	// Frees slot without writing it.
+	void Cancel(int slot);
+	// Writes the queued frames and stops the writer.
+	void Close();
+
+	std::string file;
+	int interval;
+	int queueDepth;
+	std::vector<void*> slots;
+
+	// Frames written, and how often Acquire() had to wait for a read or
+	// the writer.
+	int frames, stalls;
+
+private:
+	static void WriterMain(Trajectory* trajectory);
+	void Hand(int slot, bool read);
+
+	FILE* f;
+	size_t frameBytes;
+	std::vector<bool> busy;
+	// Slots still being read, oldest first. The engine's thread only.
+	std::deque<std::pair<int, cl_event> > reading;
+	// Slots read and waiting for the writer
+	std::deque<int> queue;
+	bool closing;
+	bool failed;
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable queued, freed;
+};
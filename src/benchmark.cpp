@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "OCL.h"
+#include "CPU.h"
+#include "MultiDevice.h"
+#include "util.h"
+#include "scene.h"
+
+// Headless throughput benchmark. Runs updateParticles for a fixed number of
+// steps over a sweep of particle counts, local work sizes and devices and
+// writes one JSON record per run.
+
+struct BenchDevice
+{
+	std::string name;
+	int platform, device; // -1 for the native CPU backend, -2 for all devices
+};
+
+// One run's settings.
+struct BenchConfig
+{
+	int particles;
+	int localWorkSize; // 0 = driver choice, -1 = tuned
+	ParticleLayout layout;
+	ParticleIntegrator integrator;
+	bool compact, procedural, nbody, sph;
+	std::string colliderFile; // Empty for none
+	int steps;
+	int substeps;
+};
+
+struct BenchResult
+{
+	BenchConfig config;
+	std::string backend, device;
+	double seconds;
+	double bytesPerParticle;
+	bool ok;
+};
+
+//----------------------------------------------------------------------
+void listDevices(std::vector<BenchDevice>& devices)
+{
+	cl_uint platformCount = 0;
+	if(clGetPlatformIDs(0, NULL, &platformCount) != CL_SUCCESS)
+		platformCount = 0;
+
+	for(cl_uint p = 0; p < platformCount; p++)
+	{
+		cl_platform_id platform;
+		cl_uint deviceCount = 0;
+		if( !oclGetPlatformByIndex(&platform, p) )
+			continue;
+		if(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount) != CL_SUCCESS)
+			continue;
+
+		for(cl_uint d = 0; d < deviceCount; d++)
+		{
+			cl_device_id id;
+			char name[1024];
+			if( !oclGetDeviceByIndex(&id, platform, d) )
+				continue;
+			clGetDeviceInfo(id, CL_DEVICE_NAME, sizeof(name), name, NULL);
+
+			BenchDevice device;
+			device.name = name;
+			device.platform = p;
+			device.device = d;
+			devices.push_back(device);
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+static const char* layoutNames[] = { "aos", "soa", "aosoa" };
+static const char* integratorNames[] = { "euler", "verlet", "leapfrog", "rk4" };
+
+//----------------------------------------------------------------------
+bool runOne(const BenchDevice& device, const BenchConfig& requested, BenchResult& result)
+{
+	// Backends drop what they can't run, config ends up as what ran
+	result.config = requested;
+	BenchConfig& config = result.config;
+
+	Engine* engine;
+	OCL* ocl = NULL;
+	if(device.platform == -2)
+	{
+		MultiDevice* multi = new MultiDevice(true);
+		multi->procedural = config.procedural;
+		multi->integrator = config.integrator;
+		engine = multi;
+		result.backend = "multi";
+		config.layout = LAYOUT_AOS;
+		config.compact = config.nbody = config.sph = false;
+		config.colliderFile.clear();
+	}
+	else if(device.platform < 0)
+	{
+		engine = new CPU(true);
+		result.backend = "cpu";
+		config.layout = LAYOUT_AOS;
+		config.integrator = INTEGRATOR_EULER;
+		config.compact = config.procedural = config.nbody = config.sph = false;
+		config.colliderFile.clear();
+	}
+	else
+	{
+		ocl = new OCL(true);
+		ocl->platformIndex = device.platform;
+		ocl->deviceIndex = device.device;
+		ocl->localWorkSize = config.localWorkSize > 0 ? config.localWorkSize : 0;
+		ocl->autotune = config.localWorkSize < 0;
+		ocl->layout = config.layout;
+		ocl->integrator = config.integrator;
+		ocl->compact = config.compact;
+		ocl->procedural = config.procedural;
+		ocl->nbody = config.nbody;
+		ocl->sph = config.sph;
+		ocl->colliderFile = config.colliderFile;
+		engine = ocl;
+		result.backend = "opencl";
+	}
+	engine->substeps = config.substeps;
+	result.device = device.name;
+	result.seconds = 0.0;
+	result.bytesPerParticle = 0.0;
+	result.ok = false;
+
+	int particles = config.particles;
+	Vector4* pos = NULL;
+	Vector4* vel = NULL;
+	Vector4* color = NULL;
+	bool loaded = engine->InitializeContext() && engine->LoadProgram("particles.cl");
+	// LoadProgram() drops combinations it can't build (e.g. compact forces AoS)
+	if(loaded && ocl)
+	{
+		config.layout = ocl->layout;
+		config.compact = ocl->compact;
+		config.procedural = ocl->procedural;
+		config.nbody = ocl->nbody;
+		config.sph = ocl->sph;
+		config.colliderFile = ocl->colliderFile;
+	}
+	if(loaded && !engine->SpawnsParticles())
+	{
+		pos = (Vector4*)aligned_malloc(sizeof(Vector4) * particles, 64);
+		vel = (Vector4*)aligned_malloc(sizeof(Vector4) * particles, 64);
+		color = (Vector4*)aligned_malloc(sizeof(Vector4) * particles, 64);
+		loaded = pos && vel && color;
+		if(loaded && config.sph)
+			ocl->sphSpacing = init_fluid(pos, vel, color, particles);
+		else if(loaded && config.nbody)
+			init_bodies(pos, vel, color, particles);
+		else if(loaded)
+			init_particles(pos, vel, color, particles);
+	}
+	loaded = loaded && engine->LoadData(pos, vel, color, particles) && engine->CreateKernel();
+	aligned_free(pos);
+	aligned_free(vel);
+	aligned_free(color);
+
+	// A few untimed steps so first launch costs stay out of the numbers
+	if(loaded && engine->RunSteps(3 * config.substeps))
+	{
+		double start = get_time();
+		result.ok = engine->RunSteps(config.steps);
+		result.seconds = get_time() - start;
+		// Taken after the timed steps: N-body traffic depends on the tiles
+		// CreateKernel() picked, the CPU's on the steps fused per call
+		result.bytesPerParticle = engine->BytesPerParticleStep();
+	}
+
+	delete engine;
+	return result.ok;
+}
+
+//----------------------------------------------------------------------
+// s as a quoted JSON string. Device names come from the driver and may hold
+// anything.
+std::string jsonString(const std::string& s)
+{
+	std::string out = "\"";
+	for(size_t i = 0; i < s.size(); i++)
+	{
+		unsigned char c = (unsigned char)s[i];
+		if(c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += (char)c;
+		}
+		else if(c < 0x20)
+		{
+			char escaped[8];
+			sprintf(escaped, "\\u%04x", c);
+			out += escaped;
+		}
+		else
+			out += (char)c;
+	}
+	return out + "\"";
+}
+
+const char* jsonBool(bool b)
+{
+	return b ? "true" : "false";
+}
+
+//----------------------------------------------------------------------
+void writeJSON(FILE* f, const std::vector<BenchResult>& results)
+{
+	fprintf(f, "[\n");
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& r = results[i];
+		const BenchConfig& c = r.config;
+		double updates = (double)c.particles * c.steps;
+		double perSecond = r.ok && r.seconds > 0 ? updates / r.seconds : 0.0;
+		double nsPerParticle = r.ok && updates > 0 ? r.seconds * 1e9 / updates : 0.0;
+		// Pairwise forces evaluated, for the compute bound N-body mode
+		double interactions = c.nbody ? perSecond * c.particles : 0.0;
+
+		fprintf(f, "  {\"backend\": %s, \"device\": %s, ", jsonString(r.backend).c_str(), jsonString(r.device).c_str());
+		fprintf(f, "\"layout\": \"%s\", \"integrator\": \"%s\", ", layoutNames[c.layout], integratorNames[c.integrator]);
+		fprintf(f, "\"compact\": %s, \"procedural\": %s, \"nbody\": %s, \"sph\": %s, \"collider\": %s, ",
+			jsonBool(c.compact), jsonBool(c.procedural), jsonBool(c.nbody), jsonBool(c.sph), jsonBool(!c.colliderFile.empty()));
+		fprintf(f, "\"particles\": %d, \"local_work_size\": %d, \"steps\": %d, \"substeps\": %d, ",
+			c.particles, c.localWorkSize, c.steps, c.substeps);
+		fprintf(f, "\"ok\": %s, \"seconds\": %.6f, \"particles_per_second\": %.6g, \"ns_per_particle\": %.6g, ",
+			jsonBool(r.ok), r.seconds, perSecond, nsPerParticle);
+		fprintf(f, "\"bytes_per_particle\": %.1f, \"gb_per_second\": %.6g, \"interactions_per_second\": %.6g}%s\n",
+			r.bytesPerParticle, perSecond * r.bytesPerParticle * 1e-9, interactions, i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "]\n");
+}
+
+//----------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	int minParticles = 10000;
+	int maxParticles = 100000000;
+	bool useCPU = true, useOpenCL = true, useAll = false;
+	const char* outFile = "benchmark.json";
+	bool maxSet = false;
+	std::vector<int> localSizes;
+	std::vector<ParticleLayout> layouts;
+
+	// The sweep fills in particles, localWorkSize and layout
+	BenchConfig base;
+	base.particles = base.localWorkSize = 0;
+	base.layout = LAYOUT_AOS;
+	base.integrator = INTEGRATOR_EULER;
+	base.compact = base.procedural = base.nbody = base.sph = false;
+	base.steps = 100;
+	base.substeps = 1;
+
+	// -min/-max bound the particle counts (stepping by 10x), -local adds a
+	// local work size to sweep (0 = driver choice, the default, -1 = tuned),
+	// -steps sets the timed steps per run, -substeps fuses that many steps
+	// into one launch, -layout aos|soa|aosoa adds an OpenCL state layout to
+	// sweep (aos by default), -integrator euler|verlet|leapfrog|rk4 picks
+	// the OpenCL integrator, -compact runs OpenCL with 16 bit state and 8
+	// bit colors, -procedural respawns from a device RNG, -nbody runs
+	// OpenCL all-pairs gravity instead (up to 1e5 bodies unless -max is
+	// given), -sph the fluid, -collider bounces the fountain off a signed
+	// distance volume file, -multidevice adds a run split over all OpenCL
+	// devices, -nocpu/-noopencl drop a backend
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-min") == 0 && i + 1 < argc)
+			minParticles = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-max") == 0 && i + 1 < argc)
+		{
+			maxParticles = atoi(argv[++i]);
+			maxSet = true;
+		}
+		else if(strcmp(argv[i], "-steps") == 0 && i + 1 < argc)
+			base.steps = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-local") == 0 && i + 1 < argc)
+			localSizes.push_back(atoi(argv[++i]));
+		else if(strcmp(argv[i], "-substeps") == 0 && i + 1 < argc)
+			base.substeps = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-layout") == 0 && i + 1 < argc)
+		{
+			i++;
+			for(int l = 0; l < 3; l++)
+				if(strcmp(argv[i], layoutNames[l]) == 0)
+					layouts.push_back((ParticleLayout)l);
+		}
+		else if(strcmp(argv[i], "-integrator") == 0 && i + 1 < argc)
+		{
+			i++;
+			for(int n = 0; n < 4; n++)
+				if(strcmp(argv[i], integratorNames[n]) == 0)
+					base.integrator = (ParticleIntegrator)n;
+		}
+		else if(strcmp(argv[i], "-compact") == 0)
+			base.compact = true;
+		else if(strcmp(argv[i], "-procedural") == 0)
+			base.procedural = true;
+		else if(strcmp(argv[i], "-nbody") == 0)
+			base.nbody = true;
+		else if(strcmp(argv[i], "-sph") == 0)
+			base.sph = true;
+		else if(strcmp(argv[i], "-collider") == 0 && i + 1 < argc)
+			base.colliderFile = argv[++i];
+		else if(strcmp(argv[i], "-nocpu") == 0)
+			useCPU = false;
+		else if(strcmp(argv[i], "-multidevice") == 0)
+			useAll = true;
+		else if(strcmp(argv[i], "-noopencl") == 0)
+			useOpenCL = false;
+		else if(strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+			outFile = argv[++i];
+	}
+	if(localSizes.empty())
+		localSizes.push_back(0);
+	if(layouts.empty())
+		layouts.push_back(LAYOUT_AOS);
+	// All-pairs steps grow with the square of the bodies, 1e8 would not
+	// finish
+	if(base.nbody && !maxSet && maxParticles > 100000)
+		maxParticles = 100000;
+	// Keep the timed steps a whole number of launches
+	if(base.substeps < 1)
+		base.substeps = 1;
+	base.steps = (base.steps + base.substeps - 1) / base.substeps * base.substeps;
+
+	std::vector<BenchDevice> devices;
+	if(useCPU)
+	{
+		BenchDevice native;
+		native.name = "native";
+		native.platform = native.device = -1;
+		devices.push_back(native);
+	}
+	if(useOpenCL)
+		listDevices(devices);
+	if(useAll)
+	{
+		BenchDevice all;
+		all.name = "all devices";
+		all.platform = -2;
+		all.device = -1;
+		devices.push_back(all);
+	}
+
+	std::vector<BenchResult> results;
+	for(size_t d = 0; d < devices.size(); d++)
+	{
+		for(int particles = minParticles; particles > 0 && particles <= maxParticles; particles *= 10)
+		{
+			for(size_t m = 0; m < layouts.size(); m++)
+			{
+				for(size_t l = 0; l < localSizes.size(); l++)
+				{
+					// The native backend and the device split sweep neither work groups nor layouts
+					if(devices[d].platform < 0 && (l > 0 || m > 0))
+						break;
+					BenchConfig config = base;
+					config.particles = particles;
+					config.localWorkSize = devices[d].platform < 0 ? 0 : localSizes[l];
+					config.layout = layouts[m];
+					BenchResult result;
+					runOne(devices[d], config, result);
+					results.push_back(result);
+
+					const char* layout = layoutNames[result.config.layout];
+					if(result.ok)
+						printf("%-30s %-5s %10d particles, local %4d: %10.3f ns/particle, %8.2f GB/s\n",
+							result.device.c_str(), layout, particles, config.localWorkSize,
+							result.seconds * 1e9 / ((double)particles * config.steps),
+							(double)particles * config.steps * result.bytesPerParticle / result.seconds * 1e-9);
+					else
+						printf("%-30s %-5s %10d particles, local %4d: failed\n",
+							result.device.c_str(), layout, particles, config.localWorkSize);
+				}
+			}
+
+			// Stop before overflowing the count
+			if(particles > maxParticles / 10)
+				break;
+		}
+	}
+
+	FILE* f = fopen(outFile, "w");
+	if(!f)
+	{
+		printf("Unable to open %s for writing\n", outFile);
+		return 1;
+	}
+	writeJSON(f, results);
+	fclose(f);
+	printf("Wrote %u results to %s\n", (unsigned int)results.size(), outFile);
+	return 0;
+}
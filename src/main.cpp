@@ -1,12 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "OCL.h"
+#include "CPU.h"
+#include "MultiDevice.h"
 #include "opengl.h"
+#include "util.h"
+#include "scene.h"
+#include "Stepper.h"
 
 #define NUM_PARTICLES 10000
 
-OCL* example;
+Engine* example;
+Profiler* profiler = NULL;
+const char* profileFile = NULL;
+//turns the time between frames into launches of the simulation
+Stepper stepper;
+//the OpenCL engine, the only one that saves and restores checkpoints
+OCL* oclEngine = NULL;
+const char* checkpointFile = NULL;
+int checkpointEvery = 0;
+int checkpointLaunches = 0;
+//full positions and velocities streamed to disk, OpenCL only
+Trajectory* trajectory = NULL;
 
 //GL related variables
 int window_width = 800;
@@ -20,31 +37,275 @@ float rotate_x = 0.0, rotate_y = 0.0;
 //main app helper functions
 void init_gl(int argc, char** argv);
 void appRender();
+void writeProfile();
+void saveCheckpoint();
 void appDestroy();
 void timerCB(int ms);
 void appKeyboard(unsigned char key, int x, int y);
 void appMouse(int button, int state, int x, int y);
 void appMotion(int x, int y);
 
-//----------------------------------------------------------------------
-//quick random function to distribute our initial points
-float rand_float(float mn, float mx)
-{
-    float r = rand() / (float) RAND_MAX;
-    return mn + (mx-mn)*r;
-}
-
-
 //----------------------------------------------------------------------
 int main(int argc, char** argv)
 {
+    bool headless = false;
+    bool cpu = false;
+    bool multiDevice = false;
+    int balanceInterval = 16;
+    bool pipelined = false;
+    bool autotune = false;
+    bool compact = false;
+    bool procedural = false;
+    bool lifecycle = false;
+    int emitCount = -1;
+    int emitBurst = 1;
+    bool grid = false;
+    float cellSize = 0.02f;
+    bool nbody = false;
+    bool barnesHut = false;
+    float theta = 0.5f;
+    int mortonBits = 30;
+    bool sph = false;
+    const char* colliderFile = NULL;
+    const char* restoreFile = NULL;
+    const char* trajectoryFile = NULL;
+    int trajectoryEvery = 10;
+    int trajectoryDepth = 3;
+    float restitution = 0.5f;
+    int threads = 0;
+    int steps = 1000;
+    int substeps = 1;
+    float timeStep = 0.01f;
+    int maxLaunches = 4;
+    double timeScale = 1.0;
+    ParticleLayout layout = LAYOUT_AOS;
+    int aosoaWidth = 16;
+    ParticleIntegrator integrator = INTEGRATOR_EULER;
+    DeviceFission fission = FISSION_NONE;
+    int fissionUnits = 0;
+    int num = NUM_PARTICLES;
+    double start, elapsed;
+    Vector4* pos = NULL;
+    Vector4* vel = NULL;
+    Vector4* color = NULL;
+
+    //-headless runs the simulation without a window, -steps sets how many
+    //updates a headless run performs, -cpu uses the native CPU backend
+    //instead of OpenCL with -threads worker threads, -pipelined lets OpenCL
+    //overlap its frame with the host, -particles sets the particle count,
+    //-profile records stage timings and writes them to the given csv file,
+    //-autotune picks the kernel's local work size by timing, -substeps K
+    //integrates K steps per kernel launch, -layout aos|soa|aosoa picks how
+    //OpenCL stores the particles with -aosoa W particles per AoSoA block,
+    //-compact stores them in 16 bit positions, velocities and life and 8 bit
+    //colors, -procedural respawns particles from a random number generator
+    //on the device instead of copies of their initial state, -lifecycle only
+    //updates and draws live particles with -emit N emitted per step, in
+    //bursts every -burst B launches, -grid bins the particles into a hash
+    //grid of -cell S sized cells every step, -nbody replaces the fountain
+    //with a disc of bodies under all-pairs gravity, -barneshut approximates
+    //it with a tree of -morton 30|63 bit codes and opening angle -theta T,
+    //-sph drops a block of SPH fluid into a box, -collider bounces the
+    //fountain off the signed distance volume in the given file with
+    //-restitution R, -democollider writes a floor and a ball to the file
+    //and uses it, -integrator euler|verlet|leapfrog|rk4 picks how OpenCL
+    //integrates the fountain, -dt S sets the simulated seconds per step,
+    //-timescale X the simulated seconds per real one and -maxlaunches N how
+    //many launches a frame may take to keep up before dropping time,
+    //-multidevice splits the fountain over every OpenCL device and
+    //rebalances it every -balance B launches (0 never), -checkpoint FILE
+    //saves the OpenCL simulation to FILE at exit and every -checkpointevery
+    //N launches, -restore FILE continues from such a file, -trajectory FILE
+    //streams positions and velocities to FILE every -trajectoryevery N
+    //launches with up to -trajectorydepth D frames waiting for disk, -fission
+    //equally|counts|numa runs OpenCL on a sub-device of a CPU of -cores N
+    //compute units (all but one by default) or on its first NUMA node
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-headless") == 0)
+            headless = true;
+        else if(strcmp(argv[i], "-steps") == 0 && i + 1 < argc)
+            steps = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-cpu") == 0)
+            cpu = true;
+        else if(strcmp(argv[i], "-multidevice") == 0)
+            multiDevice = true;
+        else if(strcmp(argv[i], "-balance") == 0 && i + 1 < argc)
+            balanceInterval = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+            checkpointFile = argv[++i];
+        else if(strcmp(argv[i], "-checkpointevery") == 0 && i + 1 < argc)
+            checkpointEvery = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-restore") == 0 && i + 1 < argc)
+            restoreFile = argv[++i];
+        else if(strcmp(argv[i], "-trajectory") == 0 && i + 1 < argc)
+            trajectoryFile = argv[++i];
+        else if(strcmp(argv[i], "-trajectoryevery") == 0 && i + 1 < argc)
+            trajectoryEvery = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-trajectorydepth") == 0 && i + 1 < argc)
+            trajectoryDepth = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-pipelined") == 0)
+            pipelined = true;
+        else if(strcmp(argv[i], "-particles") == 0 && i + 1 < argc)
+            num = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-substeps") == 0 && i + 1 < argc)
+            substeps = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-dt") == 0 && i + 1 < argc)
+            timeStep = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "-timescale") == 0 && i + 1 < argc)
+            timeScale = atof(argv[++i]);
+        else if(strcmp(argv[i], "-maxlaunches") == 0 && i + 1 < argc)
+            maxLaunches = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-layout") == 0 && i + 1 < argc)
+        {
+            i++;
+            layout = strcmp(argv[i], "soa") == 0 ? LAYOUT_SOA : strcmp(argv[i], "aosoa") == 0 ? LAYOUT_AOSOA : LAYOUT_AOS;
+        }
+        else if(strcmp(argv[i], "-integrator") == 0 && i + 1 < argc)
+        {
+            i++;
+            integrator = strcmp(argv[i], "verlet") == 0 ? INTEGRATOR_VERLET : strcmp(argv[i], "leapfrog") == 0 ? INTEGRATOR_LEAPFROG :
+                strcmp(argv[i], "rk4") == 0 ? INTEGRATOR_RK4 : INTEGRATOR_EULER;
+        }
+        else if(strcmp(argv[i], "-fission") == 0 && i + 1 < argc)
+        {
+            i++;
+            fission = strcmp(argv[i], "equally") == 0 ? FISSION_EQUALLY : strcmp(argv[i], "counts") == 0 ? FISSION_BY_COUNTS :
+                strcmp(argv[i], "numa") == 0 ? FISSION_BY_NUMA : FISSION_NONE;
+        }
+        else if(strcmp(argv[i], "-cores") == 0 && i + 1 < argc)
+            fissionUnits = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-aosoa") == 0 && i + 1 < argc)
+            aosoaWidth = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-compact") == 0)
+            compact = true;
+        else if(strcmp(argv[i], "-procedural") == 0)
+            procedural = true;
+        else if(strcmp(argv[i], "-lifecycle") == 0)
+            lifecycle = true;
+        else if(strcmp(argv[i], "-emit") == 0 && i + 1 < argc)
+            emitCount = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-burst") == 0 && i + 1 < argc)
+            emitBurst = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-grid") == 0)
+            grid = true;
+        else if(strcmp(argv[i], "-cell") == 0 && i + 1 < argc)
+            cellSize = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "-nbody") == 0)
+            nbody = true;
+        else if(strcmp(argv[i], "-barneshut") == 0)
+            nbody = barnesHut = true;
+        else if(strcmp(argv[i], "-theta") == 0 && i + 1 < argc)
+            theta = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "-morton") == 0 && i + 1 < argc)
+            mortonBits = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-sph") == 0)
+            sph = true;
+        else if(strcmp(argv[i], "-collider") == 0 && i + 1 < argc)
+            colliderFile = argv[++i];
+        else if(strcmp(argv[i], "-democollider") == 0 && i + 1 < argc)
+        {
+            colliderFile = argv[++i];
+            if(!write_demo_collider(colliderFile, 64))
+                printf("Failed to write %s\n", colliderFile);
+        }
+        else if(strcmp(argv[i], "-restitution") == 0 && i + 1 < argc)
+            restitution = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "-autotune") == 0)
+            autotune = true;
+        else if(strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+            profileFile = argv[++i];
+    }
+
     printf("Hello, OpenCL\n");
     //Setup our GLUT window and OpenGL related things
     //glut callback functions are setup here too
-    init_gl(argc, argv);
+    if(!headless)
+        init_gl(argc, argv);
 
     //initialize our CL object, this sets up the context
-    example = new OCL();
+    if(cpu)
+    {
+        if(nbody || sph)
+            printf("The CPU backend has no N-body or SPH mode, running the fountain.\n");
+        if(colliderFile)
+            printf("The CPU backend has no colliders, ignoring %s.\n", colliderFile);
+        if(integrator != INTEGRATOR_EULER)
+            printf("The CPU backend only integrates with Euler.\n");
+        if(fission != FISSION_NONE)
+            printf("The CPU backend sizes its pool with -threads, ignoring -fission.\n");
+        example = new CPU(headless, threads);
+    }
+    else if(multiDevice)
+    {
+        if(nbody || sph || lifecycle || grid || compact || colliderFile || layout != LAYOUT_AOS)
+            printf("Several devices only run the AoS float fountain, using it.\n");
+        nbody = sph = false;
+        MultiDevice* multi = new MultiDevice(headless);
+        multi->procedural = procedural;
+        multi->integrator = integrator;
+        multi->fission = fission;
+        multi->fissionUnits = fissionUnits > 0 ? fissionUnits : 0;
+        multi->balanceInterval = balanceInterval;
+        example = multi;
+    }
+    else
+    {
+        OCL* ocl = new OCL(headless);
+        ocl->pipelined = pipelined;
+        ocl->autotune = autotune;
+        ocl->layout = layout;
+        ocl->compact = compact;
+        ocl->procedural = procedural;
+        ocl->lifecycle = lifecycle;
+        ocl->emitCount = emitCount;
+        ocl->emitBurst = emitBurst;
+        ocl->grid = grid;
+        ocl->cellSize = cellSize > 0.0f ? cellSize : 0.02f;
+        ocl->nbody = nbody;
+        ocl->barnesHut = barnesHut;
+        ocl->theta = theta;
+        ocl->mortonBits = mortonBits;
+        ocl->sph = sph;
+        if(colliderFile)
+            ocl->colliderFile = colliderFile;
+        ocl->restitution = restitution;
+        ocl->aosoaWidth = aosoaWidth > 0 ? aosoaWidth : 16;
+        ocl->integrator = integrator;
+        ocl->fission = fission;
+        ocl->fissionUnits = fissionUnits > 0 ? fissionUnits : 0;
+        example = oclEngine = ocl;
+    }
+    if((checkpointFile || restoreFile) && !oclEngine)
+    {
+        printf("Only the single device OpenCL engine saves and restores checkpoints.\n");
+        checkpointFile = restoreFile = NULL;
+    }
+    if(trajectoryFile)
+    {
+        if(oclEngine)
+            oclEngine->trajectory = trajectory = new Trajectory(trajectoryFile, trajectoryEvery, trajectoryDepth);
+        else
+            printf("Only the single device OpenCL engine streams trajectories.\n");
+    }
+    example->substeps = substeps > 0 ? substeps : 1;
+    example->timeStep = timeStep > 0.0f ? timeStep : 0.01f;
+    stepper.launchTime = (double)example->timeStep * example->substeps;
+    stepper.maxLaunches = maxLaunches > 0 ? maxLaunches : 1;
+    stepper.timeScale = timeScale > 0.0 ? timeScale : 1.0;
+    if(profileFile)
+    {
+        profiler = new Profiler();
+        if(profiler->Open(profileFile))
+            example->profiler = profiler;
+        else
+        {
+            delete profiler;
+            profiler = NULL;
+        }
+    }
 	if( !example->InitializeContext() )
 	{
 		printf("Failed to initialze context.\n");
@@ -57,44 +318,98 @@ int main(int argc, char** argv)
 		goto END;
 	}
 
-    //initialize our particle system with positions, velocities and color
-    int num = NUM_PARTICLES;
-    Vector4 pos[NUM_PARTICLES];
-	Vector4 vel[NUM_PARTICLES];
-	Vector4 color[NUM_PARTICLES];
-
-    //fill our vectors with initial data
-    for(int i = 0; i < num; i++)
+    //initialize our particle system with positions, velocities and color,
+    //unless the engine spawns them itself
+    if(!example->SpawnsParticles())
     {
-        //distribute the particles in a random circle around z axis
-        float rad = rand_float(.2, .5);
-        float x = rad*sin(2*3.14 * i/num);
-        float z = 0.0f;// -.1 + .2f * i/num;
-        float y = rad*cos(2*3.14 * i/num);
-		pos[i][0] = x; pos[i][1] = y; pos[i][2] = z; pos[i][3] = 1.0f;
-        
-        //give some initial velocity
-        //float xr = rand_float(-.1, .1);
-        //float yr = rand_float(1.f, 3.f);
-        //the life is the lifetime of the particle: 1 = alive 0 = dead
-        //as you will see in part2.cl we reset the particle when it dies
-        float life_r = rand_float(0.f, 1.f);
-		vel[i][0] = 0; vel[i][1] = 0; vel[i][2] = 3.0f; vel[i][3] = life_r;
-
-        //just make them red and full alpha
-        color[i][0] = 1; color[i][1] = 0; color[i][2] = 0; color[i][3] = 1;
+        pos = (Vector4*)aligned_malloc(sizeof(Vector4) * num, 64);
+        vel = (Vector4*)aligned_malloc(sizeof(Vector4) * num, 64);
+        color = (Vector4*)aligned_malloc(sizeof(Vector4) * num, 64);
+        if(!pos || !vel || !color)
+        {
+            printf("Failed to allocate %d particles.\n", num);
+            goto END;
+        }
+
+        //fill our vectors with initial data
+        if(sph && !cpu)
+            ((OCL*)example)->sphSpacing = init_fluid(pos, vel, color, num);
+        else if(nbody && !cpu)
+            init_bodies(pos, vel, color, num);
+        else
+            init_particles(pos, vel, color, num);
     }
 
     //our load data function sends our initial values to the GPU
-    example->LoadData(pos, vel, color, NUM_PARTICLES);
+    if( !example->LoadData(pos, vel, color, num) )
+    {
+        printf("Failed to load data.\n");
+        goto END;
+    }
+    //the engine has its own copy now
+    aligned_free(pos);
+    aligned_free(vel);
+    aligned_free(color);
+    pos = vel = color = NULL;
     //initialize the kernel
-    example->CreateKernel();
-    
+    if( !example->CreateKernel() )
+    {
+        printf("Failed to create kernel.\n");
+        goto END;
+    }
+    //the initial state above only sized the buffers, overwrite it
+    if(restoreFile)
+    {
+        if( !oclEngine->RestoreCheckpoint(restoreFile, &stepper.simulated) )
+        {
+            printf("Failed to restore %s.\n", restoreFile);
+            goto END;
+        }
+        stepper.launchTime = (double)example->timeStep * example->substeps;
+    }
+
+    if(headless)
+    {
+        //no window to drive us, just step the simulation as fast as we can
+        //in runs of checkpointEvery launches when checkpointing
+        printf("Running %d steps headless...\n", steps);
+        int launches = (steps + example->substeps - 1) / example->substeps;
+        int segment = checkpointFile && checkpointEvery > 0 ? checkpointEvery : launches;
+        start = get_time();
+        for(int done = 0; done < launches; done += segment)
+        {
+            int run = launches - done < segment ? launches - done : segment;
+            if( !example->RunSteps(run * example->substeps) )
+            {
+                printf("Failed to run simulation.\n");
+                delete example;
+                delete trajectory;
+                return 1;
+            }
+            stepper.simulated += run * stepper.launchTime;
+            if(done + run < launches)
+                saveCheckpoint();
+        }
+        elapsed = get_time() - start;
+        saveCheckpoint();
+        printf("%d steps of %d particles in %f s (%f steps/s, %g particles/s)\n",
+            steps, num, elapsed, steps / elapsed, (double)steps * num / elapsed);
+        delete example;
+        delete trajectory;
+        writeProfile();
+        return 0;
+    }
+
     //this starts the GLUT program, from here on out everything we want
     //to do needs to be done in glut callback functions
 	printf("Runnig program on GPU...\n");
     glutMainLoop();
 END:
+	aligned_free(pos);
+	aligned_free(vel);
+	aligned_free(color);
+	if(headless)
+		return 1;
 	system("pause");
 	return 0;
 }
@@ -105,8 +420,13 @@ void appRender()
 {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    //this updates the particle system by calling the kernel
-    example->Run();
+    //this updates the particle system by calling the kernel as many times
+    //as the time since the last frame needs
+    int launches = stepper.Launches(get_time());
+    example->Run(launches);
+    checkpointLaunches += launches;
+    if(checkpointEvery > 0 && checkpointLaunches >= checkpointEvery)
+        saveCheckpoint();
 	
     //render the particles from VBOs
     glEnable(GL_BLEND);
@@ -114,14 +434,6 @@ void appRender()
     glEnable(GL_POINT_SMOOTH);
     glPointSize(5.);
     
-    //printf("color buffer\n");
-    glBindBuffer(GL_ARRAY_BUFFER, example->vbo_color);
-    glColorPointer(4, GL_FLOAT, 0, 0);
-
-    //printf("vertex buffer\n");
-    glBindBuffer(GL_ARRAY_BUFFER, example->vbo_pos);
-    glVertexPointer(4, GL_FLOAT, 0, 0);
-
     //printf("enable client state\n");
     glEnableClientState(GL_VERTEX_ARRAY);
     glEnableClientState(GL_COLOR_ARRAY);
@@ -129,8 +441,46 @@ void appRender()
     //Need to disable these for blender
     glDisableClientState(GL_NORMAL_ARRAY);
 
-    //printf("draw arrays\n");
-    glDrawArrays(GL_POINTS, 0, NUM_PARTICLES);
+    double waitStart = get_time();
+    example->WaitForFrame();
+    double drawStart = get_time();
+
+    //compact positions are fixed point, the modelview maps them back
+    glPushMatrix();
+    glTranslatef(example->vbo_offset[0], example->vbo_offset[1], example->vbo_offset[2]);
+    glScalef(example->vbo_scale[0], example->vbo_scale[1], example->vbo_scale[2]);
+
+    //large particle counts are split over several buffers, draw each
+    for(size_t i = 0; i < example->vbo_pos.size(); i++)
+    {
+        //printf("color buffer\n");
+        glBindBuffer(GL_ARRAY_BUFFER, example->vbo_color[i]);
+        glColorPointer(4, example->vbo_color_type, 0, 0);
+
+        //printf("vertex buffer\n");
+        glBindBuffer(GL_ARRAY_BUFFER, example->vbo_pos[i]);
+        glVertexPointer(4, example->vbo_pos_type, 0, 0);
+
+        //printf("draw arrays\n");
+        if(example->vbo_index.empty())
+            glDrawArrays(GL_POINTS, 0, example->vbo_count[i]);
+        else
+        {
+            //only the live particles listed in the index buffer
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, example->vbo_index[i]);
+            glDrawElements(GL_POINTS, example->vbo_count[i], GL_UNSIGNED_INT, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
+    }
+    glPopMatrix();
+
+    if(profiler)
+    {
+        double drawEnd = get_time();
+        profiler->RecordHost("wait", waitStart, drawStart);
+        profiler->RecordHost("draw", drawStart, drawEnd);
+        profiler->NextFrame();
+    }
 
     //printf("disable stuff\n");
     glDisableClientState(GL_COLOR_ARRAY);
@@ -184,8 +534,12 @@ void init_gl(int argc, char** argv)
 //----------------------------------------------------------------------
 void appDestroy()
 {
+    saveCheckpoint();
     //this makes sure we properly cleanup our OpenCL context
     delete example;
+    delete trajectory;
+    printf("Simulated %f s, dropped %f s to keep up\n", stepper.simulated, stepper.dropped);
+    writeProfile();
     if(glutWindowHandle)glutDestroyWindow(glutWindowHandle);
     printf("about to exit!\n");
 
@@ -193,6 +547,24 @@ void appDestroy()
 }
 
 
+//----------------------------------------------------------------------
+void saveCheckpoint()
+{
+    if(!checkpointFile)
+        return;
+    checkpointLaunches = 0;
+
+    //write next to the last checkpoint and only replace it once complete,
+    //so a crash while saving still leaves one to restart from
+    std::string temp = std::string(checkpointFile) + ".tmp";
+    if( !oclEngine->SaveCheckpoint(temp.c_str(), stepper.simulated) )
+        return;
+    remove(checkpointFile);
+    if(rename(temp.c_str(), checkpointFile) != 0)
+        printf("Failed to move %s to %s\n", temp.c_str(), checkpointFile);
+}
+
+
 //----------------------------------------------------------------------
 void timerCB(int ms)
 {
@@ -259,4 +631,16 @@ void appMotion(int x, int y)
     glTranslatef(0.0, 0.0, translate_z);
     glRotatef(rotate_x, 1.0, 0.0, 0.0);
     glRotatef(rotate_y, 0.0, 1.0, 0.0);
+}
+
+
+//----------------------------------------------------------------------
+void writeProfile()
+{
+    //print the rolling stage statistics, closing the CSV writes the rest
+    if(!profiler)
+        return;
+    profiler->PrintSummary();
+    delete profiler;
+    profiler = NULL;
 }
\ No newline at end of file
@@ -1,7 +1,153 @@
-__kernel void updateParticles(__global float4* pos, __global float4* color, __global float4* vel, __global float4* pos_gen, __global float4* vel_gen, float dt)
+//number of dt steps each launch integrates, set with -DSUBSTEPS=K
+#ifndef SUBSTEPS
+#define SUBSTEPS 1
+#endif
+
+#ifdef PROCEDURAL_RESPAWN
+//procedural respawn: instead of reading copies of the initial state, a dead
+//particle gets a fresh one from a random number generator keyed by its
+//global index and the current step, so no generator state is stored
+#ifndef RNG_SEED
+#define RNG_SEED 0x7A3C61E5u
+#endif
+#define RESPAWN_ARGS , unsigned int offset, unsigned int step
+
+//Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+//3"), four random words for every counter and key
+uint4 philox4x32(uint4 ctr, uint2 key)
+{
+	for(int r = 0; r < 10; r++)
+	{
+		uint hi0 = mul_hi(0xD2511F53u, ctr.x);
+		uint lo0 = 0xD2511F53u * ctr.x;
+		uint hi1 = mul_hi(0xCD9E8D57u, ctr.z);
+		uint lo1 = 0xCD9E8D57u * ctr.z;
+		ctr = (uint4)(hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);
+		key += (uint2)(0x9E3779B9u, 0xBB67AE85u);
+	}
+	return ctr;
+}
+
+//uniform in [0, 1) from the top 24 bits
+float uniform_float(uint x)
+{
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+//a particle of the ring around the z axis init_particles builds on the host,
+//with a random life in v.w. stream 0 is for respawns, 1 for the first spawn
+void spawn_particle(uint index, uint step, uint stream, float4* p, float4* v)
+{
+	uint4 r = philox4x32((uint4)(index, step, stream, 0), (uint2)(RNG_SEED, 0));
+	float rad = 0.2f + 0.3f * uniform_float(r.x);
+	float angle = 2.0f * M_PI_F * uniform_float(r.y);
+	*p = (float4)(rad * sin(angle), rad * cos(angle), 0.0f, 1.0f);
+	*v = (float4)(0.0f, 0.0f, 3.0f, uniform_float(r.z));
+}
+
+//initial state of count particles starting at offset
+__kernel void spawnParticles(__global float4* pos, __global float4* color, __global float4* vel, unsigned int count, unsigned int offset)
+{
+	unsigned int i = get_global_id(0);
+	if(i >= count)
+		return;
+
+	float4 p, v;
+	spawn_particle(offset + i, 0, 1, &p, &v);
+	pos[i] = p;
+	vel[i] = v;
+	color[i] = (float4)(1.0f, 0.0f, 0.0f, 1.0f);
+}
+#else
+#define RESPAWN_ARGS
+#endif
+
+#ifdef COLLIDER
+//static colliders as a signed distance volume, negative inside. every texel
+//holds the outward normal in xyz and the distance in w, so one filtered read
+//gives both however many colliders the volume holds. outside the volume the
+//border reads 0 and nothing collides
+#define COLLIDER_ARGS , __read_only image3d_t collider, float4 colliderOrigin, float colliderScale, float restitution
+#define COLLIDE(p, v) collide(collider, colliderOrigin, colliderScale, restitution, &(p), &(v))
+const sampler_t colliderSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_LINEAR;
+
+//a particle inside a collider goes back to its surface and the velocity
+//into it is reflected, keeping restitution of the normal speed. texel
+//centers are half a texel in, colliderScale is one over the spacing
+void collide(__read_only image3d_t collider, float4 colliderOrigin, float colliderScale, float restitution, float4* p, float4* v)
+{
+	float4 s = read_imagef(collider, colliderSampler, (*p - colliderOrigin) * colliderScale + (float4)(0.5f, 0.5f, 0.5f, 0.0f));
+	float4 n = (float4)(s.x, s.y, s.z, 0.0f);
+	float len = length(n);
+	if(s.w >= 0.0f || len == 0.0f)
+		return;
+
+	//w of the normal is 0 so position and life stay
+	n /= len;
+	*p -= n * s.w;
+	float vn = dot(*v, n);
+	if(vn < 0.0f)
+		*v -= n * ((1.0f + restitution) * vn);
+}
+#else
+#define COLLIDER_ARGS
+#endif
+
+//the integrator is picked with -DINTEGRATOR=n so the kernels don't branch
+//on it. all of them advance p and v by dt under acceleration() and leave w
+//alone (1 in positions, the life in velocities)
+#define INTEGRATOR_EULER 0    //semi-implicit euler, first order
+#define INTEGRATOR_VERLET 1   //velocity verlet, second order
+#define INTEGRATOR_LEAPFROG 2 //kick-drift-kick leapfrog, second order and symplectic
+#define INTEGRATOR_RK4 3      //classical runge-kutta, fourth order
+#ifndef INTEGRATOR
+#define INTEGRATOR INTEGRATOR_EULER
+#endif
+
+//the fountain's only force is "gravity" in the z direction
+float4 acceleration(float4 p, float4 v)
+{
+	return (float4)(0.0f, 0.0f, -9.8f, 0.0f);
+}
+
+void integrate(float4* p, float4* v, float dt)
+{
+	float4 x = *p;
+	float4 u = (float4)((*v).xyz, 0.0f);
+#if INTEGRATOR == INTEGRATOR_VERLET
+	float4 a = acceleration(x, u);
+	x += u * dt + a * (0.5f * dt * dt);
+	u += (a + acceleration(x, u + a * dt)) * (0.5f * dt);
+#elif INTEGRATOR == INTEGRATOR_LEAPFROG
+	u += acceleration(x, u) * (0.5f * dt);
+	x += u * dt;
+	u += acceleration(x, u) * (0.5f * dt);
+#elif INTEGRATOR == INTEGRATOR_RK4
+	float4 k1x = u;
+	float4 k1v = acceleration(x, u);
+	float4 k2x = u + k1v * (0.5f * dt);
+	float4 k2v = acceleration(x + k1x * (0.5f * dt), k2x);
+	float4 k3x = u + k2v * (0.5f * dt);
+	float4 k3v = acceleration(x + k2x * (0.5f * dt), k3x);
+	float4 k4x = u + k3v * dt;
+	float4 k4v = acceleration(x + k3x * dt, k4x);
+	x += (k1x + 2.0f * (k2x + k3x) + k4x) * (dt / 6.0f);
+	u += (k1v + 2.0f * (k2v + k3v) + k4v) * (dt / 6.0f);
+#else
+	u += acceleration(x, u) * dt;
+	x += u * dt;
+#endif
+	*p = x;
+	*v = (float4)(u.xyz, (*v).w);
+}
+
+__kernel void updateParticles(__global float4* pos, __global float4* color, __global float4* vel, __global float4* pos_gen, __global float4* vel_gen, float dt, unsigned int count RESPAWN_ARGS COLLIDER_ARGS)
 {
 	//get our index in the array
 	unsigned int i = get_global_id(0);
+	//the global size is padded up to a whole number of work groups
+	if(i >= count)
+		return;
 	//copy position and velocity for this iteration to a local variable
 	//note: if we were doing many more calculations we would want to have opencl
 	//copy to a local memory array to speed up memory access (this will be the subject of a later tutorial)
@@ -9,22 +155,33 @@ __kernel void updateParticles(__global float4* pos, __global float4* color, __gl
 	float4 v = vel[i];
 
 	//we've stored the life in the fourth component of our velocity array
-	float life = vel[i].w;
-	//decrease the life by the time step (this value could be adjusted to lengthen or shorten particle life
-	life -= dt;
-	//if the life is 0 or less we reset the particle's values back to the original values and set life to 1
-	if(life <= 0)
-	{
-		p = pos_gen[i];
-		v = vel_gen[i];
-		life = 1.0;
-	}
-
-	//we use a first order euler method to integrate the velocity and position (i'll expand on this in another tutorial)
-	//update the velocity to be affected by "gravity" in the z direction
-	v.z -= 9.8*dt;
-	//update the position with the new velocity
-	p.z += v.z*dt;
+	float life = v.w;
+
+	//all substeps work on the registers, global memory is only read and
+	//written once per launch
+	for(int k = 0; k < SUBSTEPS; k++)
+	{
+		//decrease the life by the time step (this value could be adjusted to lengthen or shorten particle life
+		life -= dt;
+		//if the life is 0 or less we reset the particle's values back to the original values and set life to 1
+		if(life <= 0)
+		{
+#ifdef PROCEDURAL_RESPAWN
+			spawn_particle(offset + i, step + k, 0, &p, &v);
+#else
+			p = pos_gen[i];
+			v = vel_gen[i];
+#endif
+			life = 1.0;
+		}
+
+		//integrate the velocity and position under "gravity" in the z direction,
+		//with the integrator the program was built for
+		integrate(&p, &v, dt);
+#ifdef COLLIDER
+		COLLIDE(p, v);
+#endif
+	}
 	//store the updated life in the velocity array
 	v.w = life;
 
@@ -36,4 +193,660 @@ __kernel void updateParticles(__global float4* pos, __global float4* color, __gl
 	//here we adjust the alpha
 	color[i].w = life;
 
-}
\ No newline at end of file
+}
+#ifdef COMPACT
+//compact storage: positions are 16 bit fixed point decoding as
+//center + q*scale, velocities and life are halves and colors are RGBA8.
+//the integration itself still runs in float
+__kernel void updateParticlesCompact(__global short4* pos, __global uchar4* color, __global half* vel, __global const short4* pos_gen, __global const half* vel_gen, float dt, unsigned int count, float4 center, float4 scale RESPAWN_ARGS)
+{
+	unsigned int i = get_global_id(0);
+	if(i >= count)
+		return;
+
+	float4 p = center + convert_float4(pos[i]) * scale;
+	float4 v = vload_half4(i, vel);
+	float life = v.w;
+
+	for(int k = 0; k < SUBSTEPS; k++)
+	{
+		life -= dt;
+		if(life <= 0)
+		{
+#ifdef PROCEDURAL_RESPAWN
+			spawn_particle(offset + i, step + k, 0, &p, &v);
+#else
+			p = center + convert_float4(pos_gen[i]) * scale;
+			v = vload_half4(i, vel_gen);
+#endif
+			life = 1.0;
+		}
+		integrate(&p, &v, dt);
+	}
+	v.w = life;
+
+	//scale.w is 1 and center.w 0 so w stays 1
+	pos[i] = convert_short4_sat_rte((p - center) / scale);
+	vstore_half4(v, i, vel);
+	//the whole uchar4, byte stores need cl_khr_byte_addressable_store on 1.0
+	uchar4 c = color[i];
+	c.w = convert_uchar_sat_rte(life * 255.0f);
+	color[i] = c;
+}
+#endif
+
+#if defined(LAYOUT_SOA) || defined(LAYOUT_AOSOA)
+//packed layouts only keep what changes: pos.z, vel.z and life in state and
+//the respawn pos.z and vel.z in gen. FIELD finds field f of particle i in a
+//buffer with the given number of fields per particle
+#ifdef LAYOUT_AOSOA
+//blocks of AOSOA_WIDTH particles, each field contiguous inside a block
+#define FIELD(buffer, f, fields, i, stride) buffer[((i) / AOSOA_WIDTH * (fields) + (f)) * AOSOA_WIDTH + (i) % AOSOA_WIDTH]
+#else
+//one array of stride floats per field
+#define FIELD(buffer, f, fields, i, stride) buffer[(f) * (stride) + (i)]
+#endif
+
+__kernel void updateParticlesPacked(__global float* state, __global const float* gen, float dt, unsigned int count, unsigned int stride RESPAWN_ARGS)
+{
+	unsigned int i = get_global_id(0);
+	if(i >= count)
+		return;
+
+	//neighbouring work items read neighbouring floats of every field
+	float pz = FIELD(state, 0, 3, i, stride);
+	float vz = FIELD(state, 1, 3, i, stride);
+	float life = FIELD(state, 2, 3, i, stride);
+
+	for(int k = 0; k < SUBSTEPS; k++)
+	{
+		life -= dt;
+		if(life <= 0)
+		{
+#ifdef PROCEDURAL_RESPAWN
+			float4 p, v;
+			spawn_particle(offset + i, step + k, 0, &p, &v);
+			pz = p.z;
+			vz = v.z;
+#else
+			pz = FIELD(gen, 0, 2, i, stride);
+			vz = FIELD(gen, 1, 2, i, stride);
+#endif
+			life = 1.0;
+		}
+		//only z moves, the compiler drops the rest
+		float4 p = (float4)(0.0f, 0.0f, pz, 0.0f);
+		float4 v = (float4)(0.0f, 0.0f, vz, 0.0f);
+		integrate(&p, &v, dt);
+		pz = p.z;
+		vz = v.z;
+	}
+
+	FIELD(state, 0, 3, i, stride) = pz;
+	FIELD(state, 1, 3, i, stride) = vz;
+	FIELD(state, 2, 3, i, stride) = life;
+}
+
+//copies the packed state into the interleaved buffers the renderer draws
+__kernel void unpackParticles(__global float4* pos, __global float4* color, __global const float* state, unsigned int count, unsigned int stride)
+{
+	unsigned int i = get_global_id(0);
+	if(i >= count)
+		return;
+
+	pos[i].z = FIELD(state, 0, 3, i, stride);
+	color[i].w = FIELD(state, 2, 3, i, stride);
+}
+#endif
+
+#ifdef LIFECYCLE
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+//particle lifecycles: only the particles on the live list are updated and
+//drawn. dead ones wait on a free list for an emitter to spawn them again.
+//counters holds the list sizes
+#define LIVE 0      //particles on this step's live list
+#define DEAD 1      //particles on the free list
+#define EMITTED 2   //particles emitted this step
+#define EMIT_BASE 3 //live list slot of the first one
+#define LIVE_OUT 4  //survivors appended to the next step's live list
+
+//last step's survivors are this step's live list, the emitted particles
+//come off the top of the free list and are appended to it
+__kernel void beginLifecycleStep(__global unsigned int* counters, unsigned int request)
+{
+	if(get_global_id(0) != 0)
+		return;
+
+	unsigned int emitted = min(request, counters[DEAD]);
+	counters[EMITTED] = emitted;
+	counters[EMIT_BASE] = counters[LIVE_OUT];
+	counters[LIVE] = counters[LIVE_OUT] + emitted;
+	counters[DEAD] -= emitted;
+	counters[LIVE_OUT] = 0;
+}
+
+__kernel void emitParticles(__global float4* pos, __global float4* color, __global float4* vel, __global unsigned int* live, __global const unsigned int* dead, __global const unsigned int* counters, unsigned int offset, unsigned int step)
+{
+	unsigned int e = get_global_id(0);
+	if(e >= counters[EMITTED])
+		return;
+
+	unsigned int i = dead[counters[DEAD] + e];
+	float4 p, v;
+	spawn_particle(offset + i, step, 0, &p, &v);
+	v.w = 1.0f;
+	pos[i] = p;
+	vel[i] = v;
+	color[i] = (float4)(1.0f, 0.0f, 0.0f, 1.0f);
+	live[counters[EMIT_BASE] + e] = i;
+}
+
+//updateParticles for the live list, survivors are appended to live_out and
+//the dead to the free list
+__kernel void updateLiveParticles(__global float4* pos, __global float4* color, __global float4* vel, __global const unsigned int* live, __global unsigned int* live_out, __global unsigned int* dead, __global unsigned int* counters, float dt COLLIDER_ARGS)
+{
+	unsigned int g = get_global_id(0);
+	if(g >= counters[LIVE])
+		return;
+
+	unsigned int i = live[g];
+	float4 p = pos[i];
+	float4 v = vel[i];
+	float life = v.w;
+
+	for(int k = 0; k < SUBSTEPS; k++)
+	{
+		life -= dt;
+		if(life <= 0)
+		{
+			dead[atomic_inc(&counters[DEAD])] = i;
+			return;
+		}
+		integrate(&p, &v, dt);
+#ifdef COLLIDER
+		COLLIDE(p, v);
+#endif
+	}
+	v.w = life;
+
+	pos[i] = p;
+	vel[i] = v;
+	color[i].w = life;
+	live_out[atomic_inc(&counters[LIVE_OUT])] = i;
+}
+#endif
+
+#ifdef GRID
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+//uniform grid for neighbor queries. space is cut into cells of cellSize
+//which are hashed into hashSize (a power of two) buckets, so the grid needs
+//no bounds. every step the particles are counting sorted by bucket, with
+//the scan from primitives.cl:
+//sortedIndex[cellStart[c] .. cellEnd[c]) are the particles in bucket c
+
+int4 cell_of(float4 p, float cellSize)
+{
+	int4 c = convert_int4(floor(p / cellSize));
+	c.w = 0;
+	return c;
+}
+
+unsigned int cell_hash(int4 c, unsigned int hashSize)
+{
+	return ((unsigned int)c.x * 73856093u ^ (unsigned int)c.y * 19349663u ^ (unsigned int)c.z * 83492791u) & (hashSize - 1);
+}
+
+//steps through the 27 cells around a cell, x fastest
+int4 next_offset(int4 d)
+{
+	d.x++;
+	if(d.x > 1)
+	{
+		d.x = -1;
+		d.y++;
+		if(d.y > 1)
+		{
+			d.y = -1;
+			d.z++;
+		}
+	}
+	return d;
+}
+
+//kernels taking GRID_ARGS iterate over the particles near p with
+//    FOR_EACH_NEIGHBOR(p, j) { ... }
+//j runs over the buckets of the 27 cells around p's cell, including the
+//particle itself. hashing brings in farther particles too, and a bucket
+//twice when two of the cells collide, so check the distance
+#define GRID_ARGS __global const unsigned int* cellStart, __global const unsigned int* cellEnd, __global const unsigned int* sortedIndex, float cellSize, unsigned int hashSize
+#define FOR_EACH_NEIGHBOR(p, j) \
+	for(int4 _base = cell_of(p, cellSize), _d = (int4)(-1, -1, -1, 0); _d.z <= 1; _d = next_offset(_d)) \
+		for(unsigned int _c = cell_hash(_base + _d, hashSize), _k = cellStart[_c]; \
+			_k < cellEnd[_c] && (((j) = sortedIndex[_k]), 1); _k++)
+
+__kernel void clearCells(__global unsigned int* cellCount, unsigned int hashSize)
+{
+	unsigned int c = get_global_id(0);
+	if(c < hashSize)
+		cellCount[c] = 0;
+}
+
+//bucket of every particle and its slot in the bucket
+__kernel void hashParticles(__global const float4* pos, __global unsigned int* particleCell, __global unsigned int* particleRank, __global unsigned int* cellCount, float cellSize, unsigned int hashSize, unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	if(i >= count)
+		return;
+
+	unsigned int c = cell_hash(cell_of(pos[i], cellSize), hashSize);
+	particleCell[i] = c;
+	particleRank[i] = atomic_inc(&cellCount[c]);
+}
+
+__kernel void scatterParticles(__global const unsigned int* particleCell, __global const unsigned int* particleRank, __global const unsigned int* cellStart, __global unsigned int* sortedIndex, unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	if(i < count)
+		sortedIndex[cellStart[particleCell[i]] + particleRank[i]] = i;
+}
+
+//turns the per cell counts into the end of every cell's range
+__kernel void finishCells(__global const unsigned int* cellStart, __global unsigned int* cellEnd, unsigned int hashSize)
+{
+	unsigned int c = get_global_id(0);
+	if(c < hashSize)
+		cellEnd[c] += cellStart[c];
+}
+#endif
+
+#ifdef NBODY
+//all-pairs gravity. every work group walks over all bodies in tiles of its
+//own size: each work item loads one body of the tile into local memory and
+//then all of them sum up the tile's pull, so a body is read from global
+//memory once per work group instead of once per work item. velocities are
+//kicked here and the positions drifted by moveBodies once every body is
+//kicked. softening2 keeps close encounters from blowing up
+__kernel void accelerateBodies(__global const float4* pos, __global float4* vel, __global const float* mass, __local float4* tile, float dt, float gravity, float softening2, unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	unsigned int lid = get_local_id(0);
+	unsigned int size = get_local_size(0);
+	//work items past the end still help loading the tiles
+	float4 p = pos[min(i, count - 1)];
+	float4 a = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+
+	for(unsigned int base = 0; base < count; base += size)
+	{
+		//the mass goes into w, padding has none
+		unsigned int j = base + lid;
+		float4 b = j < count ? pos[j] : (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+		b.w = j < count ? mass[j] : 0.0f;
+		tile[lid] = b;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for(unsigned int k = 0; k < size; k++)
+		{
+			float4 q = tile[k];
+			float4 d = (float4)(q.x - p.x, q.y - p.y, q.z - p.z, 0.0f);
+			float inv = rsqrt(d.x * d.x + d.y * d.y + d.z * d.z + softening2);
+			a += d * (q.w * inv * inv * inv);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if(i < count)
+		vel[i] += a * (gravity * dt);
+}
+
+__kernel void moveBodies(__global float4* pos, __global const float4* vel, float dt, unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	if(i >= count)
+		return;
+
+	//w stays 1 for drawing
+	float4 v = vel[i];
+	v.w = 0.0f;
+	pos[i] += v * dt;
+}
+#endif
+
+#ifdef BARNES_HUT
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+//barnes-hut gravity over a linear bvh (karras, "maximizing parallelism in
+//the construction of bvhs, octrees, and k-d trees"). every step the bodies
+//are sorted by the morton code of their position, the tree over the sorted
+//codes is built with one work item per internal node, masses and centers
+//of mass are summed up from the leaves and every body walks the tree,
+//taking a node as a whole once it looks smaller than theta from there.
+//nodes 0 .. count - 2 are internal with 0 the root, node count - 1 + k is
+//the k-th body in morton order
+#if MORTON_BITS > 32
+typedef ulong morton_t;
+#define MORTON_AXIS_BITS 21
+#else
+typedef uint morton_t;
+#define MORTON_AXIS_BITS 10
+#endif
+#define NO_PARENT 0xFFFFFFFFu
+#define TREE_STACK 64
+
+//spreads the bits of x out to every third bit
+morton_t expand_bits(morton_t x)
+{
+#if MORTON_BITS > 32
+	x &= 0x1FFFFFul;
+	x = (x | x << 32) & 0x1F00000000FFFFul;
+	x = (x | x << 16) & 0x1F0000FF0000FFul;
+	x = (x | x << 8) & 0x100F00F00F00F00Ful;
+	x = (x | x << 4) & 0x10C30C30C30C30C3ul;
+	x = (x | x << 2) & 0x1249249249249249ul;
+#else
+	x &= 0x3FFu;
+	x = (x * 0x00010001u) & 0xFF0000FFu;
+	x = (x * 0x00000101u) & 0x0F00F00Fu;
+	x = (x * 0x00000011u) & 0xC30C30C3u;
+	x = (x * 0x00000005u) & 0x49249249u;
+#endif
+	return x;
+}
+
+//morton code of every body inside the cube at the bounds' minimum as large
+//as their largest extent, with the body's index to sort along
+__kernel void mortonCodes(__global const float4* pos, __global const float4* boundsMin, __global const float4* boundsMax, __global morton_t* keys, __global unsigned int* order, unsigned int count)
+{
+	unsigned int i = get_global_id(0);
+	if(i >= count)
+		return;
+
+	float4 lo = boundsMin[0], hi = boundsMax[0];
+	float extent = max(max(hi.x - lo.x, hi.y - lo.y), max(hi.z - lo.z, 1e-20f));
+	float cells = (float)((1 << MORTON_AXIS_BITS) - 1);
+	float4 q = clamp((pos[i] - lo) * (cells / extent), 0.0f, cells);
+	keys[i] = expand_bits((morton_t)q.x) << 2 | expand_bits((morton_t)q.y) << 1 | expand_bits((morton_t)q.z);
+	order[i] = i;
+}
+
+//length of the common prefix of the sorted keys i and j, -1 outside of the
+//keys. equal keys fall back to comparing the indices
+int common_prefix(__global const morton_t* keys, int i, int j, int count)
+{
+	if(j < 0 || j >= count)
+		return -1;
+	morton_t a = keys[i], b = keys[j];
+	if(a == b)
+		return 8 * sizeof(morton_t) + clz((uint)(i ^ j));
+	return clz(a ^ b);
+}
+
+//internal node i covers the keys from i to the end of the longest run
+//sharing more of i's prefix than its other neighbor does, and splits where
+//that prefix grows
+__kernel void buildTree(__global const morton_t* keys, __global unsigned int* left, __global unsigned int* right, __global unsigned int* parent, __global unsigned int* visits, unsigned int count)
+{
+	int i = get_global_id(0);
+	int n = count;
+	if(i >= n - 1)
+		return;
+
+	int d = common_prefix(keys, i, i + 1, n) - common_prefix(keys, i, i - 1, n) > 0 ? 1 : -1;
+	int minPrefix = common_prefix(keys, i, i - d, n);
+	int lmax = 2;
+	while(common_prefix(keys, i, i + lmax * d, n) > minPrefix)
+		lmax *= 2;
+	int l = 0;
+	for(int t = lmax / 2; t >= 1; t /= 2)
+		if(common_prefix(keys, i, i + (l + t) * d, n) > minPrefix)
+			l += t;
+	int j = i + l * d;
+
+	int nodePrefix = common_prefix(keys, i, j, n);
+	int s = 0;
+	for(int t = (l + 1) / 2; ; t = (t + 1) / 2)
+	{
+		if(common_prefix(keys, i, i + (s + t) * d, n) > nodePrefix)
+			s += t;
+		if(t == 1)
+			break;
+	}
+	int split = i + s * d + min(d, 0);
+
+	unsigned int a = min(i, j) == split ? n - 1 + split : split;
+	unsigned int b = max(i, j) == split + 1 ? n - 1 + split + 1 : split + 1;
+	left[i] = a;
+	right[i] = b;
+	parent[a] = i;
+	parent[b] = i;
+	visits[i] = 0;
+	if(i == 0)
+		parent[0] = NO_PARENT;
+}
+
+//every leaf climbs towards the root. the first of two children to arrive
+//at a node stops, the second sums up both, so every node is done once
+//after its children. xyz of com is the center of mass, w the mass
+__kernel void summarizeTree(__global const float4* pos, __global const float* mass, __global const unsigned int* order, __global const unsigned int* left, __global const unsigned int* right, __global const unsigned int* parent,
+	__global unsigned int* visits, __global volatile float4* com, __global volatile float4* boxMin, __global volatile float4* boxMax, unsigned int count)
+{
+	unsigned int k = get_global_id(0);
+	if(k >= count)
+		return;
+
+	unsigned int node = count - 1 + k;
+	float4 p = pos[order[k]];
+	p.w = mass[order[k]];
+	com[node] = p;
+	p.w = 0.0f;
+	boxMin[node] = p;
+	boxMax[node] = p;
+	if(count == 1)
+		return;
+
+	for(node = parent[node]; node != NO_PARENT; node = parent[node])
+	{
+		//make this child visible before the sibling can see the count
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		if(atomic_inc(&visits[node]) == 0)
+			return;
+
+		unsigned int a = left[node], b = right[node];
+		float4 ca = com[a], cb = com[b];
+		float m = ca.w + cb.w;
+		float4 c = m > 0.0f ? (ca * ca.w + cb * cb.w) / m : (ca + cb) * 0.5f;
+		c.w = m;
+		com[node] = c;
+		boxMin[node] = min(boxMin[a], boxMin[b]);
+		boxMax[node] = max(boxMax[a], boxMax[b]);
+	}
+}
+
+//kicks the bodies in morton order so neighboring work items walk similar
+//paths. a node whose size is below theta times its distance counts as one
+//body at its center of mass, a full stack does the same
+__kernel void accelerateTree(__global const float4* pos, __global float4* vel, __global const unsigned int* order, __global const float4* com, float dt, float gravity, float softening2, unsigned int count,
+	__global const float4* boxMin, __global const float4* boxMax, __global const unsigned int* left, __global const unsigned int* right, float theta2)
+{
+	unsigned int k = get_global_id(0);
+	if(k >= count)
+		return;
+
+	unsigned int b = order[k];
+	float4 p = pos[b];
+	float4 a = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+	unsigned int stack[TREE_STACK];
+	int top = 0;
+	stack[top++] = 0;
+
+	while(top > 0)
+	{
+		unsigned int node = stack[--top];
+		float4 q = com[node];
+		float4 d = (float4)(q.x - p.x, q.y - p.y, q.z - p.z, 0.0f);
+		float r2 = d.x * d.x + d.y * d.y + d.z * d.z;
+		float4 size = boxMax[node] - boxMin[node];
+		float s = max(max(size.x, size.y), size.z);
+
+		if(node >= count - 1 || s * s < theta2 * r2 || top + 2 > TREE_STACK)
+		{
+			float inv = rsqrt(r2 + softening2);
+			a += d * (q.w * inv * inv * inv);
+		}
+		else
+		{
+			stack[top++] = left[node];
+			stack[top++] = right[node];
+		}
+	}
+
+	vel[b] += a * (gravity * dt);
+}
+#endif
+
+#ifdef SPH
+//smoothed particle hydrodynamics (muller et al., "particle-based fluid
+//simulation for interactive applications"): density and pressure from
+//the poly6 kernel, pressure forces from the spiky kernel's gradient and
+//viscosity from its laplacian. fluid is (smoothing length h, particle mass,
+//rest density, stiffness), the grid cells are h wide so all neighbors are
+//in the 27 cells around a particle. both passes run over the particles in
+//bucket order on copies sorted the same way, so a work group's own
+//particles, which make up much of its neighbors, come from local memory
+#ifndef SPH_BOX
+#define SPH_BOX 0.5f
+#endif
+#define PI 3.14159265f
+
+//the buckets of the 27 cells around p's cell, each once even when cells
+//share a bucket
+unsigned int neighbor_buckets(float4 p, float cellSize, unsigned int hashSize, unsigned int* buckets)
+{
+	int4 base = cell_of(p, cellSize);
+	unsigned int n = 0;
+	for(int4 d = (int4)(-1, -1, -1, 0); d.z <= 1; d = next_offset(d))
+	{
+		unsigned int c = cell_hash(base + d, hashSize);
+		unsigned int m = 0;
+		while(m < n && buckets[m] != c)
+			m++;
+		if(m == n)
+			buckets[n++] = c;
+	}
+	return n;
+}
+
+__kernel void sphReorder(__global const float4* pos, __global const float4* vel, __global const unsigned int* sortedIndex, __global float4* sortedPos, __global float4* sortedVel, unsigned int count)
+{
+	unsigned int k = get_global_id(0);
+	if(k >= count)
+		return;
+	unsigned int i = sortedIndex[k];
+	sortedPos[k] = pos[i];
+	sortedVel[k] = vel[i];
+}
+
+//density and pressure of every sorted particle
+__kernel void sphDensity(__global const float4* sortedPos, __global float2* state, __global const unsigned int* cellStart, __global const unsigned int* cellEnd,
+	__local float4* cache, float4 fluid, unsigned int hashSize, unsigned int count)
+{
+	unsigned int k = get_global_id(0);
+	unsigned int lid = get_local_id(0);
+	unsigned int size = get_local_size(0);
+	unsigned int base = k - lid;
+	if(k < count)
+		cache[lid] = sortedPos[k];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if(k >= count)
+		return;
+
+	float h = fluid.x, h2 = h * h;
+	float4 p = cache[lid];
+	unsigned int buckets[27];
+	unsigned int n = neighbor_buckets(p, h, hashSize, buckets);
+	float sum = 0.0f;
+	for(unsigned int b = 0; b < n; b++)
+	{
+		for(unsigned int s = cellStart[buckets[b]]; s < cellEnd[buckets[b]]; s++)
+		{
+			float4 q = s - base < size ? cache[s - base] : sortedPos[s];
+			float4 d = (float4)(p.x - q.x, p.y - q.y, p.z - q.z, 0.0f);
+			float r2 = dot(d, d);
+			if(r2 < h2)
+				sum += (h2 - r2) * (h2 - r2) * (h2 - r2);
+		}
+	}
+
+	float density = fluid.y * 315.0f / (64.0f * PI * pown(h, 9)) * sum;
+	state[k] = (float2)(density, max(fluid.w * (density - fluid.z), 0.0f));
+}
+
+//pressure, viscosity and gravity, then the particle moves and bounces off
+//the walls of the box. the results go back to the unsorted buffers the
+//renderer draws, colored by speed
+__kernel void sphForces(__global float4* pos, __global float4* color, __global float4* vel, __global const float4* sortedPos, __global const float4* sortedVel,
+	__global const float2* state, __global const unsigned int* sortedIndex, __global const unsigned int* cellStart, __global const unsigned int* cellEnd,
+	__local float4* cache, __local float2* cacheState, float4 fluid, float viscosity, float dt, unsigned int hashSize, unsigned int count)
+{
+	unsigned int k = get_global_id(0);
+	unsigned int lid = get_local_id(0);
+	unsigned int size = get_local_size(0);
+	unsigned int base = k - lid;
+	//positions in the first half of cache, velocities in the second
+	if(k < count)
+	{
+		cache[lid] = sortedPos[k];
+		cache[size + lid] = sortedVel[k];
+		cacheState[lid] = state[k];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if(k >= count)
+		return;
+
+	float h = fluid.x, mass = fluid.y;
+	float gradient = 45.0f / (PI * pown(h, 6));
+	float4 p = cache[lid], v = cache[size + lid];
+	float2 si = cacheState[lid];
+	float4 a = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+
+	unsigned int buckets[27];
+	unsigned int n = neighbor_buckets(p, h, hashSize, buckets);
+	for(unsigned int b = 0; b < n; b++)
+	{
+		for(unsigned int s = cellStart[buckets[b]]; s < cellEnd[buckets[b]]; s++)
+		{
+			bool cached = s - base < size;
+			float4 q = cached ? cache[s - base] : sortedPos[s];
+			float4 d = (float4)(p.x - q.x, p.y - q.y, p.z - q.z, 0.0f);
+			float r = length(d);
+			if(s == k || r >= h || r <= 0.0f)
+				continue;
+
+			float4 vj = cached ? cache[size + s - base] : sortedVel[s];
+			float2 sj = cached ? cacheState[s - base] : state[s];
+			float hr = h - r;
+			//pushes i away from j, pulls i along with j's velocity
+			a += d * (mass * (si.y + sj.y) / (2.0f * sj.x) * gradient * hr * hr / r);
+			a += (vj - v) * (viscosity * mass / sj.x * gradient * hr);
+		}
+	}
+	a = a / si.x;
+	a.z -= 9.8f;
+	a.w = 0.0f;
+
+	v += a * dt;
+	p += v * dt;
+	//walls of the box, losing half the speed
+	if(p.x < -SPH_BOX) { p.x = -SPH_BOX; v.x *= -0.5f; }
+	if(p.x > SPH_BOX) { p.x = SPH_BOX; v.x *= -0.5f; }
+	if(p.y < -SPH_BOX) { p.y = -SPH_BOX; v.y *= -0.5f; }
+	if(p.y > SPH_BOX) { p.y = SPH_BOX; v.y *= -0.5f; }
+	if(p.z < -SPH_BOX) { p.z = -SPH_BOX; v.z *= -0.5f; }
+	if(p.z > SPH_BOX) { p.z = SPH_BOX; v.z *= -0.5f; }
+	p.w = 1.0f;
+
+	unsigned int i = sortedIndex[k];
+	pos[i] = p;
+	vel[i] = v;
+	float speed = min(length(v) / 3.0f, 1.0f);
+	color[i] = (float4)(speed, speed, 1.0f, 1.0f);
+}
+#endif
@@ -0,0 +1,224 @@
+//parallel building blocks for the other programs: exclusive and segmented
+//scans, a key-value radix sort, reductions and stream compaction. a work
+//group handles a tile of TILE elements staged in local memory, every work
+//item ITEMS consecutive ones of it. the host picks GROUP_SIZE (a power of
+//two of at least RADIX) and ITEMS to fit the device's local memory
+#ifndef GROUP_SIZE
+#define GROUP_SIZE 256
+#endif
+#ifndef ITEMS
+#define ITEMS 4
+#endif
+#define TILE (GROUP_SIZE * ITEMS)
+
+//the sort takes 4 bits of the key per pass
+#define RADIX_BITS 4
+#define RADIX (1 << RADIX_BITS)
+
+//exclusive scan of size values in local memory, size a power of two, by
+//all work items of the group (blelloch's up-sweep and down-sweep). returns
+//the total
+uint scan_local(__local uint* a, uint size)
+{
+	uint lid = get_local_id(0);
+	uint offset = 1;
+	for(uint d = size >> 1; d > 0; d >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for(uint i = lid; i < d; i += GROUP_SIZE)
+			a[offset * (2 * i + 2) - 1] += a[offset * (2 * i + 1) - 1];
+		offset <<= 1;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint total = a[size - 1];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if(lid == 0)
+		a[size - 1] = 0;
+
+	for(uint d = 1; d < size; d <<= 1)
+	{
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for(uint i = lid; i < d; i += GROUP_SIZE)
+		{
+			uint x = offset * (2 * i + 1) - 1;
+			uint y = offset * (2 * i + 2) - 1;
+			uint t = a[x];
+			a[x] = a[y];
+			a[y] += t;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return total;
+}
+
+//exclusive scan of every tile, the tile's total goes to sums unless NULL.
+//in and out may be the same buffer
+__kernel void scanTiles(__global const uint* in, __global uint* out, __global uint* sums, uint n)
+{
+	__local uint tile[TILE];
+	__local uint totals[GROUP_SIZE];
+	uint lid = get_local_id(0);
+	uint base = get_group_id(0) * TILE;
+
+	for(uint k = lid; k < TILE; k += GROUP_SIZE)
+		tile[k] = base + k < n ? in[base + k] : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//every work item scans its own run, then the run totals are scanned
+	uint sum = 0;
+	for(uint k = lid * ITEMS; k < (lid + 1) * ITEMS; k++)
+	{
+		uint v = tile[k];
+		tile[k] = sum;
+		sum += v;
+	}
+	totals[lid] = sum;
+	uint total = scan_local(totals, GROUP_SIZE);
+
+	for(uint k = lid * ITEMS; k < (lid + 1) * ITEMS; k++)
+		tile[k] += totals[lid];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint k = lid; k < TILE; k += GROUP_SIZE)
+		if(base + k < n)
+			out[base + k] = tile[k];
+	if(sums && lid == 0)
+		sums[get_group_id(0)] = total;
+}
+
+//adds the scanned tile totals to the tiles
+__kernel void addTileSums(__global uint* data, __global const uint* sums, uint n)
+{
+	uint base = get_group_id(0) * TILE;
+	uint s = sums[get_group_id(0)];
+	for(uint k = get_local_id(0); k < TILE; k += GROUP_SIZE)
+		if(base + k < n)
+			data[base + k] += s;
+}
+
+//segmented scans subtract the plain scan at the segment's head. ids is the
+//exclusive scan of the head flags, so element i is in segment
+//ids[i] + heads[i] and segment 0 holds whatever comes before the first head
+__kernel void segmentBases(__global const uint* scan, __global const uint* ids, __global const uint* heads, __global uint* bases, uint n)
+{
+	uint i = get_global_id(0);
+	if(i >= n)
+		return;
+	if(i == 0)
+		bases[0] = 0;
+	if(heads[i])
+		bases[ids[i] + 1] = scan[i];
+}
+
+__kernel void segmentFinish(__global uint* out, __global const uint* ids, __global const uint* heads, __global const uint* bases, uint n)
+{
+	uint i = get_global_id(0);
+	if(i < n)
+		out[i] -= bases[ids[i] + heads[i]];
+}
+
+//stream compaction: the flagged elements in order, pos is the exclusive
+//scan of the flags and the last element writes the number kept
+__kernel void compactScatter(__global const uint* in, __global const uint* flags, __global const uint* pos, __global uint* out, __global uint* count, uint n)
+{
+	uint i = get_global_id(0);
+	if(i >= n)
+		return;
+	if(flags[i])
+		out[pos[i]] = in[i];
+	if(i == n - 1)
+		count[0] = pos[i] + flags[i];
+}
+
+//least significant digit radix sort, one pass per digit:
+//radixCount counts every tile's digits into counts[digit * groups + group],
+//whose exclusive scan gives each tile the first slot of every digit, then
+//radixScatter moves the tile's pairs there keeping their order. every work
+//item counts its run in its own column of digits so no atomics are needed
+#define RADIX_KERNELS(KEY, COUNT, SCATTER) \
+__kernel void COUNT(__global const KEY* keys, __global uint* counts, uint n, uint shift) \
+{ \
+	__local uint digits[RADIX * GROUP_SIZE]; \
+	uint lid = get_local_id(0); \
+	uint base = get_group_id(0) * TILE; \
+	for(uint d = 0; d < RADIX; d++) \
+		digits[d * GROUP_SIZE + lid] = 0; \
+	for(uint k = lid; k < TILE; k += GROUP_SIZE) \
+		if(base + k < n) \
+			digits[(uint)((keys[base + k] >> shift) & (RADIX - 1)) * GROUP_SIZE + lid]++; \
+	for(uint stride = GROUP_SIZE / 2; stride > 0; stride >>= 1) \
+	{ \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+		if(lid < stride) \
+			for(uint d = 0; d < RADIX; d++) \
+				digits[d * GROUP_SIZE + lid] += digits[d * GROUP_SIZE + lid + stride]; \
+	} \
+	barrier(CLK_LOCAL_MEM_FENCE); \
+	if(lid < RADIX) \
+		counts[lid * get_num_groups(0) + get_group_id(0)] = digits[lid * GROUP_SIZE]; \
+} \
+ \
+__kernel void SCATTER(__global const KEY* keysIn, __global const uint* valuesIn, __global KEY* keysOut, __global uint* valuesOut, \
+	__global const uint* offsets, uint n, uint shift) \
+{ \
+	__local KEY tile[TILE]; \
+	__local uint digits[RADIX * GROUP_SIZE]; \
+	__local uint starts[RADIX]; \
+	uint lid = get_local_id(0); \
+	uint base = get_group_id(0) * TILE; \
+	for(uint d = 0; d < RADIX; d++) \
+		digits[d * GROUP_SIZE + lid] = 0; \
+	for(uint k = lid; k < TILE; k += GROUP_SIZE) \
+		if(base + k < n) \
+			tile[k] = keysIn[base + k]; \
+	barrier(CLK_LOCAL_MEM_FENCE); \
+	uint end = min((lid + 1) * ITEMS, n > base ? n - base : 0); \
+	for(uint k = lid * ITEMS; k < end; k++) \
+		digits[(uint)((tile[k] >> shift) & (RADIX - 1)) * GROUP_SIZE + lid]++; \
+	/* digit major, so every digit's count comes after the smaller digits */ \
+	scan_local(digits, RADIX * GROUP_SIZE); \
+	if(lid < RADIX) \
+		starts[lid] = digits[lid * GROUP_SIZE]; \
+	barrier(CLK_LOCAL_MEM_FENCE); \
+	for(uint k = lid * ITEMS; k < end; k++) \
+	{ \
+		uint d = (uint)((tile[k] >> shift) & (RADIX - 1)); \
+		uint slot = offsets[d * get_num_groups(0) + get_group_id(0)] + digits[d * GROUP_SIZE + lid]++ - starts[d]; \
+		keysOut[slot] = tile[k]; \
+		valuesOut[slot] = valuesIn[base + k]; \
+	} \
+}
+
+RADIX_KERNELS(uint, radixCount32, radixScatter32)
+RADIX_KERNELS(ulong, radixCount64, radixScatter64)
+
+//op 0 sums, 1 takes the minimum, 2 the maximum. every tile reduces to one
+//value in out[group]
+#define REDUCE_KERNEL(T, NAME) \
+__kernel void NAME(__global const T* in, __global T* out, uint n, uint op, T identity) \
+{ \
+	__local T partial[GROUP_SIZE]; \
+	uint lid = get_local_id(0); \
+	uint base = get_group_id(0) * TILE; \
+	T acc = identity; \
+	for(uint k = lid; k < TILE; k += GROUP_SIZE) \
+		if(base + k < n) \
+			acc = op == 0 ? acc + in[base + k] : op == 1 ? min(acc, in[base + k]) : max(acc, in[base + k]); \
+	partial[lid] = acc; \
+	for(uint stride = GROUP_SIZE / 2; stride > 0; stride >>= 1) \
+	{ \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+		if(lid < stride) \
+		{ \
+			T a = partial[lid], b = partial[lid + stride]; \
+			partial[lid] = op == 0 ? a + b : op == 1 ? min(a, b) : max(a, b); \
+		} \
+	} \
+	if(lid == 0) \
+		out[get_group_id(0)] = partial[0]; \
+}
+
+REDUCE_KERNEL(uint, reduceUint)
+REDUCE_KERNEL(float, reduceFloat)
+REDUCE_KERNEL(float4, reduceFloat4)
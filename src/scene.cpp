@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "scene.h"
+
+//----------------------------------------------------------------------
+//quick random function to distribute our initial points
+float rand_float(float mn, float mx)
+{
+    float r = rand() / (float) RAND_MAX;
+    return mn + (mx-mn)*r;
+}
+
+
+//----------------------------------------------------------------------
+void init_particles(Vector4* pos, Vector4* vel, Vector4* color, int num)
+{
+    for(int i = 0; i < num; i++)
+    {
+        //distribute the particles in a random circle around z axis
+        float rad = rand_float(.2, .5);
+        float x = rad*sin(2*3.14 * i/num);
+        float z = 0.0f;// -.1 + .2f * i/num;
+        float y = rad*cos(2*3.14 * i/num);
+		pos[i][0] = x; pos[i][1] = y; pos[i][2] = z; pos[i][3] = 1.0f;
+        
+        //give some initial velocity
+        //float xr = rand_float(-.1, .1);
+        //float yr = rand_float(1.f, 3.f);
+        //the life is the lifetime of the particle: 1 = alive 0 = dead
+        //as you will see in part2.cl we reset the particle when it dies
+        float life_r = rand_float(0.f, 1.f);
+		vel[i][0] = 0; vel[i][1] = 0; vel[i][2] = 3.0f; vel[i][3] = life_r;
+
+        //just make them red and full alpha
+        color[i][0] = 1; color[i][1] = 0; color[i][2] = 0; color[i][3] = 1;
+    }
+}
+
+
+//----------------------------------------------------------------------
+void init_bodies(Vector4* pos, Vector4* vel, Vector4* color, int num)
+{
+    //half the mass sits in the center, the disc shares the other half
+    float center = num > 1 ? .05f : .1f;
+    float mass = num > 1 ? .05f / (num - 1) : 0.f;
+    float rmin = .1f, rmax = .5f;
+
+    for(int i = 0; i < num; i++)
+    {
+        float x = 0, y = 0, z = 0, vx = 0, vy = 0;
+        if(i > 0)
+        {
+            //uniform over the disc's area
+            float rad = sqrt(rand_float(rmin*rmin, rmax*rmax));
+            float angle = rand_float(0.f, 2*3.14159265f);
+            x = rad*cos(angle);
+            y = rad*sin(angle);
+            z = rand_float(-.01f, .01f);
+
+            //circular orbit around the mass inside the radius
+            float inside = center + .05f * (rad*rad - rmin*rmin) / (rmax*rmax - rmin*rmin);
+            float speed = sqrt(inside / rad);
+            vx = -speed*sin(angle);
+            vy = speed*cos(angle);
+        }
+        pos[i][0] = x; pos[i][1] = y; pos[i][2] = z; pos[i][3] = 1.0f;
+        vel[i][0] = vx; vel[i][1] = vy; vel[i][2] = 0; vel[i][3] = i > 0 ? mass : center;
+
+        //white at the center fading to blue at the rim
+        float t = sqrt(x*x + y*y) / rmax;
+        color[i][0] = 1 - t; color[i][1] = 1 - t; color[i][2] = 1; color[i][3] = 1;
+    }
+}
+
+
+//----------------------------------------------------------------------
+float init_fluid(Vector4* pos, Vector4* vel, Vector4* color, int num)
+{
+    //the block is [-0.5, 0] x [-0.5, 0.5] x [-0.5, 0], its volume shared
+    //evenly between the particles
+    float spacing = pow(.25f / (num > 0 ? num : 1), 1.f/3.f);
+    int nx = (int)(.5f / spacing) > 0 ? (int)(.5f / spacing) : 1;
+    int ny = (int)(1.f / spacing) > 0 ? (int)(1.f / spacing) : 1;
+
+    for(int i = 0; i < num; i++)
+    {
+        //a little jitter keeps the lattice from stacking perfectly
+        float x = -.5f + (i % nx + .5f) * spacing + rand_float(-.01f, .01f) * spacing;
+        float y = -.5f + (i / nx % ny + .5f) * spacing + rand_float(-.01f, .01f) * spacing;
+        float z = -.5f + (i / (nx*ny) + .5f) * spacing;
+        pos[i][0] = x; pos[i][1] = y; pos[i][2] = z; pos[i][3] = 1.0f;
+        vel[i][0] = 0; vel[i][1] = 0; vel[i][2] = 0; vel[i][3] = 0;
+        color[i][0] = 0; color[i][1] = 0; color[i][2] = 1; color[i][3] = 1;
+    }
+    return spacing;
+}
+
+
+//----------------------------------------------------------------------
+bool write_demo_collider(const char* file, int resolution)
+{
+    int n = resolution > 2 ? resolution : 2;
+    size_t samples = (size_t)n * n * n;
+    std::vector<char> data(sizeof(ColliderHeader) + sizeof(float) * samples);
+    ColliderHeader* header = (ColliderHeader*)&data[0];
+    float* distance = (float*)(header + 1);
+
+    //the volume covers [-0.6, 0.6]^3
+    memcpy(header->magic, "PSDF", 4);
+    header->version = 1;
+    header->size[0] = header->size[1] = header->size[2] = n;
+    header->origin[0] = header->origin[1] = header->origin[2] = -.6f;
+    header->spacing = 1.2f / (n - 1);
+
+    for(size_t s = 0; s < samples; s++)
+    {
+        float x = header->origin[0] + s % n * header->spacing;
+        float y = header->origin[1] + s / n % n * header->spacing;
+        float z = header->origin[2] + s / n / n * header->spacing;
+        //the union of the colliders is the nearest one
+        float floor = z + .3f;
+        float ball = sqrt(x*x + (y - .35f)*(y - .35f) + (z - .2f)*(z - .2f)) - .1f;
+        distance[s] = floor < ball ? floor : ball;
+    }
+    FILE* f = fopen(file, "wb");
+    if(!f)
+        return false;
+    bool written = fwrite(&data[0], 1, data.size(), f) == data.size();
+    fclose(f);
+    return written;
+}
@@ -0,0 +1,35 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "Engine.h"
+
+float rand_float(float mn, float mx);
+
+//fills the initial particle state: a ring around the z axis moving up
+void init_particles(Vector4* pos, Vector4* vel, Vector4* color, int num);
+
+//fills the initial state of n-body gravity with gravity = 1: a thin disc in
+//circular orbits around a heavy body at the origin, masses in vel.w
+void init_bodies(Vector4* pos, Vector4* vel, Vector4* color, int num);
+
+//fills the initial state of the sph fluid: a block at rest filling a
+//quarter of the [-0.5, 0.5]^3 box on a lattice, returns its spacing
+float init_fluid(Vector4* pos, Vector4* vel, Vector4* color, int num);
+
+//signed distance volume of static colliders, negative inside: this header
+//and then size[0]*size[1]*size[2] floats, x fastest. sample (i, j, k) is
+//the distance at origin + (i, j, k)*spacing
+struct ColliderHeader
+{
+    char magic[4]; //"PSDF"
+    unsigned int version; //1
+    unsigned int size[3];
+    float origin[3];
+    float spacing;
+};
+
+//writes a collider volume of resolution^3 samples around the fountain: a
+//floor below the ring and a ball in the way of the rising particles
+bool write_demo_collider(const char* file, int resolution);
+
+#endif
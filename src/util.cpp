@@ -3,11 +3,25 @@
 //#include <stdlib.h>
 #include <string>
 #include <string.h>
+#include <limits.h>
 
 #include <CL/cl.h>
 
 #include "util.h"
 
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#endif
+
 #ifdef UTIL_GL_SHARING
 #define GL_INTEROP
 #include "opengl.h"
@@ -52,9 +66,175 @@ char *read_file(const char *filename, int *length)
 	return (char*)buffer;
 }
 
+char *read_binary_file(const char *filename, size_t *length)
+{
+	FILE *f = fopen(filename, "rb");
+	void *buffer;
+
+	if (!f)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	*length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buffer = malloc(*length);
+	if (buffer && fread(buffer, 1, *length, f) != *length) {
+		free(buffer);
+		buffer = NULL;
+	}
+	fclose(f);
+
+	return (char*)buffer;
+}
+
+const void *map_file(const char *filename, size_t *length)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping)
+		return NULL;
+
+	// The view keeps the mapping alive
+	void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	*length = (size_t)size.QuadPart;
+	return data;
+#else
+	int file = open(filename, O_RDONLY);
+	if (file < 0)
+		return NULL;
+	struct stat info;
+	void *data = MAP_FAILED;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	madvise(data, info.st_size, MADV_SEQUENTIAL);
+	*length = info.st_size;
+	return data;
+#endif
+}
+
+void unmap_file(const void *data, size_t length)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void*)data, length);
+#endif
+}
+
+bool write_file(const char *filename, const void *data, size_t length)
+{
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s for writing\n", filename);
+		return false;
+	}
+
+	bool ok = fwrite(data, 1, length, f) == length;
+	fclose(f);
+	return ok;
+}
+
+// 64 bit FNV-1a, pass the previous result as hash to extend it.
+unsigned long long hash_fnv1a(const void *data, size_t length, unsigned long long hash)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+void *aligned_malloc(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void *buffer;
+	if (posix_memalign(&buffer, alignment, size) != 0)
+		return NULL;
+	return buffer;
+#endif
+}
+
+void aligned_free(void *buffer)
+{
+#ifdef _WIN32
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+}
+
+double get_time()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// IEEE 754 half float with round to nearest even, as vstore_half does.
+unsigned short float_to_half(float value)
+{
+	unsigned int x;
+	memcpy(&x, &value, sizeof(x));
+	unsigned int sign = (x >> 16) & 0x8000;
+	unsigned int mantissa = x & 0x7fffff;
+	int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+
+	if(((x >> 23) & 0xff) == 0xff) // Inf and NaN
+		return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	if(exponent >= 31)
+		return (unsigned short)(sign | 0x7c00);
+
+	int shift = 13;
+	if(exponent <= 0)
+	{
+		// Denormal, or zero when even the largest denormal rounding fails
+		if(exponent < -10)
+			return (unsigned short)sign;
+		mantissa |= 0x800000;
+		shift = 14 - exponent;
+		exponent = 0;
+	}
+	unsigned int half = ((unsigned int)exponent << 10) | (mantissa >> shift);
+	unsigned int rest = mantissa & ((1u << shift) - 1);
+	unsigned int halfway = 1u << (shift - 1);
+	// A carry out of the mantissa correctly bumps the exponent
+	if(rest > halfway || (rest == halfway && (half & 1)))
+		half++;
+	return (unsigned short)(sign | half);
+}
+
 #ifdef UTIL_GL_SHARING
-GLuint oglCreateVBO(const void* data, int dataSize, GLenum target, GLenum usage)
+GLuint oglCreateVBO(const void* data, GLsizeiptr dataSize, GLenum target, GLenum usage)
 {
+	if( dataSize > INT_MAX )
+	{
+		printf("Can't create a gl buffer of %.0f bytes, the limit is %d.\n", (double)dataSize, INT_MAX);
+		return 0;
+	}
+
 	GLuint vbo;
 	glGenBuffers(1,&vbo);
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
@@ -62,7 +242,7 @@ GLuint oglCreateVBO(const void* data, int dataSize, GLenum target, GLenum usage)
 
 	int bufferSize = 0;
 	glGetBufferParameteriv(target, GL_BUFFER_SIZE, &bufferSize);
-	if( dataSize != bufferSize )
+	if( dataSize != (GLsizeiptr)bufferSize )
 	{
 		printf("No memmory allocated for gl buffer.\n");
 		glDeleteBuffers(1, &vbo);
@@ -139,6 +319,44 @@ bool oclGetNVIDIAPlatform(cl_platform_id* clSelectedPlatformID)
 	return true;
 }
 
+bool oclGetPlatformByIndex(cl_platform_id* platformId, int index)
+{
+	cl_uint num_platforms;
+	cl_int error;
+
+	error = clGetPlatformIDs(0, NULL, &num_platforms);
+	if(error != CL_SUCCESS || index < 0 || (cl_uint)index >= num_platforms)
+	{
+		printf("No OpenCL platform %d\n", index);
+		return false;
+	}
+
+	cl_platform_id* platforms = (cl_platform_id*)malloc(num_platforms * sizeof(cl_platform_id));
+	error = clGetPlatformIDs(num_platforms, platforms, NULL);
+	*platformId = platforms[index];
+	free(platforms);
+	return error == CL_SUCCESS;
+}
+
+bool oclGetDeviceByIndex(cl_device_id* deviceId , cl_platform_id platformId, int index)
+{
+	cl_uint deviceCount;
+	cl_int error;
+
+	error = clGetDeviceIDs(platformId,CL_DEVICE_TYPE_ALL,0, NULL, &deviceCount);
+	if(error != CL_SUCCESS || index < 0 || (cl_uint)index >= deviceCount)
+	{
+		printf("No device %d on platform\n", index);
+		return false;
+	}
+
+	cl_device_id* devices = (cl_device_id*)malloc(deviceCount*sizeof(cl_device_id));
+	error = clGetDeviceIDs(platformId,CL_DEVICE_TYPE_ALL, deviceCount, devices, NULL);
+	*deviceId = devices[index];
+	free(devices);
+	return error == CL_SUCCESS;
+}
+
 bool oclGetSomeGPUDevice(cl_device_id* deviceId , cl_platform_id platformId)
 {
 	cl_uint deviceCount;
@@ -219,78 +437,267 @@ bool oclGetSomeGPUDevice(cl_device_id* deviceId , cl_platform_id platformId)
 	return true;
 }
 
-bool oclCreateSomeContext(cl_context* context , cl_device_id deviceId,cl_platform_id platformId)
+bool oclGetSomeDevice(cl_device_id* deviceId , cl_platform_id platformId)
 {
-	cl_int error = 0;
+	cl_uint deviceCount;
+	cl_int error;
 
-#ifdef UTIL_GL_SHARING
-	// Define OS-specific context properties and create the OpenCL context
-#if defined (__APPLE__)
-	CGLContextObj kCGLContext = CGLGetCurrentContext();
-	CGLShareGroupObj kCGLShareGroup = CGLGetShareGroup(kCGLContext);
-	if( kCGLContext == NULL)
-		printf("CGLGetCurrentContext() returned NULL\n");
-	if( kCGLShareGroup == NULL)
-		printf("CGLGetShareGroup(kCGLContext) returned NULL\n");
-	cl_context_properties props[] = 
+	// Prefer a GPU, but take whatever the platform offers.
+	error = clGetDeviceIDs(platformId,CL_DEVICE_TYPE_GPU,1, deviceId, &deviceCount);
+	if(error == CL_SUCCESS && deviceCount > 0)
+		return true;
+
+	error = clGetDeviceIDs(platformId,CL_DEVICE_TYPE_ALL,1, deviceId, &deviceCount);
+	if(error != CL_SUCCESS)
 	{
-		CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE, (cl_context_properties)kCGLShareGroup, 
-		0 
-	};
-	cxGPUContext = clCreateContext(props, 0,0, NULL, NULL, &ciErrNum);
+		printf("Failed to fetch device with error code %d (%s)\n",error, oclErrorString(error));
+		return false;
+	}
+	if(deviceCount == 0)
+	{
+		printf("No devices found on platform\n");
+		return false;
+	}
+	return true;
+}
+
+bool oclDeviceHasExtension(cl_device_id deviceId, const char* extension)
+{
+	size_t extensionsSize;
+	cl_int error;
+
+	error = clGetDeviceInfo(deviceId, CL_DEVICE_EXTENSIONS, 0, NULL, &extensionsSize);
+	if(error != CL_SUCCESS)
+		return false;
+
+	char* extensions = (char*)malloc(extensionsSize);
+	error = clGetDeviceInfo(deviceId, CL_DEVICE_EXTENSIONS, extensionsSize, extensions, NULL);
+	bool found = error == CL_SUCCESS && strstr(extensions, extension) != NULL;
+	free(extensions);
+	return found;
+}
+
+// OpenCL 1.2, missing from the 1.0 headers and import library, so the entry
+// points are looked up in the already loaded OpenCL library
+typedef cl_int (CL_API_CALL *clCreateSubDevicesFn)(cl_device_id, const intptr_t*, cl_uint, cl_device_id*, cl_uint*);
+typedef cl_int (CL_API_CALL *clReleaseDeviceFn)(cl_device_id);
+
+static void* oclGetFunction(const char* name)
+{
+#ifdef _WIN32
+	HMODULE module = GetModuleHandleA("OpenCL.dll");
+	return module ? (void*)GetProcAddress(module, name) : NULL;
 #else
-#ifdef UNIX
-	GLXContext glxContext = glXGetCurrentContext();
-	Display* display = glXGetCurrentDisplay();
-	if(glxContext == NULL)
-		printf("glXGetCurrentContext() returned NULL\n");
-	if(display == NULL)
-		printf("glXGetCurrentDisplay() returned NULL\n");
-	cl_context_properties props[] = 
+	return dlsym(RTLD_DEFAULT, name);
+#endif
+}
+
+bool oclCreateSubDevice(cl_device_id* subDevice, cl_device_id deviceId, const intptr_t* properties)
+{
+	clCreateSubDevicesFn createSubDevices = (clCreateSubDevicesFn)oclGetFunction("clCreateSubDevices");
+	if(!createSubDevices)
 	{
-		CL_GL_CONTEXT_KHR, (cl_context_properties)glxContext, 
-		CL_GLX_DISPLAY_KHR, (cl_context_properties)display, 
-		CL_CONTEXT_PLATFORM, (cl_context_properties)cpPlatform, 
-		0
-	};
-	cxGPUContext = clCreateContext(props, 1, &cdDevices[uiDeviceUsed], NULL, NULL, &ciErrNum);
-#else // Win32
-	HGLRC wglContext = wglGetCurrentContext();
-	HDC wglDC = wglGetCurrentDC();
-	if(wglContext == NULL)
-		printf("wglGetCurrentContext() returned NULL\n");
-	if(wglDC == NULL)
-		printf("wglGetCurrentDC() returned NULL\n");
-	cl_context_properties props[] = 
+		printf("clCreateSubDevices is not available (needs an OpenCL 1.2 runtime)\n");
+		return false;
+	}
+
+	cl_uint count = 0;
+	cl_int error = createSubDevices(deviceId, properties, 0, NULL, &count);
+	if(error != CL_SUCCESS || count == 0)
 	{
-		CL_GL_CONTEXT_KHR, (cl_context_properties)wglContext, 
-		CL_WGL_HDC_KHR, (cl_context_properties)wglDC, 
-		CL_CONTEXT_PLATFORM, (cl_context_properties)platformId, 
-		0
-	};
+		printf("Failed to partition the device with error code %d (%s)\n", error, oclErrorString(error));
+		return false;
+	}
 
-	*context = clCreateContext(props, 1, &deviceId, NULL, NULL, &error);
+	cl_device_id* devices = (cl_device_id*)malloc(count * sizeof(cl_device_id));
+	error = createSubDevices(deviceId, properties, count, devices, NULL);
 	if(error != CL_SUCCESS)
 	{
-		printf("Failed to create shared gl-cl context with error code %d (%s)\n", error, oclErrorString(error));
+		free(devices);
+		printf("Failed to create sub-devices with error code %d (%s)\n", error, oclErrorString(error));
 		return false;
 	}
+
+	// Keep the first, the other partitions stay unused
+	*subDevice = devices[0];
+	for(cl_uint i = 1; i < count; i++)
+		oclReleaseSubDevice(devices[i]);
+	free(devices);
+	return true;
+}
+
+void oclReleaseSubDevice(cl_device_id subDevice)
+{
+	clReleaseDeviceFn releaseDevice = (clReleaseDeviceFn)oclGetFunction("clReleaseDevice");
+	if(releaseDevice)
+		releaseDevice(subDevice);
+}
+
+bool oclCreateSomeContext(cl_context* context , cl_device_id deviceId,cl_platform_id platformId, bool glSharing)
+{
+	cl_int error = 0;
+
+#ifdef UTIL_GL_SHARING
+	if(glSharing)
+	{
+		// Define OS-specific context properties and create the OpenCL context
+#if defined (__APPLE__)
+		CGLContextObj kCGLContext = CGLGetCurrentContext();
+		CGLShareGroupObj kCGLShareGroup = CGLGetShareGroup(kCGLContext);
+		if( kCGLContext == NULL)
+			printf("CGLGetCurrentContext() returned NULL\n");
+		if( kCGLShareGroup == NULL)
+			printf("CGLGetShareGroup(kCGLContext) returned NULL\n");
+		cl_context_properties props[] = 
+		{
+			CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE, (cl_context_properties)kCGLShareGroup, 
+			0 
+		};
+		*context = clCreateContext(props, 0,0, NULL, NULL, &error);
+#else
+#ifdef UNIX
+		GLXContext glxContext = glXGetCurrentContext();
+		Display* display = glXGetCurrentDisplay();
+		if(glxContext == NULL)
+			printf("glXGetCurrentContext() returned NULL\n");
+		if(display == NULL)
+			printf("glXGetCurrentDisplay() returned NULL\n");
+		cl_context_properties props[] = 
+		{
+			CL_GL_CONTEXT_KHR, (cl_context_properties)glxContext, 
+			CL_GLX_DISPLAY_KHR, (cl_context_properties)display, 
+			CL_CONTEXT_PLATFORM, (cl_context_properties)platformId, 
+			0
+		};
+		*context = clCreateContext(props, 1, &deviceId, NULL, NULL, &error);
+#else // Win32
+		HGLRC wglContext = wglGetCurrentContext();
+		HDC wglDC = wglGetCurrentDC();
+		if(wglContext == NULL)
+			printf("wglGetCurrentContext() returned NULL\n");
+		if(wglDC == NULL)
+			printf("wglGetCurrentDC() returned NULL\n");
+		cl_context_properties props[] = 
+		{
+			CL_GL_CONTEXT_KHR, (cl_context_properties)wglContext, 
+			CL_WGL_HDC_KHR, (cl_context_properties)wglDC, 
+			CL_CONTEXT_PLATFORM, (cl_context_properties)platformId, 
+			0
+		};
+
+		*context = clCreateContext(props, 1, &deviceId, NULL, NULL, &error);
+#endif
 #endif
+		if(error != CL_SUCCESS)
+		{
+			printf("Failed to create shared gl-cl context with error code %d (%s)\n", error, oclErrorString(error));
+			return false;
+		}
+
+		return true;
+	}
 #endif
 
-#else
 	*context = clCreateContext(NULL, 1, &deviceId, NULL, NULL, &error);
 	if(error != CL_SUCCESS)
 	{
 		printf("Failed to create cl context with error code %d (%s)\n", error, oclErrorString(error));
 		return false;
 	}
-#endif
 	return true;
 }
 
 // Helper function to get error string
 // *********************************************************************
+unsigned long long oclProgramCacheKey(cl_device_id deviceId, const char* file, const char* options,
+	const char* source, size_t length, std::string& cacheFile)
+{
+	char deviceName[1024] = "", driverVersion[1024] = "", name[32];
+	clGetDeviceInfo(deviceId, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+	clGetDeviceInfo(deviceId, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL);
+
+	unsigned long long fileHash = hash_fnv1a(deviceName, strlen(deviceName));
+	fileHash = hash_fnv1a(options, strlen(options), fileHash);
+	sprintf(name, ".%016llx.bin", fileHash);
+	cacheFile = std::string(file) + name;
+
+	unsigned long long key = hash_fnv1a(source, length, fileHash);
+	return hash_fnv1a(driverVersion, strlen(driverVersion), key);
+}
+
+struct ProgramCacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned long long key;
+	unsigned long long size;
+};
+
+cl_program oclLoadProgramBinary(cl_context context, cl_device_id deviceId, const char* cacheFile, unsigned long long key)
+{
+	cl_int error, status;
+	size_t length;
+	char* data = read_binary_file(cacheFile, &length);
+	if(!data)
+		return 0;
+
+	ProgramCacheHeader* header = (ProgramCacheHeader*)data;
+	if(length < sizeof(ProgramCacheHeader) || memcmp(header->magic, "PCLB", 4) != 0 ||
+		header->version != 1 || header->key != key || header->size != length - sizeof(ProgramCacheHeader))
+	{
+		printf("Program cache \"%s\" is stale.\n", cacheFile);
+		free(data);
+		remove(cacheFile);
+		return 0;
+	}
+
+	printf("Loading program binary from \"%s\"...\n", cacheFile);
+	size_t size = (size_t)header->size;
+	const unsigned char* binary = (const unsigned char*)(data + sizeof(ProgramCacheHeader));
+	cl_program program = clCreateProgramWithBinary(context, 1, &deviceId, &size, &binary, &status, &error);
+	free(data);
+	if(error != CL_SUCCESS || status != CL_SUCCESS)
+	{
+		printf("Cached program binary rejected, rebuilding from source.\n");
+		if(error == CL_SUCCESS)
+			clReleaseProgram(program);
+		remove(cacheFile);
+		return 0;
+	}
+	return program;
+}
+
+bool oclSaveProgramBinary(cl_program program, const char* cacheFile, unsigned long long key)
+{
+	cl_int error;
+	size_t size;
+
+	error = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL);
+	if(error != CL_SUCCESS || size == 0)
+	{
+		printf("Program binary not available, not caching.\n");
+		return false;
+	}
+
+	char* data = (char*)malloc(sizeof(ProgramCacheHeader) + size);
+	ProgramCacheHeader* header = (ProgramCacheHeader*)data;
+	memcpy(header->magic, "PCLB", 4);
+	header->version = 1;
+	header->key = key;
+	header->size = size;
+
+	unsigned char* binary = (unsigned char*)(data + sizeof(ProgramCacheHeader));
+	error = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary, NULL);
+	bool saved = error == CL_SUCCESS && write_file(cacheFile, data, sizeof(ProgramCacheHeader) + size);
+	free(data);
+
+	if(saved)
+		printf("Saved program binary to \"%s\"\n", cacheFile);
+	else
+		printf("Failed to save program binary to \"%s\"\n", cacheFile);
+	return saved;
+}
+
 const char* oclErrorString(cl_int error)
 {
 	static const char* errorString[] = {
@@ -2,19 +2,54 @@
 #define UTIL_H
 
 char *read_file(const char *filename, int *length);
+char *read_binary_file(const char *filename, size_t *length);
+// Read only view of a whole file, released with unmap_file().
+const void *map_file(const char *filename, size_t *length);
+void unmap_file(const void *data, size_t length);
+bool write_file(const char *filename, const void *data, size_t length);
+unsigned long long hash_fnv1a(const void *data, size_t length, unsigned long long hash = 14695981039346656037ULL);
+void *aligned_malloc(size_t size, size_t alignment);
+void aligned_free(void *buffer);
+double get_time();
+unsigned short float_to_half(float value);
 
 #ifdef UTIL_GL_SHARING
 #include "opengl.h"
-GLuint oglCreateVBO(const void* data, int dataSize, GLenum target, GLenum usage);
+// GL_BUFFER_SIZE is a GLint, so buffers past INT_MAX bytes are refused.
+GLuint oglCreateVBO(const void* data, GLsizeiptr dataSize, GLenum target, GLenum usage);
 #endif
 
+// OpenCL helpers, only declared after the CL headers so code without
+// OpenCL (the CPU backend) can include this without them.
+#ifdef __OPENCL_CL_H
+#include <string>
+
 bool oclGetNVIDIAPlatform(cl_platform_id* clSelectedPlatformID);
+bool oclGetPlatformByIndex(cl_platform_id* platformId, int index);
+bool oclGetDeviceByIndex(cl_device_id* deviceId , cl_platform_id platformId, int index);
 bool oclGetSomeGPUDevice(cl_device_id* deviceId , cl_platform_id platformId);
-bool oclCreateSomeContext(cl_context* context , cl_device_id deviceId,cl_platform_id platformId);
+bool oclGetSomeDevice(cl_device_id* deviceId , cl_platform_id platformId);
+bool oclDeviceHasExtension(cl_device_id deviceId, const char* extension);
+// Partitions deviceId with clCreateSubDevices (OpenCL 1.2) by the zero
+// terminated properties and returns the first sub-device.
+bool oclCreateSubDevice(cl_device_id* subDevice, cl_device_id deviceId, const intptr_t* properties);
+void oclReleaseSubDevice(cl_device_id subDevice);
+bool oclCreateSomeContext(cl_context* context , cl_device_id deviceId,cl_platform_id platformId, bool glSharing);
+
+// Program binary cache: one file per source, device and build options,
+// named by oclProgramCacheKey(). The key stored inside also covers the
+// source text and driver version so any change invalidates it.
+unsigned long long oclProgramCacheKey(cl_device_id deviceId, const char* file, const char* options,
+	const char* source, size_t length, std::string& cacheFile);
+// The program of a cached binary, still to be built with the options it
+// was cached for, or 0. Stale files are removed.
+cl_program oclLoadProgramBinary(cl_context context, cl_device_id deviceId, const char* cacheFile, unsigned long long key);
+bool oclSaveProgramBinary(cl_program program, const char* cacheFile, unsigned long long key);
 
 const char* oclErrorString(cl_int error);
 void oclPrintPlatformInfo(cl_platform_id id);
 void oclPrintDeviceInfo(cl_device_id device);
+#endif
 
 
 #endif